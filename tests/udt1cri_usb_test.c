@@ -0,0 +1,483 @@
+/* KUnit tests of the udt1cri_usb RX parser, TX encoder and context ring
+ *
+ * Copyright (C) 2018 UniSwarm
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; version 2 of the License.
+ *
+ * They call the helpers of udt1cri_codec.h and udt1cri_ring.h the driver
+ * uses, and need neither USB nor an adapter.
+ */
+
+#include <kunit/test.h>
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/module.h>
+
+#include "../udt1cri_codec.h"
+#include "../udt1cri_ring.h"
+
+/* Bulk IN transfers of the default size */
+#define UDT1CRI_TEST_XFER_SIZE 512
+#define UDT1CRI_TEST_BENCH_LOOPS 10000
+#define UDT1CRI_TEST_RING_LOOPS 1000000
+
+/* Context counts of ethtool -G, rounded up to a power of 2 as the driver
+ * does: 20 for the former default, the default and 256.
+ */
+static const unsigned int udt1cri_test_ring_cnts[] = { 20, 64, 256 };
+
+static void udt1cri_test_fill_can(struct udt1cri_usb_msg_can *msg, u32 eid,
+				  u8 flags, u8 dlc)
+{
+	unsigned int i;
+
+	memset(msg, 0, sizeof(*msg));
+	msg->cmd_id = UDT1CRI_CMD_RECEIVE_MESSAGE;
+	msg->eid = __cpu_to_le32(eid);
+	msg->flags = flags;
+	msg->dlc = dlc;
+	for (i = 0; i < sizeof(msg->data); i++)
+		msg->data[i] = i + 1;
+}
+
+static void udt1cri_test_fill_canfd(struct udt1cri_usb_msg_canfd *msg,
+				    u32 eid, u8 flags, u8 dlc)
+{
+	unsigned int i;
+
+	memset(msg, 0, sizeof(*msg));
+	msg->cmd_id = UDT1CRI_CMD_RECEIVE_MESSAGE;
+	msg->eid = __cpu_to_le32(eid);
+	msg->flags = FLAG_CAN_FDF | flags;
+	msg->dlc = dlc;
+	for (i = 0; i < sizeof(msg->data); i++)
+		msg->data[i] = i + 1;
+}
+
+/* 2 FD messages then 18 classic ones fill a transfer exactly */
+static unsigned int udt1cri_test_fill_xfer(u8 *buf, bool fd)
+{
+	unsigned int pos = 0, i;
+
+	memset(buf, 0, UDT1CRI_TEST_XFER_SIZE);
+
+	for (i = 0; fd && i < 2; i++) {
+		udt1cri_test_fill_canfd((struct udt1cri_usb_msg_canfd *)
+						(buf + pos),
+					0x100 + i, FLAG_CAN_BRS, 15);
+		pos += UDT1CRI_USB_FD_MSG_SIZE;
+	}
+
+	while (pos + UDT1CRI_USB_MSG_SIZE <= UDT1CRI_TEST_XFER_SIZE) {
+		udt1cri_test_fill_can((struct udt1cri_usb_msg_can *)(buf + pos),
+				      0x200 + pos, 0, 8);
+		pos += UDT1CRI_USB_MSG_SIZE;
+	}
+
+	return pos;
+}
+
+static void udt1cri_test_msg_len(struct kunit *test)
+{
+	struct udt1cri_usb_msg_canfd fd_msg;
+	struct udt1cri_usb_msg_can msg;
+	u8 *buf;
+
+	udt1cri_test_fill_can(&msg, 0x123, 0, 8);
+	KUNIT_EXPECT_EQ(test, udt1cri_usb_msg_len((u8 *)&msg, sizeof(msg),
+						  false),
+			(unsigned int)UDT1CRI_USB_MSG_SIZE);
+	KUNIT_EXPECT_EQ(test, udt1cri_usb_msg_len((u8 *)&msg,
+						  UDT1CRI_USB_MSG_SIZE - 1,
+						  false),
+			0U);
+
+	/* FDF only makes a long message on UDT1FR-I */
+	udt1cri_test_fill_canfd(&fd_msg, 0x123, 0, 15);
+	KUNIT_EXPECT_EQ(test, udt1cri_usb_msg_len((u8 *)&fd_msg,
+						  sizeof(fd_msg), true),
+			(unsigned int)UDT1CRI_USB_FD_MSG_SIZE);
+	KUNIT_EXPECT_EQ(test, udt1cri_usb_msg_len((u8 *)&fd_msg,
+						  sizeof(fd_msg), false),
+			(unsigned int)UDT1CRI_USB_MSG_SIZE);
+	KUNIT_EXPECT_EQ(test, udt1cri_usb_msg_len((u8 *)&fd_msg,
+						  UDT1CRI_USB_FD_MSG_SIZE - 1,
+						  true),
+			0U);
+
+	/* Transmission responses keep the short format */
+	fd_msg.cmd_id = UDT1CRI_CMD_TRANSMIT_MESSAGE_RSP;
+	KUNIT_EXPECT_EQ(test, udt1cri_usb_msg_len((u8 *)&fd_msg,
+						  sizeof(fd_msg), true),
+			(unsigned int)UDT1CRI_USB_MSG_SIZE);
+
+	buf = kunit_kzalloc(test, UDT1CRI_TEST_XFER_SIZE, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, buf);
+	KUNIT_EXPECT_EQ(test, udt1cri_usb_msg_len(buf, 0, false), 0U);
+}
+
+/* Split a transfer as udt1cri_usb_read_bulk_callback() does, return the
+ * bytes parsed
+ */
+static unsigned int udt1cri_test_split(u8 *buf, unsigned int len, bool fd,
+				       unsigned int *nmsgs, bool *truncated)
+{
+	struct udt1cri_usb_split split;
+
+	*nmsgs = 0;
+	udt1cri_usb_split_init(&split, buf, len, fd);
+	while (udt1cri_usb_split_next(&split))
+		(*nmsgs)++;
+	*truncated = udt1cri_usb_split_truncated(&split);
+
+	return split.pos;
+}
+
+static void udt1cri_test_packed_xfer(struct kunit *test)
+{
+	unsigned int len, nmsgs;
+	bool truncated;
+	u8 *buf;
+
+	buf = kunit_kzalloc(test, UDT1CRI_TEST_XFER_SIZE, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, buf);
+
+	len = udt1cri_test_fill_xfer(buf, true);
+	KUNIT_ASSERT_EQ(test, len, UDT1CRI_TEST_XFER_SIZE);
+	KUNIT_EXPECT_EQ(test,
+			udt1cri_test_split(buf, len, true, &nmsgs, &truncated),
+			len);
+	KUNIT_EXPECT_EQ(test, nmsgs, 20U);
+	KUNIT_EXPECT_FALSE(test, truncated);
+}
+
+static void udt1cri_test_truncated_xfer(struct kunit *test)
+{
+	unsigned int len, nmsgs;
+	bool truncated;
+	u8 *buf;
+
+	buf = kunit_kzalloc(test, UDT1CRI_TEST_XFER_SIZE, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, buf);
+
+	/* 25 messages, then 12 bytes of a 26th */
+	len = udt1cri_test_fill_xfer(buf, false);
+	KUNIT_ASSERT_EQ(test, len, 25 * UDT1CRI_USB_MSG_SIZE);
+	udt1cri_test_fill_can((struct udt1cri_usb_msg_can *)(buf + len), 0x7ff,
+			      0, 8);
+	KUNIT_EXPECT_EQ(test,
+			udt1cri_test_split(buf, UDT1CRI_TEST_XFER_SIZE, false,
+					   &nmsgs, &truncated),
+			len);
+	KUNIT_EXPECT_EQ(test, nmsgs, 25U);
+	KUNIT_EXPECT_TRUE(test, truncated);
+
+	/* A FD message cut short ends the transfer too */
+	len = udt1cri_test_fill_xfer(buf, true);
+	KUNIT_EXPECT_EQ(test,
+			udt1cri_test_split(buf, UDT1CRI_USB_FD_MSG_SIZE + 40,
+					   true, &nmsgs, &truncated),
+			(unsigned int)UDT1CRI_USB_FD_MSG_SIZE);
+	KUNIT_EXPECT_EQ(test, nmsgs, 1U);
+	KUNIT_EXPECT_TRUE(test, truncated);
+}
+
+static void udt1cri_test_decode_flags(struct kunit *test)
+{
+	struct udt1cri_usb_msg_can msg;
+	struct canfd_frame cfd;
+
+	udt1cri_test_fill_can(&msg, 0x1abcdef, FLAG_CAN_EID, 4);
+	memset(&cfd, 0, sizeof(cfd));
+	udt1cri_usb_decode_can(&msg, false, &cfd);
+	KUNIT_EXPECT_EQ(test, cfd.can_id, 0x1abcdef | CAN_EFF_FLAG);
+	KUNIT_EXPECT_EQ(test, cfd.len, 4);
+	KUNIT_EXPECT_EQ(test, memcmp(cfd.data, msg.data, 4), 0);
+
+	udt1cri_test_fill_can(&msg, 0x123, FLAG_CAN_RTR, 2);
+	memset(&cfd, 0, sizeof(cfd));
+	udt1cri_usb_decode_can(&msg, false, &cfd);
+	KUNIT_EXPECT_EQ(test, cfd.can_id, 0x123 | CAN_RTR_FLAG);
+
+	udt1cri_test_fill_can(&msg, 0x1abcdef, FLAG_CAN_EID | FLAG_CAN_RTR, 0);
+	memset(&cfd, 0, sizeof(cfd));
+	udt1cri_usb_decode_can(&msg, false, &cfd);
+	KUNIT_EXPECT_EQ(test, cfd.can_id,
+			0x1abcdef | CAN_EFF_FLAG | CAN_RTR_FLAG);
+	KUNIT_EXPECT_EQ(test, cfd.len, 0);
+}
+
+static void udt1cri_test_decode_dlc(struct kunit *test)
+{
+	struct udt1cri_usb_msg_canfd fd_msg;
+	struct udt1cri_usb_msg_can msg;
+	struct canfd_frame cfd;
+
+	/* DLC 9 to 15 mean 8 bytes on a classic frame */
+	udt1cri_test_fill_can(&msg, 0x123, 0, 9);
+	memset(&cfd, 0, sizeof(cfd));
+	udt1cri_usb_decode_can(&msg, false, &cfd);
+	KUNIT_EXPECT_EQ(test, cfd.len, CAN_MAX_DLEN);
+
+	/* Only the low 4 bits are the DLC */
+	udt1cri_test_fill_can(&msg, 0x123, 0, 0x13);
+	memset(&cfd, 0, sizeof(cfd));
+	udt1cri_usb_decode_can(&msg, false, &cfd);
+	KUNIT_EXPECT_EQ(test, cfd.len, 3);
+
+	udt1cri_test_fill_canfd(&fd_msg, 0x123, FLAG_CAN_BRS | FLAG_CAN_ESI, 9);
+	memset(&cfd, 0, sizeof(cfd));
+	udt1cri_usb_decode_can((struct udt1cri_usb_msg_can *)&fd_msg, true,
+			       &cfd);
+	KUNIT_EXPECT_EQ(test, cfd.len, 12);
+	KUNIT_EXPECT_EQ(test, cfd.flags, CANFD_BRS | CANFD_ESI);
+	KUNIT_EXPECT_EQ(test, memcmp(cfd.data, fd_msg.data, 12), 0);
+
+	udt1cri_test_fill_canfd(&fd_msg, 0x123, 0, 0x1f);
+	memset(&cfd, 0, sizeof(cfd));
+	udt1cri_usb_decode_can((struct udt1cri_usb_msg_can *)&fd_msg, true,
+			       &cfd);
+	KUNIT_EXPECT_EQ(test, cfd.len, CANFD_MAX_DLEN);
+}
+
+static void udt1cri_test_encode(struct kunit *test)
+{
+	struct udt1cri_usb_msg_canfd msg;
+	struct canfd_frame cfd = {
+		.can_id = 0x1abcdef | CAN_EFF_FLAG,
+		.len = 8,
+		.data = { 1, 2, 3, 4, 5, 6, 7, 8 },
+	};
+
+	memset(&msg, 0, sizeof(msg));
+	KUNIT_EXPECT_EQ(test, udt1cri_usb_encode_can(&cfd, false, &msg),
+			(unsigned int)UDT1CRI_USB_MSG_SIZE);
+	KUNIT_EXPECT_EQ(test, msg.cmd_id, UDT1CRI_CMD_TRANSMIT_MESSAGE_EV);
+	KUNIT_EXPECT_EQ(test, msg.flags, FLAG_CAN_EID);
+	KUNIT_EXPECT_EQ(test, msg.dlc, 8);
+	KUNIT_EXPECT_EQ(test, __le32_to_cpu(msg.eid), cfd.can_id);
+	KUNIT_EXPECT_EQ(test, memcmp(msg.data, cfd.data, 8), 0);
+
+	cfd.can_id = 0x123 | CAN_RTR_FLAG;
+	cfd.len = 0;
+	memset(&msg, 0, sizeof(msg));
+	udt1cri_usb_encode_can(&cfd, false, &msg);
+	KUNIT_EXPECT_EQ(test, msg.flags, FLAG_CAN_RTR);
+	KUNIT_EXPECT_EQ(test, msg.dlc, 0);
+
+	cfd.can_id = 0x123;
+	cfd.len = 12;
+	cfd.flags = CANFD_BRS;
+	memset(&msg, 0, sizeof(msg));
+	KUNIT_EXPECT_EQ(test, udt1cri_usb_encode_can(&cfd, true, &msg),
+			(unsigned int)UDT1CRI_USB_FD_MSG_SIZE);
+	KUNIT_EXPECT_EQ(test, msg.flags, FLAG_CAN_FDF | FLAG_CAN_BRS);
+	KUNIT_EXPECT_EQ(test, msg.dlc, 9);
+}
+
+/* Encoding then decoding gives the frame back */
+static void udt1cri_test_round_trip(struct kunit *test)
+{
+	struct udt1cri_usb_msg_canfd msg;
+	struct canfd_frame in = {
+		.can_id = 0x18fe0001 | CAN_EFF_FLAG,
+		.len = 64,
+		.flags = CANFD_BRS,
+	}, out;
+	unsigned int i;
+
+	for (i = 0; i < in.len; i++)
+		in.data[i] = i * 3;
+
+	memset(&msg, 0, sizeof(msg));
+	udt1cri_usb_encode_can(&in, true, &msg);
+	msg.cmd_id = UDT1CRI_CMD_RECEIVE_MESSAGE;
+
+	memset(&out, 0, sizeof(out));
+	udt1cri_usb_decode_can((struct udt1cri_usb_msg_can *)&msg, true, &out);
+	KUNIT_EXPECT_EQ(test, out.can_id, in.can_id);
+	KUNIT_EXPECT_EQ(test, out.len, in.len);
+	KUNIT_EXPECT_EQ(test, out.flags, in.flags);
+	KUNIT_EXPECT_EQ(test, memcmp(out.data, in.data, in.len), 0);
+}
+
+/* Time the split and decoding of a packed transfer, per frame */
+static void udt1cri_test_bench_decode(struct kunit *test, bool fd)
+{
+	struct udt1cri_usb_split split;
+	unsigned int len, frames = 0, i;
+	struct canfd_frame *cfd;
+	u64 start, ns;
+	u8 *buf, *msg;
+
+	buf = kunit_kzalloc(test, UDT1CRI_TEST_XFER_SIZE, GFP_KERNEL);
+	cfd = kunit_kzalloc(test, sizeof(*cfd), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, buf);
+	KUNIT_ASSERT_NOT_NULL(test, cfd);
+
+	len = udt1cri_test_fill_xfer(buf, fd);
+
+	start = ktime_get_ns();
+	for (i = 0; i < UDT1CRI_TEST_BENCH_LOOPS; i++) {
+		udt1cri_usb_split_init(&split, buf, len, fd);
+		while ((msg = udt1cri_usb_split_next(&split))) {
+			const struct udt1cri_usb_msg_can *can_msg =
+				(const struct udt1cri_usb_msg_can *)msg;
+
+			memset(cfd, 0, sizeof(*cfd));
+			udt1cri_usb_decode_can(can_msg, fd, cfd);
+			frames++;
+		}
+	}
+	ns = ktime_get_ns() - start;
+
+	KUNIT_EXPECT_EQ(test, frames,
+			UDT1CRI_TEST_BENCH_LOOPS * (fd ? 20U : 25U));
+	kunit_info(test, "decode %s: %llu ns/frame\n", fd ? "fd" : "classic",
+		   div_u64(ns, frames));
+}
+
+static void udt1cri_test_bench_decode_classic(struct kunit *test)
+{
+	udt1cri_test_bench_decode(test, false);
+}
+
+static void udt1cri_test_bench_decode_fd(struct kunit *test)
+{
+	udt1cri_test_bench_decode(test, true);
+}
+
+static void udt1cri_test_bench_encode(struct kunit *test, bool fd)
+{
+	const unsigned int frames = UDT1CRI_TEST_BENCH_LOOPS * 25;
+	struct udt1cri_usb_msg_canfd *msg;
+	struct canfd_frame *cfd;
+	unsigned int i, len = 0;
+	u64 start, ns;
+
+	msg = kunit_kzalloc(test, sizeof(*msg), GFP_KERNEL);
+	cfd = kunit_kzalloc(test, sizeof(*cfd), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, msg);
+	KUNIT_ASSERT_NOT_NULL(test, cfd);
+
+	cfd->len = fd ? CANFD_MAX_DLEN : CAN_MAX_DLEN;
+	memset(cfd->data, 0x55, cfd->len);
+
+	start = ktime_get_ns();
+	for (i = 0; i < frames; i++) {
+		cfd->can_id = i & CAN_SFF_MASK;
+		len += udt1cri_usb_encode_can(cfd, fd, msg);
+	}
+	ns = ktime_get_ns() - start;
+
+	KUNIT_EXPECT_EQ(test, len,
+			frames * (fd ? UDT1CRI_USB_FD_MSG_SIZE :
+				       UDT1CRI_USB_MSG_SIZE));
+	kunit_info(test, "encode %s: %llu ns/frame\n", fd ? "fd" : "classic",
+		   div_u64(ns, frames));
+}
+
+static void udt1cri_test_bench_encode_classic(struct kunit *test)
+{
+	udt1cri_test_bench_encode(test, false);
+}
+
+static void udt1cri_test_bench_encode_fd(struct kunit *test)
+{
+	udt1cri_test_bench_encode(test, true);
+}
+
+/* The free running indexes keep working as they wrap around */
+static void udt1cri_test_ring_wrap(struct kunit *test)
+{
+	unsigned int head = UINT_MAX - 2, tail = UINT_MAX - 2;
+	const unsigned int cnt = 8;
+	unsigned int i;
+
+	KUNIT_EXPECT_EQ(test, udt1cri_ring_free(head, &tail, cnt), cnt);
+
+	for (i = 0; i < cnt; i++)
+		head++;
+	KUNIT_EXPECT_EQ(test, udt1cri_ring_free(head, &tail, cnt), 0U);
+	KUNIT_EXPECT_EQ(test, udt1cri_ring_slot(head, cnt),
+			udt1cri_ring_slot(tail, cnt));
+
+	udt1cri_ring_release(&tail);
+	KUNIT_EXPECT_EQ(test, udt1cri_ring_free(head, &tail, cnt), 1U);
+	KUNIT_EXPECT_TRUE(test, udt1cri_ring_released(UINT_MAX - 2, tail));
+	KUNIT_EXPECT_FALSE(test, udt1cri_ring_released(UINT_MAX - 1, tail));
+	KUNIT_EXPECT_FALSE(test, udt1cri_ring_released(head - 1, tail));
+
+	while (tail != head)
+		udt1cri_ring_release(&tail);
+	KUNIT_EXPECT_EQ(test, udt1cri_ring_free(head, &tail, cnt), cnt);
+	KUNIT_EXPECT_TRUE(test, udt1cri_ring_released(head - 1, tail));
+}
+
+/* Time the claim and release of a context with all but one in flight, as
+ * on a busy bus, where every claim follows the release of the oldest
+ * context by a transmission response. Claims read their context, which
+ * counts as one.
+ */
+static void udt1cri_test_bench_ring(struct kunit *test)
+{
+	unsigned int c, i;
+
+	for (c = 0; c < ARRAY_SIZE(udt1cri_test_ring_cnts); c++) {
+		unsigned int cnt, head = 0, tail = 0, claimed = 0, *ctx;
+		u64 start, ns;
+
+		cnt = roundup_pow_of_two(udt1cri_test_ring_cnts[c]);
+		ctx = kunit_kzalloc(test, cnt * sizeof(*ctx), GFP_KERNEL);
+		KUNIT_ASSERT_NOT_NULL(test, ctx);
+		for (i = 0; i < cnt; i++)
+			ctx[i] = 1;
+
+		while (udt1cri_ring_free(head, &tail, cnt) > 1)
+			claimed += ctx[udt1cri_ring_slot(head++, cnt)];
+
+		start = ktime_get_ns();
+		for (i = 0; i < UDT1CRI_TEST_RING_LOOPS; i++) {
+			udt1cri_ring_release(&tail);
+			if (udt1cri_ring_free(head, &tail, cnt))
+				claimed += ctx[udt1cri_ring_slot(head++, cnt)];
+		}
+		ns = ktime_get_ns() - start;
+
+		KUNIT_EXPECT_EQ(test, claimed,
+				cnt - 1 + UDT1CRI_TEST_RING_LOOPS);
+		kunit_info(test, "ring %u: %llu ps/context\n", cnt,
+			   div_u64(ns * 1000, UDT1CRI_TEST_RING_LOOPS));
+	}
+}
+
+static struct kunit_case udt1cri_usb_test_cases[] = {
+	KUNIT_CASE(udt1cri_test_msg_len),
+	KUNIT_CASE(udt1cri_test_packed_xfer),
+	KUNIT_CASE(udt1cri_test_truncated_xfer),
+	KUNIT_CASE(udt1cri_test_decode_flags),
+	KUNIT_CASE(udt1cri_test_decode_dlc),
+	KUNIT_CASE(udt1cri_test_encode),
+	KUNIT_CASE(udt1cri_test_round_trip),
+	KUNIT_CASE(udt1cri_test_ring_wrap),
+	KUNIT_CASE(udt1cri_test_bench_decode_classic),
+	KUNIT_CASE(udt1cri_test_bench_decode_fd),
+	KUNIT_CASE(udt1cri_test_bench_encode_classic),
+	KUNIT_CASE(udt1cri_test_bench_encode_fd),
+	KUNIT_CASE(udt1cri_test_bench_ring),
+	{}
+};
+
+static struct kunit_suite udt1cri_usb_test_suite = {
+	.name = "udt1cri_usb",
+	.test_cases = udt1cri_usb_test_cases,
+};
+
+kunit_test_suite(udt1cri_usb_test_suite);
+
+MODULE_DESCRIPTION("KUnit tests of the udt1cri_usb codec and context ring");
+MODULE_LICENSE("GPL v2");
@@ -0,0 +1,689 @@
+/* Userspace access to the UniSwarm UDT1CRI CAN debugger through libusb
+ *
+ * Copyright (C) 2018 UniSwarm
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; version 2 of the License.
+ */
+
+#include "libudt1cri.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <libusb.h>
+
+#include "udt1cri_proto.h"
+#include "udt1cri_spsc.hpp"
+
+namespace udt1cri {
+
+namespace {
+
+constexpr unsigned int TX_TIMEOUT_MS = 1000;
+constexpr unsigned int EVENT_WAIT_US = 100000;
+constexpr size_t MAX_MSGS = UDT1CRI_USB_BUFF_SIZE / UDT1CRI_USB_MSG_SIZE;
+
+constexpr uint8_t FD_DLC_LEN[16] = { 0,	 1,  2,	 3,  4,	 5,  6,	 7,
+				     8,	 12, 16, 20, 24, 32, 48, 64 };
+
+uint8_t fd_len_to_dlc(uint8_t len)
+{
+	uint8_t dlc = 0;
+
+	while (dlc < 15 && FD_DLC_LEN[dlc] < len)
+		dlc++;
+
+	return dlc;
+}
+
+using cmd_msg = std::array<uint8_t, UDT1CRI_USB_MSG_SIZE>;
+
+struct inflight_frame {
+	frame f;
+	bool dropped; /* its transfer failed, no confirmation will come */
+};
+
+} /* namespace */
+
+error::error(const std::string &what, int code)
+	: std::runtime_error(what + ": " + libusb_error_name(code)), code_(code)
+{
+}
+
+struct device::impl {
+	/* Bulk OUT transfer and the frames it carries */
+	struct tx_slot {
+		impl *d;
+		libusb_transfer *xfer;
+		size_t first; /* inflight sequence of its first frame */
+		size_t frames;
+	};
+
+	explicit impl(const options &o)
+		: opts(o), rx_ring(o.rx_ring), tx_ring(o.tx_ring),
+		  inflight(std::max(o.tx_inflight, 1u))
+	{
+	}
+
+	~impl();
+
+	void start();
+	void open_device();
+	libusb_transfer *alloc_transfer(unsigned char ep,
+					libusb_transfer_cb_fn cb, void *data,
+					unsigned int timeout);
+	bool submit(libusb_transfer *xfer);
+	void run();
+
+	void decode(const uint8_t *buf, size_t len);
+	size_t msg_size(const frame &f) const;
+	size_t encode(const frame &f, uint8_t *buf) const;
+	void reap_dropped();
+	void drop_frames(tx_slot *slot);
+	size_t fill(tx_slot *slot);
+	void pump_tx();
+	void queue_cmd(const void *msg);
+
+	static void LIBUSB_CALL rx_done(libusb_transfer *xfer);
+	static void LIBUSB_CALL tx_done(libusb_transfer *xfer);
+
+	options opts;
+	libusb_context *ctx = nullptr;
+	libusb_device_handle *handle = nullptr;
+	bool claimed = false;
+	bool fd = false;
+
+	spsc_ring<frame> rx_ring;
+	spsc_ring<frame> tx_ring;
+
+	/* Event thread only */
+	std::vector<libusb_transfer *> rx_xfers;
+	std::vector<tx_slot> tx_slots;
+	std::vector<tx_slot *> tx_free;
+	unsigned int active = 0; /* transfers submitted */
+	/* frames sent and waiting for TRANSMIT_MESSAGE_RSP, in order, from
+	 * sequence inflight_head on
+	 */
+	std::vector<inflight_frame> inflight;
+	size_t inflight_head = 0;
+	size_t inflight_cnt = 0;
+	/* frame taken from tx_ring that did not fit in the last transfer */
+	frame carry;
+	bool carry_valid = false;
+
+	std::thread thread;
+	std::atomic<bool> stop{ false };
+	/* set while nothing is being sent, send() then wakes the thread up */
+	std::atomic<bool> tx_idle{ true };
+
+	std::mutex cmd_lock;
+	std::deque<cmd_msg> cmds;
+	std::atomic<bool> cmd_pending{ false };
+
+	mutable std::mutex stats_lock;
+	struct stats st = {};
+};
+
+device::impl::~impl()
+{
+	if (thread.joinable()) {
+		stop = true;
+		libusb_interrupt_event_handler(ctx);
+		thread.join();
+	} else if (active) {
+		/* Failed start, reap the transfers submitted so far */
+		stop = true;
+		run();
+	}
+
+	for (libusb_transfer *xfer : rx_xfers) {
+		delete[] xfer->buffer;
+		libusb_free_transfer(xfer);
+	}
+	for (tx_slot &slot : tx_slots) {
+		if (!slot.xfer)
+			continue;
+		delete[] slot.xfer->buffer;
+		libusb_free_transfer(slot.xfer);
+	}
+
+	if (claimed)
+		libusb_release_interface(handle, 0);
+	if (handle)
+		libusb_close(handle);
+	if (ctx)
+		libusb_exit(ctx);
+}
+
+void device::impl::open_device()
+{
+	libusb_device **list;
+	ssize_t n, i;
+
+	n = libusb_get_device_list(ctx, &list);
+	if (n < 0)
+		throw error("libusb_get_device_list", (int)n);
+
+	for (i = 0; i < n && !handle; i++) {
+		libusb_device_descriptor desc;
+
+		if (libusb_get_device_descriptor(list[i], &desc) ||
+		    desc.idVendor != UDT1CRI_VENDOR_ID ||
+		    desc.idProduct != UDT1CRI_PRODUCT_ID)
+			continue;
+		if (opts.bus >= 0 && libusb_get_bus_number(list[i]) != opts.bus)
+			continue;
+		if (opts.address >= 0 &&
+		    libusb_get_device_address(list[i]) != opts.address)
+			continue;
+
+		int err = libusb_open(list[i], &handle);
+		if (err) {
+			libusb_free_device_list(list, 1);
+			throw error("libusb_open", err);
+		}
+
+		unsigned char product[64] = {};
+		if (libusb_get_string_descriptor_ascii(handle, desc.iProduct,
+						       product,
+						       sizeof(product)) > 0)
+			fd = !strcmp((const char *)product,
+				     UDT1CRI_PRODUCT_FD);
+	}
+
+	libusb_free_device_list(list, 1);
+
+	if (!handle)
+		throw error("no " UDT1CRI_PRODUCT " device", LIBUSB_ERROR_NO_DEVICE);
+}
+
+libusb_transfer *device::impl::alloc_transfer(unsigned char ep,
+					       libusb_transfer_cb_fn cb,
+					       void *data, unsigned int timeout)
+{
+	libusb_transfer *xfer = libusb_alloc_transfer(0);
+
+	if (!xfer)
+		throw error("libusb_alloc_transfer", LIBUSB_ERROR_NO_MEM);
+
+	libusb_fill_bulk_transfer(xfer, handle, ep,
+				  new uint8_t[UDT1CRI_USB_BUFF_SIZE],
+				  UDT1CRI_USB_BUFF_SIZE, cb, data, timeout);
+
+	return xfer;
+}
+
+void device::impl::start()
+{
+	unsigned int i;
+	int err;
+
+	err = libusb_init(&ctx);
+	if (err)
+		throw error("libusb_init", err);
+
+	open_device();
+
+	/* The udt1cri_usb driver is bound again on release */
+	libusb_set_auto_detach_kernel_driver(handle, 1);
+	err = libusb_claim_interface(handle, 0);
+	if (err)
+		throw error("libusb_claim_interface", err);
+	claimed = true;
+
+	/* Sized once, the transfers point to their slot */
+	tx_slots.reserve(opts.tx_transfers);
+	for (i = 0; i < opts.tx_transfers; i++) {
+		tx_slots.push_back({ this, nullptr, 0, 0 });
+		tx_slots.back().xfer = alloc_transfer(UDT1CRI_USB_EP_OUT,
+						      tx_done, &tx_slots.back(),
+						      TX_TIMEOUT_MS);
+		tx_free.push_back(&tx_slots.back());
+	}
+
+	for (i = 0; i < opts.rx_transfers; i++) {
+		rx_xfers.push_back(
+			alloc_transfer(UDT1CRI_USB_EP_IN, rx_done, this, 0));
+		if (!submit(rx_xfers.back()))
+			throw error("libusb_submit_transfer", LIBUSB_ERROR_IO);
+	}
+
+	thread = std::thread(&impl::run, this);
+}
+
+bool device::impl::submit(libusb_transfer *xfer)
+{
+	int err = libusb_submit_transfer(xfer);
+
+	if (err) {
+		std::lock_guard<std::mutex> lock(stats_lock);
+
+		st.xfer_errors++;
+		if (err == LIBUSB_ERROR_NO_DEVICE)
+			stop = true;
+
+		return false;
+	}
+
+	active++;
+
+	return true;
+}
+
+/* Until stopped, then until all the transfers are cancelled */
+void device::impl::run()
+{
+	bool cancelled = false;
+
+	while (!stop || active) {
+		struct timeval tv = { 0, EVENT_WAIT_US };
+
+		if (stop && !cancelled) {
+			for (libusb_transfer *xfer : rx_xfers)
+				libusb_cancel_transfer(xfer);
+			for (tx_slot &slot : tx_slots)
+				libusb_cancel_transfer(slot.xfer);
+			cancelled = true;
+		}
+
+		libusb_handle_events_timeout_completed(ctx, &tv, nullptr);
+
+		if (!stop)
+			pump_tx();
+	}
+}
+
+/* Decode a received transfer, the frames and echoes go to rx_ring in one
+ * batch.
+ */
+void device::impl::decode(const uint8_t *buf, size_t len)
+{
+	frame batch[MAX_MSGS];
+	size_t n = 0, pushed, pos = 0;
+	uint64_t format_errors = 0, echoes = 0;
+	const udt1cri_usb_msg_ka_can *ka_can = nullptr;
+	const udt1cri_usb_msg_ka_usb *ka_usb = nullptr;
+
+	while (pos + UDT1CRI_USB_MSG_SIZE <= len) {
+		const auto *msg =
+			reinterpret_cast<const udt1cri_usb_msg_can *>(buf + pos);
+		const bool fdf = fd && (msg->flags & FLAG_CAN_FDF);
+		size_t msg_len = UDT1CRI_USB_MSG_SIZE;
+
+		if (msg->cmd_id == UDT1CRI_CMD_RECEIVE_MESSAGE && fdf)
+			msg_len = UDT1CRI_USB_FD_MSG_SIZE;
+		if (pos + msg_len > len) {
+			format_errors++;
+			break;
+		}
+		pos += msg_len;
+
+		switch (msg->cmd_id) {
+		case UDT1CRI_CMD_RECEIVE_MESSAGE: {
+			frame &f = batch[n++];
+			const uint8_t dlc = msg->dlc & UDT1CRI_DLC_MASK;
+
+			f.id = udt1cri_get_le32((const uint8_t *)&msg->eid);
+			f.flags = msg->flags & (FRAME_EFF | FRAME_RTR |
+						FRAME_FDF | FRAME_BRS |
+						FRAME_ESI);
+			if (!fdf)
+				f.flags &= ~FRAME_FDF;
+			f.timestamp = udt1cri_get_le32(
+				(const uint8_t *)&msg->timestamp);
+			f.len = fdf ? FD_DLC_LEN[dlc] : std::min<uint8_t>(dlc, 8);
+			memcpy(f.data, msg->data, f.len);
+			break;
+		}
+
+		case UDT1CRI_CMD_TRANSMIT_MESSAGE_RSP:
+			/* Confirmations come in the order frames were sent */
+			reap_dropped();
+			if (!inflight_cnt)
+				break;
+			batch[n] = inflight[inflight_head % inflight.size()].f;
+			batch[n].flags |= FRAME_ECHO;
+			batch[n].timestamp = udt1cri_get_le32(
+				(const uint8_t *)&msg->timestamp);
+			n++;
+			inflight_head++;
+			inflight_cnt--;
+			echoes++;
+			break;
+
+		case UDT1CRI_CMD_I_AM_ALIVE_FROM_CAN:
+			ka_can = reinterpret_cast<const udt1cri_usb_msg_ka_can *>(
+				msg);
+			break;
+
+		case UDT1CRI_CMD_I_AM_ALIVE_FROM_USB:
+			ka_usb = reinterpret_cast<const udt1cri_usb_msg_ka_usb *>(
+				msg);
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	pushed = rx_ring.push(batch, n);
+
+	std::lock_guard<std::mutex> lock(stats_lock);
+
+	st.rx_xfers++;
+	st.rx_frames += n - echoes;
+	st.tx_frames += echoes;
+	st.rx_overruns += n - pushed;
+	st.format_errors += format_errors;
+	if (ka_can) {
+		const uint8_t *rate = (const uint8_t *)&ka_can->can_bitrate;
+		const uint8_t *lost = (const uint8_t *)&ka_can->rx_lost;
+
+		st.bitrate_kbps = rate[0] << 8 | rate[1];
+		st.dev_rx_lost = lost[0] | lost[1] << 8;
+		st.tx_err_cnt = ka_can->tx_err_cnt;
+		st.rx_err_cnt = ka_can->rx_err_cnt;
+		st.bus_off = ka_can->tx_bus_off;
+	}
+	if (ka_usb)
+		st.termination = ka_usb->termination_state;
+}
+
+size_t device::impl::msg_size(const frame &f) const
+{
+	return fd && (f.flags & FRAME_FDF) ? UDT1CRI_USB_FD_MSG_SIZE :
+					     UDT1CRI_USB_MSG_SIZE;
+}
+
+size_t device::impl::encode(const frame &f, uint8_t *buf) const
+{
+	auto *msg = reinterpret_cast<udt1cri_usb_msg_can *>(buf);
+	const bool fdf = fd && (f.flags & FRAME_FDF);
+	const size_t size = msg_size(f);
+	const uint8_t len = std::min<uint8_t>(f.len, fdf ? 64 : 8);
+
+	memset(buf, 0, size);
+	msg->cmd_id = UDT1CRI_CMD_TRANSMIT_MESSAGE_EV;
+	udt1cri_put_le32((uint8_t *)&msg->eid, f.id);
+
+	if (fdf) {
+		msg->flags = f.flags & (FRAME_EFF | FRAME_FDF | FRAME_BRS);
+		msg->dlc = fd_len_to_dlc(len);
+	} else {
+		msg->flags = f.flags & (FRAME_EFF | FRAME_RTR);
+		msg->dlc = len;
+	}
+	memcpy(msg->data, f.data, len);
+
+	return size;
+}
+
+/* Forget the frames of failed transfers once they are the oldest */
+void device::impl::reap_dropped()
+{
+	while (inflight_cnt &&
+	       inflight[inflight_head % inflight.size()].dropped) {
+		inflight_head++;
+		inflight_cnt--;
+	}
+}
+
+/* The frames of a failed transfer will never be confirmed */
+void device::impl::drop_frames(tx_slot *slot)
+{
+	size_t i;
+
+	for (i = 0; i < slot->frames; i++)
+		inflight[(slot->first + i) % inflight.size()].dropped = true;
+
+	reap_dropped();
+}
+
+/* Fill a transfer with the pending commands, then with frames while the
+ * device may take more. Return its length.
+ */
+size_t device::impl::fill(tx_slot *slot)
+{
+	uint8_t *buf = slot->xfer->buffer;
+	size_t len = 0;
+
+	slot->first = inflight_head + inflight_cnt;
+	slot->frames = 0;
+
+	if (cmd_pending) {
+		std::lock_guard<std::mutex> lock(cmd_lock);
+
+		while (!cmds.empty() &&
+		       len + UDT1CRI_USB_MSG_SIZE <= UDT1CRI_USB_BUFF_SIZE) {
+			memcpy(buf + len, cmds.front().data(),
+			       UDT1CRI_USB_MSG_SIZE);
+			cmds.pop_front();
+			len += UDT1CRI_USB_MSG_SIZE;
+		}
+		cmd_pending = !cmds.empty();
+	}
+
+	while (inflight_cnt < inflight.size()) {
+		if (!carry_valid) {
+			if (!tx_ring.pop(&carry, 1))
+				break;
+			carry_valid = true;
+		}
+
+		if (len + msg_size(carry) > UDT1CRI_USB_BUFF_SIZE)
+			break;
+
+		len += encode(carry, buf + len);
+		inflight[(slot->first + slot->frames) % inflight.size()] = {
+			carry, false
+		};
+		inflight_cnt++;
+		slot->frames++;
+		carry_valid = false;
+	}
+
+	return len;
+}
+
+/* Submit transfers while there is something to send, then go idle if
+ * nothing is left in flight.
+ */
+void device::impl::pump_tx()
+{
+	for (;;) {
+		while (!stop && !tx_free.empty()) {
+			tx_slot *slot = tx_free.back();
+			size_t len = fill(slot);
+
+			if (!len)
+				break;
+
+			slot->xfer->length = len;
+			tx_free.pop_back();
+			if (!submit(slot->xfer)) {
+				drop_frames(slot);
+				tx_free.push_back(slot);
+				return;
+			}
+		}
+
+		/* Transfers in flight or confirmations to come pump again.
+		 * With all frames in flight awaiting confirmation, fill()
+		 * takes nothing from tx_ring: going idle would loop forever.
+		 */
+		if (tx_free.size() != tx_slots.size() || carry_valid ||
+		    cmd_pending || inflight_cnt == inflight.size())
+			return;
+
+		tx_idle = true;
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+
+		/* Frames queued before send() could see the flag */
+		if (tx_ring.empty() || !tx_idle.exchange(false))
+			return;
+	}
+}
+
+void LIBUSB_CALL device::impl::rx_done(libusb_transfer *xfer)
+{
+	impl *d = static_cast<impl *>(xfer->user_data);
+
+	d->active--;
+
+	switch (xfer->status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		d->decode(xfer->buffer, xfer->actual_length);
+		break;
+
+	case LIBUSB_TRANSFER_CANCELLED:
+		return;
+
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		d->stop = true;
+		return;
+
+	default: {
+		std::lock_guard<std::mutex> lock(d->stats_lock);
+
+		d->st.xfer_errors++;
+		break;
+	}
+	}
+
+	if (!d->stop)
+		d->submit(xfer);
+
+	/* Confirmations make room for more frames */
+	d->pump_tx();
+}
+
+void LIBUSB_CALL device::impl::tx_done(libusb_transfer *xfer)
+{
+	tx_slot *slot = static_cast<tx_slot *>(xfer->user_data);
+	impl *d = slot->d;
+
+	d->active--;
+	d->tx_free.push_back(slot);
+
+	switch (xfer->status) {
+	case LIBUSB_TRANSFER_COMPLETED: {
+		std::lock_guard<std::mutex> lock(d->stats_lock);
+
+		d->st.tx_xfers++;
+		break;
+	}
+
+	case LIBUSB_TRANSFER_CANCELLED:
+		return;
+
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		d->stop = true;
+		return;
+
+	default: {
+		std::lock_guard<std::mutex> lock(d->stats_lock);
+
+		d->st.xfer_errors++;
+		break;
+	}
+	}
+
+	if (xfer->status != LIBUSB_TRANSFER_COMPLETED)
+		d->drop_frames(slot);
+
+	d->pump_tx();
+}
+
+void device::impl::queue_cmd(const void *msg)
+{
+	cmd_msg cmd;
+
+	memcpy(cmd.data(), msg, cmd.size());
+
+	{
+		std::lock_guard<std::mutex> lock(cmd_lock);
+
+		cmds.push_back(cmd);
+		cmd_pending = true;
+	}
+
+	libusb_interrupt_event_handler(ctx);
+}
+
+device::device(const options &opts) : impl_(new impl(opts))
+{
+	impl_->start();
+}
+
+device::~device() = default;
+
+bool device::fd() const
+{
+	return impl_->fd;
+}
+
+size_t device::send(const frame *frames, size_t n)
+{
+	n = impl_->tx_ring.push(frames, n);
+
+	/* Pairs with the fence in pump_tx() */
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (n && impl_->tx_idle.exchange(false))
+		libusb_interrupt_event_handler(impl_->ctx);
+
+	return n;
+}
+
+size_t device::receive(frame *frames, size_t n)
+{
+	return impl_->rx_ring.pop(frames, n);
+}
+
+void device::set_bitrate(unsigned int kbps)
+{
+	udt1cri_usb_msg_change_bitrate msg = {};
+
+	msg.cmd_id = UDT1CRI_CMD_CHANGE_BIT_RATE;
+	((uint8_t *)&msg.bitrate)[0] = kbps >> 8;
+	((uint8_t *)&msg.bitrate)[1] = kbps;
+
+	impl_->queue_cmd(&msg);
+}
+
+void device::set_data_bitrate(unsigned int kbps)
+{
+	udt1cri_usb_msg_change_bitrate msg = {};
+
+	msg.cmd_id = UDT1CRI_CMD_CHANGE_DATA_BIT_RATE;
+	((uint8_t *)&msg.bitrate)[0] = kbps >> 8;
+	((uint8_t *)&msg.bitrate)[1] = kbps;
+
+	impl_->queue_cmd(&msg);
+}
+
+void device::set_termination(bool on)
+{
+	udt1cri_usb_msg_termination msg = {};
+
+	msg.cmd_id = UDT1CRI_CMD_SETUP_TERMINATION_RESISTANCE;
+	msg.termination = on;
+
+	impl_->queue_cmd(&msg);
+}
+
+struct stats device::stats() const
+{
+	std::lock_guard<std::mutex> lock(impl_->stats_lock);
+
+	return impl_->st;
+}
+
+} /* namespace udt1cri */
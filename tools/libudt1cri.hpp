@@ -0,0 +1,133 @@
+/* Userspace access to the UniSwarm UDT1CRI CAN debugger through libusb
+ *
+ * Copyright (C) 2018 UniSwarm
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; version 2 of the License.
+ *
+ * The device is claimed from the udt1cri_usb driver, which libusb binds
+ * again when it is released, and spoken to with the messages of
+ * udt1cri_proto.h. As in the driver, many bulk transfers are kept in
+ * flight in both directions.
+ *
+ * An event thread owns all the transfers. Received and confirmed frames
+ * reach the application through one ring, frames to send leave it through
+ * another. Both are lock-free single producer, single consumer rings, so
+ * receive() never makes a system call, and send() only makes one to wake
+ * the event thread up when nothing was being sent.
+ */
+
+#ifndef LIBUDT1CRI_HPP
+#define LIBUDT1CRI_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+namespace udt1cri {
+
+/* Frame flags, those of the USB messages and the echo flag */
+enum : uint8_t {
+	FRAME_EFF = 0x01,
+	FRAME_RTR = 0x02,
+	FRAME_FDF = 0x08,
+	FRAME_BRS = 0x10,
+	FRAME_ESI = 0x20,
+	/* a sent frame, handed back once the device put it on the bus */
+	FRAME_ECHO = 0x80,
+};
+
+struct frame {
+	uint32_t id; /* without flags */
+	uint8_t len; /* data bytes, up to 8 or 64 with FRAME_FDF */
+	uint8_t flags;
+	/* device time in microseconds, of the reception or, for an echo,
+	 * of the transmission
+	 */
+	uint32_t timestamp;
+	uint8_t data[64];
+};
+
+struct options {
+	/* first device found when both are negative */
+	int bus = -1;
+	int address = -1;
+	unsigned int rx_transfers = 16;
+	unsigned int tx_transfers = 8;
+	/* frames sent and not confirmed yet, as the driver's TX contexts */
+	unsigned int tx_inflight = 64;
+	size_t rx_ring = 1 << 16;
+	size_t tx_ring = 1 << 16;
+};
+
+struct stats {
+	uint64_t rx_frames;
+	uint64_t rx_overruns; /* frames lost to a full receive ring */
+	uint64_t rx_xfers;
+	uint64_t tx_frames; /* confirmed by the device */
+	uint64_t tx_xfers;
+	uint64_t format_errors;
+	uint64_t xfer_errors;
+	uint64_t dev_rx_lost; /* last count reported by the device */
+	uint16_t bitrate_kbps;
+	uint8_t tx_err_cnt;
+	uint8_t rx_err_cnt;
+	bool bus_off;
+	bool termination;
+};
+
+class error : public std::runtime_error {
+public:
+	error(const std::string &what, int code);
+
+	int code() const
+	{
+		return code_;
+	}
+
+private:
+	int code_; /* libusb error code */
+};
+
+class device {
+public:
+	/* throws udt1cri::error when no device can be claimed */
+	explicit device(const options &opts = options());
+	~device();
+
+	device(const device &) = delete;
+	device &operator=(const device &) = delete;
+
+	/* whether the device is a UDT1FR-I, which takes FRAME_FDF frames */
+	bool fd() const;
+
+	/* Queue up to n frames to send, return how many fit. Only one thread
+	 * may send.
+	 */
+	size_t send(const frame *frames, size_t n);
+
+	/* Take up to n received frames and echoes, in the order the device
+	 * reported them. Only one thread may receive.
+	 */
+	size_t receive(frame *frames, size_t n);
+
+	/* Commands, sent ahead of the queued frames. The device reports their
+	 * effect in its keep-alives, see stats().
+	 */
+	void set_bitrate(unsigned int kbps);
+	void set_data_bitrate(unsigned int kbps);
+	void set_termination(bool on);
+
+	struct stats stats() const;
+
+private:
+	struct impl;
+	std::unique_ptr<impl> impl_;
+};
+
+} /* namespace udt1cri */
+
+#endif /* LIBUDT1CRI_HPP */
@@ -0,0 +1,435 @@
+/* Throughput and latency benchmark for the udt1cri_usb SocketCAN interface
+ *
+ * Copyright (C) 2018 UniSwarm
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; version 2 of the License.
+ *
+ * Sends and receives frames carrying the benchmark payload of
+ * udt1cri_proto.h and reports, for each direction, the frame rate, the
+ * frames lost, and the p50/p99/max latency:
+ *
+ *  - RX latency runs from the time the emulator generated the frame to the
+ *    time it is read from the socket,
+ *  - TX latency runs from the write to the echo of the frame, which the
+ *    driver loops back once the device has confirmed it on the bus.
+ *
+ * Both ends read CLOCK_MONOTONIC, so the emulator has to run on the same
+ * host. The CPU time spent per frame is taken from /proc/stat over the run
+ * and the interface drop counters from sysfs.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <net/if.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <linux/can.h>
+#include <linux/can/raw.h>
+
+#include "udt1cri_proto.h"
+
+#define BENCH_MAX_SAMPLES (1 << 22)
+
+static const char *const bench_ifstats[] = {
+	"rx_dropped",
+	"tx_dropped",
+	"rx_over_errors",
+	"rx_missed_errors",
+};
+
+#define BENCH_IFSTATS (sizeof(bench_ifstats) / sizeof(bench_ifstats[0]))
+
+/* Latency samples of one direction, in microseconds */
+struct bench_dir {
+	uint32_t *samples;
+	size_t count;
+	uint64_t frames;
+	uint64_t lost;
+	uint32_t next_seq;
+	bool seq_valid;
+};
+
+struct bench {
+	int sock;
+	const char *ifname;
+	bool do_rx;
+	bool do_tx;
+	bool fd;
+	unsigned int rate;
+	unsigned int duration;
+	canid_t rx_id;
+	canid_t tx_id;
+
+	volatile bool stop;
+	uint64_t tx_written;
+	uint64_t tx_enobufs;
+
+	struct bench_dir rx;
+	struct bench_dir tx;
+};
+
+static void bench_die(const char *what)
+{
+	perror(what);
+	exit(EXIT_FAILURE);
+}
+
+static void bench_dir_init(struct bench_dir *dir)
+{
+	dir->samples = calloc(BENCH_MAX_SAMPLES, sizeof(*dir->samples));
+	if (!dir->samples)
+		bench_die("calloc");
+}
+
+static void bench_dir_add(struct bench_dir *dir, const uint8_t *data)
+{
+	uint32_t seq = udt1cri_get_le32(data);
+	uint32_t stamp = udt1cri_get_le32(data + 4);
+
+	/* a sequence going backwards is a restarted sender, not a loss */
+	if (dir->seq_valid && (int32_t)(seq - dir->next_seq) > 0)
+		dir->lost += seq - dir->next_seq;
+	dir->next_seq = seq + 1;
+	dir->seq_valid = true;
+
+	dir->frames++;
+	if (dir->count < BENCH_MAX_SAMPLES)
+		dir->samples[dir->count++] = udt1cri_mono_us() - stamp;
+}
+
+/* Busy and total jiffies of all CPUs */
+static void bench_cpu_jiffies(uint64_t *busy, uint64_t *total)
+{
+	unsigned long long v[8] = { 0 };
+	FILE *f;
+	int i;
+
+	f = fopen("/proc/stat", "r");
+	if (!f)
+		bench_die("/proc/stat");
+	if (fscanf(f, "cpu %llu %llu %llu %llu %llu %llu %llu %llu", &v[0],
+		   &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7]) < 4) {
+		fprintf(stderr, "cannot parse /proc/stat\n");
+		exit(EXIT_FAILURE);
+	}
+	fclose(f);
+
+	*total = 0;
+	for (i = 0; i < 8; i++)
+		*total += v[i];
+	/* idle and iowait */
+	*busy = *total - v[3] - v[4];
+}
+
+static uint64_t bench_ifstat(const char *ifname, const char *name)
+{
+	unsigned long long val = 0;
+	char path[128];
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/sys/class/net/%s/statistics/%s",
+		 ifname, name);
+	f = fopen(path, "r");
+	if (!f)
+		return 0;
+	if (fscanf(f, "%llu", &val) != 1)
+		val = 0;
+	fclose(f);
+
+	return val;
+}
+
+static void bench_open(struct bench *bench)
+{
+	struct sockaddr_can addr;
+	struct timeval tv = { .tv_usec = 100000 };
+	struct can_filter filter[2];
+	int one = 1;
+	int rcvbuf = 4 << 20;
+	int n = 0;
+
+	bench->sock = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+	if (bench->sock < 0)
+		bench_die("socket");
+
+	if (bench->do_rx) {
+		filter[n].can_id = bench->rx_id;
+		filter[n++].can_mask = CAN_EFF_FLAG | CAN_RTR_FLAG |
+				       CAN_EFF_MASK;
+	}
+	if (bench->do_tx) {
+		filter[n].can_id = bench->tx_id;
+		filter[n++].can_mask = CAN_EFF_FLAG | CAN_RTR_FLAG |
+				       CAN_EFF_MASK;
+	}
+	if (setsockopt(bench->sock, SOL_CAN_RAW, CAN_RAW_FILTER, filter,
+		       n * sizeof(filter[0])) < 0)
+		bench_die("CAN_RAW_FILTER");
+
+	if (setsockopt(bench->sock, SOL_CAN_RAW, CAN_RAW_RECV_OWN_MSGS, &one,
+		       sizeof(one)) < 0)
+		bench_die("CAN_RAW_RECV_OWN_MSGS");
+
+	if (bench->fd && setsockopt(bench->sock, SOL_CAN_RAW,
+				    CAN_RAW_FD_FRAMES, &one, sizeof(one)) < 0)
+		bench_die("CAN_RAW_FD_FRAMES");
+
+	setsockopt(bench->sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf,
+		   sizeof(rcvbuf));
+	setsockopt(bench->sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.can_family = AF_CAN;
+	addr.can_ifindex = if_nametoindex(bench->ifname);
+	if (!addr.can_ifindex)
+		bench_die(bench->ifname);
+
+	if (bind(bench->sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+		bench_die("bind");
+}
+
+static void *bench_rx_thread(void *arg)
+{
+	struct bench *bench = arg;
+	struct canfd_frame frame;
+	struct iovec iov = {
+		.iov_base = &frame,
+		.iov_len = sizeof(frame),
+	};
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+	};
+	ssize_t ret;
+
+	while (!bench->stop) {
+		msg.msg_flags = 0;
+		ret = recvmsg(bench->sock, &msg, 0);
+		if (ret < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
+			bench_die("recvmsg");
+		}
+		if (ret < (ssize_t)CAN_MTU ||
+		    frame.len < UDT1CRI_BENCH_PAYLOAD_LEN)
+			continue;
+
+		/* own frames come back flagged once the device confirmed them */
+		if (msg.msg_flags & MSG_CONFIRM)
+			bench_dir_add(&bench->tx, frame.data);
+		else if ((frame.can_id & CAN_EFF_MASK) == bench->rx_id)
+			bench_dir_add(&bench->rx, frame.data);
+	}
+
+	return NULL;
+}
+
+static void *bench_tx_thread(void *arg)
+{
+	struct bench *bench = arg;
+	struct canfd_frame frame;
+	struct timespec next;
+	uint64_t period_ns = 1000000000ull / bench->rate;
+	size_t mtu = bench->fd ? CANFD_MTU : CAN_MTU;
+	uint32_t seq = 0;
+
+	memset(&frame, 0, sizeof(frame));
+	frame.can_id = bench->tx_id;
+	frame.len = UDT1CRI_BENCH_PAYLOAD_LEN;
+	if (bench->fd)
+		frame.flags = CANFD_BRS;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	while (!bench->stop) {
+		udt1cri_bench_payload(frame.data, seq);
+		if (write(bench->sock, &frame, mtu) < 0) {
+			if (errno != ENOBUFS && errno != EAGAIN)
+				bench_die("write");
+			/* the driver stopped the queue, retry the same frame */
+			bench->tx_enobufs++;
+			usleep(100);
+			continue;
+		}
+		bench->tx_written++;
+		seq++;
+
+		next.tv_nsec += period_ns;
+		while (next.tv_nsec >= 1000000000) {
+			next.tv_nsec -= 1000000000;
+			next.tv_sec++;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+	}
+
+	return NULL;
+}
+
+static int bench_cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void bench_report(const char *name, struct bench_dir *dir,
+			 double seconds)
+{
+	size_t n = dir->count;
+
+	printf("%s: %llu frames, %.0f frames/s, %llu lost", name,
+	       (unsigned long long)dir->frames, dir->frames / seconds,
+	       (unsigned long long)dir->lost);
+	if (!n) {
+		printf("\n");
+		return;
+	}
+
+	qsort(dir->samples, n, sizeof(*dir->samples), bench_cmp_u32);
+	printf(", latency p50 %u us p99 %u us max %u us\n",
+	       dir->samples[n / 2], dir->samples[(n * 99) / 100],
+	       dir->samples[n - 1]);
+}
+
+static void bench_usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -i, --interface NAME  CAN interface (can0)\n"
+		"  -m, --mode MODE       rx, tx or both (both)\n"
+		"  -r, --rate N          transmitted frames per second (1000)\n"
+		"  -d, --duration S      run time in seconds (10)\n"
+		"  -R, --rx-id ID        identifier of received frames (0x123)\n"
+		"  -T, --tx-id ID        identifier of transmitted frames (0x321)\n"
+		"  -f, --fd              transmit CAN FD frames\n",
+		prog);
+}
+
+int main(int argc, char **argv)
+{
+	static const struct option opts[] = {
+		{ "interface", required_argument, NULL, 'i' },
+		{ "mode", required_argument, NULL, 'm' },
+		{ "rate", required_argument, NULL, 'r' },
+		{ "duration", required_argument, NULL, 'd' },
+		{ "rx-id", required_argument, NULL, 'R' },
+		{ "tx-id", required_argument, NULL, 'T' },
+		{ "fd", no_argument, NULL, 'f' },
+		{ "help", no_argument, NULL, 'h' },
+		{}
+	};
+	struct bench bench = {
+		.ifname = "can0",
+		.do_rx = true,
+		.do_tx = true,
+		.rate = 1000,
+		.duration = 10,
+		.rx_id = 0x123,
+		.tx_id = 0x321,
+	};
+	uint64_t ifstats[BENCH_IFSTATS];
+	uint64_t busy0, total0, busy1, total1;
+	uint64_t start_ns, frames;
+	pthread_t rx_thread, tx_thread;
+	double seconds, busy_s;
+	unsigned int i;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "i:m:r:d:R:T:fh", opts,
+				  NULL)) != -1) {
+		switch (opt) {
+		case 'i':
+			bench.ifname = optarg;
+			break;
+		case 'm':
+			bench.do_rx = strcmp(optarg, "tx") != 0;
+			bench.do_tx = strcmp(optarg, "rx") != 0;
+			break;
+		case 'r':
+			bench.rate = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			bench.duration = strtoul(optarg, NULL, 0);
+			break;
+		case 'R':
+			bench.rx_id = strtoul(optarg, NULL, 0);
+			break;
+		case 'T':
+			bench.tx_id = strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			bench.fd = true;
+			break;
+		default:
+			bench_usage(argv[0]);
+			return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+	if (!bench.rate || !bench.duration) {
+		bench_usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	bench_dir_init(&bench.rx);
+	bench_dir_init(&bench.tx);
+	bench_open(&bench);
+
+	for (i = 0; i < BENCH_IFSTATS; i++)
+		ifstats[i] = bench_ifstat(bench.ifname, bench_ifstats[i]);
+	bench_cpu_jiffies(&busy0, &total0);
+	start_ns = udt1cri_mono_ns();
+
+	/* echoes are read by the RX thread even in tx mode */
+	if (pthread_create(&rx_thread, NULL, bench_rx_thread, &bench))
+		bench_die("pthread_create");
+	if (bench.do_tx &&
+	    pthread_create(&tx_thread, NULL, bench_tx_thread, &bench))
+		bench_die("pthread_create");
+
+	sleep(bench.duration);
+	bench.stop = true;
+
+	if (bench.do_tx)
+		pthread_join(tx_thread, NULL);
+	/* let the last echoes come back */
+	usleep(200000);
+	pthread_join(rx_thread, NULL);
+
+	seconds = (udt1cri_mono_ns() - start_ns) / 1e9;
+	bench_cpu_jiffies(&busy1, &total1);
+	busy_s = (double)(busy1 - busy0) / sysconf(_SC_CLK_TCK);
+
+	if (bench.do_rx)
+		bench_report("rx", &bench.rx, seconds);
+	if (bench.do_tx) {
+		bench_report("tx", &bench.tx, seconds);
+		printf("tx: %llu written, %llu unconfirmed, %llu ENOBUFS\n",
+		       (unsigned long long)bench.tx_written,
+		       (unsigned long long)(bench.tx_written - bench.tx.frames),
+		       (unsigned long long)bench.tx_enobufs);
+	}
+
+	frames = bench.rx.frames + bench.tx.frames;
+	printf("cpu: %.1f%% busy, %.2f us per frame\n",
+	       total1 > total0 ? 100.0 * (busy1 - busy0) / (total1 - total0) : 0,
+	       frames ? busy_s * 1e6 / frames : 0);
+
+	for (i = 0; i < BENCH_IFSTATS; i++)
+		printf("%s %llu\n", bench_ifstats[i],
+		       (unsigned long long)(bench_ifstat(bench.ifname,
+							 bench_ifstats[i]) -
+					    ifstats[i]));
+
+	close(bench.sock);
+
+	return EXIT_SUCCESS;
+}
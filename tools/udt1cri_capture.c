@@ -0,0 +1,292 @@
+/* Drain the USB traffic capture of the udt1cri_usb driver
+ *
+ * Copyright (C) 2018 UniSwarm
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; version 2 of the License.
+ *
+ * Reads the capture<cpu> relay files of the debugfs directory of a device
+ * in large chunks, and appends their records, as defined in
+ * udt1cri_proto.h, to a file. Records are written in the order each CPU
+ * buffer holds them; their seq and time_ns give the global order.
+ *
+ * At the end, the records are counted per direction and the capture is
+ * reported complete when no seq is missing.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "udt1cri_proto.h"
+
+#define CAPTURE_MAX_CPUS 256
+/* A relay sub-buffer of the driver, so a record always fits */
+#define CAPTURE_BUFF_SIZE (1024 * 1024)
+#define CAPTURE_POLL_MS 100
+
+struct capture_file {
+	int fd;
+	uint8_t *buf;
+	size_t len; /* bytes waiting, the last record may be partial */
+};
+
+struct capture {
+	struct capture_file files[CAPTURE_MAX_CPUS];
+	unsigned int nfiles;
+	FILE *out;
+	uint64_t records[UDT1CRI_CAPTURE_CMD + 1];
+	uint64_t bytes[UDT1CRI_CAPTURE_CMD + 1];
+	uint64_t total;
+	uint32_t seq_max;
+	uint32_t lost_max;
+};
+
+static volatile sig_atomic_t capture_stop;
+
+static void capture_die(const char *what)
+{
+	perror(what);
+	exit(EXIT_FAILURE);
+}
+
+static void capture_signal(int sig)
+{
+	(void)sig;
+	capture_stop = 1;
+}
+
+/* Start or stop the capture through the debugfs control file */
+static void capture_control(const char *dir, bool on)
+{
+	char path[4096];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/capture", dir);
+	fd = open(path, O_WRONLY);
+	if (fd < 0)
+		capture_die(path);
+	if (write(fd, on ? "1" : "0", 1) != 1)
+		capture_die(path);
+	close(fd);
+}
+
+static void capture_open(struct capture *capture, const char *dir)
+{
+	char path[4096];
+	unsigned int i;
+
+	for (i = 0; i < CAPTURE_MAX_CPUS; i++) {
+		struct capture_file *file = &capture->files[i];
+
+		snprintf(path, sizeof(path), "%s/capture%u", dir, i);
+		file->fd = open(path, O_RDONLY | O_NONBLOCK);
+		if (file->fd < 0) {
+			if (errno == ENOENT)
+				break;
+			capture_die(path);
+		}
+
+		file->buf = malloc(CAPTURE_BUFF_SIZE);
+		if (!file->buf)
+			capture_die("malloc");
+		file->len = 0;
+	}
+
+	if (!i) {
+		fprintf(stderr, "no capture files in %s, start the capture\n",
+			dir);
+		exit(EXIT_FAILURE);
+	}
+	capture->nfiles = i;
+}
+
+/* Write out the complete records waiting in a file buffer */
+static void capture_records(struct capture *capture,
+			    struct capture_file *file)
+{
+	size_t pos = 0;
+
+	while (file->len - pos >= sizeof(struct udt1cri_capture_hdr)) {
+		struct udt1cri_capture_hdr hdr;
+		size_t size;
+
+		memcpy(&hdr, file->buf + pos, sizeof(hdr));
+		size = UDT1CRI_CAPTURE_ALIGN(sizeof(hdr) + hdr.len);
+		if (file->len - pos < size)
+			break;
+
+		if (hdr.dir <= UDT1CRI_CAPTURE_CMD) {
+			capture->records[hdr.dir]++;
+			capture->bytes[hdr.dir] += hdr.len;
+		}
+		if (!capture->total ||
+		    (int32_t)(hdr.seq - capture->seq_max) > 0)
+			capture->seq_max = hdr.seq;
+		capture->total++;
+		if (hdr.lost > capture->lost_max)
+			capture->lost_max = hdr.lost;
+
+		pos += size;
+	}
+
+	if (pos && fwrite(file->buf, pos, 1, capture->out) != 1)
+		capture_die("write");
+
+	memmove(file->buf, file->buf + pos, file->len - pos);
+	file->len -= pos;
+}
+
+/* Read what each CPU buffer holds, return the number of bytes read */
+static size_t capture_drain(struct capture *capture)
+{
+	size_t total = 0;
+	unsigned int i;
+
+	for (i = 0; i < capture->nfiles; i++) {
+		struct capture_file *file = &capture->files[i];
+		ssize_t n;
+
+		for (;;) {
+			n = read(file->fd, file->buf + file->len,
+				 CAPTURE_BUFF_SIZE - file->len);
+			if (n < 0 && errno != EAGAIN && errno != EINTR)
+				capture_die("read");
+			if (n <= 0)
+				break;
+
+			file->len += n;
+			total += n;
+			capture_records(capture, file);
+		}
+	}
+
+	return total;
+}
+
+static void capture_wait(struct capture *capture)
+{
+	struct pollfd fds[CAPTURE_MAX_CPUS];
+	unsigned int i;
+
+	/* Relay files only poll ready once a sub-buffer is full */
+	for (i = 0; i < capture->nfiles; i++) {
+		fds[i].fd = capture->files[i].fd;
+		fds[i].events = POLLIN;
+	}
+
+	if (poll(fds, capture->nfiles, CAPTURE_POLL_MS) < 0 && errno != EINTR)
+		capture_die("poll");
+}
+
+static void capture_report(struct capture *capture)
+{
+	static const char *const names[] = { "rx", "tx", "cmd" };
+	uint64_t missing;
+	unsigned int i;
+
+	for (i = 0; i <= UDT1CRI_CAPTURE_CMD; i++)
+		fprintf(stderr, "%s: %llu transfers, %llu bytes\n", names[i],
+			(unsigned long long)capture->records[i],
+			(unsigned long long)capture->bytes[i]);
+
+	missing = capture->total ? capture->seq_max + 1ull - capture->total :
+				   0;
+	fprintf(stderr, "records: %llu, missing %llu, lost %u: %s\n",
+		(unsigned long long)capture->total,
+		(unsigned long long)missing, capture->lost_max,
+		missing ? "incomplete" : "complete");
+}
+
+static void capture_usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s -D DIR [options]\n"
+		"  -D, --dir DIR         debugfs directory of the device\n"
+		"  -o, --output FILE     records file (stdout)\n"
+		"  -d, --duration S      run time in seconds (until SIGINT)\n"
+		"  -s, --start           start and stop the capture\n",
+		prog);
+}
+
+int main(int argc, char **argv)
+{
+	static const struct option opts[] = {
+		{ "dir", required_argument, NULL, 'D' },
+		{ "output", required_argument, NULL, 'o' },
+		{ "duration", required_argument, NULL, 'd' },
+		{ "start", no_argument, NULL, 's' },
+		{ "help", no_argument, NULL, 'h' },
+		{}
+	};
+	static struct capture capture;
+	const char *dir = NULL, *output = NULL;
+	unsigned int duration = 0;
+	bool start = false;
+	uint64_t end_ns = 0;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "D:o:d:sh", opts, NULL)) != -1) {
+		switch (opt) {
+		case 'D':
+			dir = optarg;
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 'd':
+			duration = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			start = true;
+			break;
+		default:
+			capture_usage(argv[0]);
+			return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+	if (!dir) {
+		capture_usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	capture.out = output ? fopen(output, "w") : stdout;
+	if (!capture.out)
+		capture_die(output);
+
+	signal(SIGINT, capture_signal);
+	signal(SIGTERM, capture_signal);
+
+	if (start)
+		capture_control(dir, true);
+	capture_open(&capture, dir);
+
+	if (duration)
+		end_ns = udt1cri_mono_ns() + duration * 1000000000ull;
+
+	while (!capture_stop && (!end_ns || udt1cri_mono_ns() < end_ns)) {
+		if (!capture_drain(&capture))
+			capture_wait(&capture);
+	}
+
+	/* Stopping flushes the last sub-buffers */
+	if (start)
+		capture_control(dir, false);
+	while (capture_drain(&capture))
+		;
+
+	if (fflush(capture.out))
+		capture_die("write");
+
+	capture_report(&capture);
+
+	return EXIT_SUCCESS;
+}
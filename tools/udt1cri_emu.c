@@ -0,0 +1,931 @@
+/* Software model of the UniSwarm UDT1CRI CAN debugger
+ *
+ * Copyright (C) 2018 UniSwarm
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; version 2 of the License.
+ *
+ * Runs the device side of the protocol through raw-gadget, so the driver can
+ * be exercised on a host with no adapter. With dummy_hcd, the emulated
+ * device is plugged into the same host:
+ *
+ *   modprobe dummy_hcd raw_gadget
+ *   ./udt1cri_emu --rx-rate 2000
+ *
+ * The model sends keep-alives from both PICs every 100 ms, answers firmware
+ * version requests, applies bitrate and termination commands, confirms each
+ * transmitted frame with TRANSMIT_MESSAGE_RSP once it would have left a bus
+ * running at the configured bitrate, and streams RECEIVE_MESSAGE frames at
+ * a fixed rate. Received frames carry the benchmark payload of
+ * udt1cri_proto.h. Frames that do not fit in the device buffer while the
+ * host is not reading are counted in rx_lost, as the firmware does.
+ */
+
+#include <endian.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include <linux/types.h>
+#include <linux/usb/ch9.h>
+#include <linux/usb/raw_gadget.h>
+
+#include "udt1cri_proto.h"
+
+#define EMU_KA_PERIOD_US 100000
+#define EMU_RSP_QUEUE_LEN 1024
+#define EMU_IDLE_WAIT_US 1000
+
+#define STRING_ID_MANUFACTURER 1
+#define STRING_ID_PRODUCT 2
+#define STRING_ID_SERIAL 3
+
+struct emu_io {
+	struct usb_raw_ep_io inner;
+	uint8_t data[UDT1CRI_USB_BUFF_SIZE];
+};
+
+struct emu_ep0_io {
+	struct usb_raw_ep_io inner;
+	uint8_t data[256];
+};
+
+struct emu_event {
+	struct usb_raw_event inner;
+	struct usb_ctrlrequest ctrl;
+};
+
+/* A frame waiting for its transmission response */
+struct emu_rsp {
+	uint64_t due_us;
+	struct udt1cri_usb_msg_can msg;
+};
+
+struct emu {
+	int fd;
+	int ep_in;
+	int ep_out;
+	bool configured;
+
+	/* options */
+	const char *udc_driver;
+	const char *udc_device;
+	bool fd_variant;
+	unsigned int rx_rate; /* frames/s */
+	uint32_t rx_id;
+	unsigned int dev_buf; /* frames the device holds for the host */
+	bool bus_timing;
+	bool verbose;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	/* device state, protected by lock */
+	unsigned int bitrate_kbps;
+	unsigned int data_bitrate_kbps;
+	bool termination;
+	bool ka_usb_now;
+	bool ka_can_now;
+	uint64_t next_ka_us;
+	uint64_t bus_free_us;
+	struct emu_rsp rsp[EMU_RSP_QUEUE_LEN];
+	unsigned int rsp_head;
+	unsigned int rsp_tail;
+	uint64_t rx_start_us;
+	uint64_t rx_generated; /* frames due since rx_start_us */
+	uint32_t rx_seq;
+	uint16_t rx_lost;
+	bool rx_ovfl;
+
+	/* statistics */
+	uint64_t stat_in_xfers;
+	uint64_t stat_out_xfers;
+	uint64_t stat_rx_frames;
+	uint64_t stat_tx_frames;
+	uint64_t stat_rsp_dropped;
+	uint64_t stat_bad_msgs;
+};
+
+static volatile sig_atomic_t emu_stop;
+
+static void emu_sigint(int sig)
+{
+	(void)sig;
+	emu_stop = 1;
+}
+
+static uint64_t emu_now_us(void)
+{
+	return udt1cri_mono_ns() / 1000;
+}
+
+static void emu_die(const char *what)
+{
+	perror(what);
+	exit(EXIT_FAILURE);
+}
+
+/* Descriptors */
+
+static const struct usb_device_descriptor emu_dev_desc = {
+	.bLength = USB_DT_DEVICE_SIZE,
+	.bDescriptorType = USB_DT_DEVICE,
+	.bcdUSB = 0x0200,
+	.bDeviceClass = 0,
+	.bDeviceSubClass = 0,
+	.bDeviceProtocol = 0,
+	.bMaxPacketSize0 = 64,
+	.idVendor = UDT1CRI_VENDOR_ID,
+	.idProduct = UDT1CRI_PRODUCT_ID,
+	.bcdDevice = 0x0100,
+	.iManufacturer = STRING_ID_MANUFACTURER,
+	.iProduct = STRING_ID_PRODUCT,
+	.iSerialNumber = STRING_ID_SERIAL,
+	.bNumConfigurations = 1,
+};
+
+static const struct usb_qualifier_descriptor emu_qual_desc = {
+	.bLength = sizeof(struct usb_qualifier_descriptor),
+	.bDescriptorType = USB_DT_DEVICE_QUALIFIER,
+	.bcdUSB = 0x0200,
+	.bMaxPacketSize0 = 64,
+	.bNumConfigurations = 1,
+};
+
+static const struct usb_config_descriptor emu_config = {
+	.bLength = USB_DT_CONFIG_SIZE,
+	.bDescriptorType = USB_DT_CONFIG,
+	.wTotalLength = USB_DT_CONFIG_SIZE + USB_DT_INTERFACE_SIZE +
+			2 * USB_DT_ENDPOINT_SIZE,
+	.bNumInterfaces = 1,
+	.bConfigurationValue = 1,
+	.iConfiguration = 0,
+	.bmAttributes = USB_CONFIG_ATT_ONE | USB_CONFIG_ATT_SELFPOWER,
+	.bMaxPower = 50,
+};
+
+static const struct usb_interface_descriptor emu_intf = {
+	.bLength = USB_DT_INTERFACE_SIZE,
+	.bDescriptorType = USB_DT_INTERFACE,
+	.bInterfaceNumber = 0,
+	.bAlternateSetting = 0,
+	.bNumEndpoints = 2,
+	.bInterfaceClass = USB_CLASS_VENDOR_SPEC,
+	.bInterfaceSubClass = 0,
+	.bInterfaceProtocol = 0,
+	.iInterface = 0,
+};
+
+static const struct usb_endpoint_descriptor emu_ep_in = {
+	.bLength = USB_DT_ENDPOINT_SIZE,
+	.bDescriptorType = USB_DT_ENDPOINT,
+	.bEndpointAddress = UDT1CRI_USB_EP_IN,
+	.bmAttributes = USB_ENDPOINT_XFER_BULK,
+	.wMaxPacketSize = UDT1CRI_USB_MAX_PACKET,
+};
+
+static const struct usb_endpoint_descriptor emu_ep_out = {
+	.bLength = USB_DT_ENDPOINT_SIZE,
+	.bDescriptorType = USB_DT_ENDPOINT,
+	.bEndpointAddress = UDT1CRI_USB_EP_OUT,
+	.bmAttributes = USB_ENDPOINT_XFER_BULK,
+	.wMaxPacketSize = UDT1CRI_USB_MAX_PACKET,
+};
+
+/* Configuration descriptor with its interface and endpoints */
+static int emu_config_desc(uint8_t *buf)
+{
+	int len = 0;
+
+	memcpy(buf + len, &emu_config, USB_DT_CONFIG_SIZE);
+	len += USB_DT_CONFIG_SIZE;
+	memcpy(buf + len, &emu_intf, USB_DT_INTERFACE_SIZE);
+	len += USB_DT_INTERFACE_SIZE;
+	memcpy(buf + len, &emu_ep_in, USB_DT_ENDPOINT_SIZE);
+	len += USB_DT_ENDPOINT_SIZE;
+	memcpy(buf + len, &emu_ep_out, USB_DT_ENDPOINT_SIZE);
+	len += USB_DT_ENDPOINT_SIZE;
+
+	return len;
+}
+
+/* USB string descriptor in UTF-16LE, ASCII only */
+static int emu_string_desc(struct emu *emu, unsigned int id, uint8_t *buf)
+{
+	const char *str;
+	unsigned int i;
+
+	switch (id) {
+	case 0:
+		buf[0] = 4;
+		buf[1] = USB_DT_STRING;
+		buf[2] = 0x09; /* en-US */
+		buf[3] = 0x04;
+		return 4;
+	case STRING_ID_MANUFACTURER:
+		str = "UniSwarm";
+		break;
+	case STRING_ID_PRODUCT:
+		str = emu->fd_variant ? UDT1CRI_PRODUCT_FD : UDT1CRI_PRODUCT;
+		break;
+	case STRING_ID_SERIAL:
+		str = "EMU00001";
+		break;
+	default:
+		return -1;
+	}
+
+	buf[0] = 2 + 2 * strlen(str);
+	buf[1] = USB_DT_STRING;
+	for (i = 0; str[i]; i++) {
+		buf[2 + 2 * i] = str[i];
+		buf[3 + 2 * i] = 0;
+	}
+
+	return buf[0];
+}
+
+/* Raw gadget helpers */
+
+static void emu_raw_init(struct emu *emu)
+{
+	struct usb_raw_init arg;
+
+	memset(&arg, 0, sizeof(arg));
+	strncpy((char *)arg.driver_name, emu->udc_driver,
+		UDC_NAME_LENGTH_MAX - 1);
+	strncpy((char *)arg.device_name, emu->udc_device,
+		UDC_NAME_LENGTH_MAX - 1);
+	arg.speed = USB_SPEED_HIGH;
+
+	if (ioctl(emu->fd, USB_RAW_IOCTL_INIT, &arg) < 0)
+		emu_die("ioctl(USB_RAW_IOCTL_INIT)");
+
+	if (ioctl(emu->fd, USB_RAW_IOCTL_RUN, 0) < 0)
+		emu_die("ioctl(USB_RAW_IOCTL_RUN)");
+}
+
+static void emu_ep0_write(struct emu *emu, const void *data, unsigned int len,
+			  unsigned int max)
+{
+	struct emu_ep0_io io;
+
+	if (len > max)
+		len = max;
+	if (len > sizeof(io.data))
+		len = sizeof(io.data);
+
+	io.inner.ep = 0;
+	io.inner.flags = 0;
+	io.inner.length = len;
+	memcpy(io.data, data, len);
+
+	if (ioctl(emu->fd, USB_RAW_IOCTL_EP0_WRITE, &io) < 0)
+		perror("ioctl(USB_RAW_IOCTL_EP0_WRITE)");
+}
+
+/* Acknowledge a control request without data stage */
+static void emu_ep0_ack(struct emu *emu)
+{
+	struct emu_ep0_io io;
+
+	io.inner.ep = 0;
+	io.inner.flags = 0;
+	io.inner.length = 0;
+
+	if (ioctl(emu->fd, USB_RAW_IOCTL_EP0_READ, &io) < 0)
+		perror("ioctl(USB_RAW_IOCTL_EP0_READ)");
+}
+
+static void emu_ep0_stall(struct emu *emu)
+{
+	if (ioctl(emu->fd, USB_RAW_IOCTL_EP0_STALL, 0) < 0)
+		perror("ioctl(USB_RAW_IOCTL_EP0_STALL)");
+}
+
+/* Device model */
+
+static void emu_put_ka_usb(struct emu *emu, uint8_t *buf)
+{
+	struct udt1cri_usb_msg_ka_usb *ka = (void *)buf;
+
+	memset(ka, 0, sizeof(*ka));
+	ka->cmd_id = UDT1CRI_CMD_I_AM_ALIVE_FROM_USB;
+	ka->termination_state = emu->termination;
+	ka->soft_ver_major = 1;
+	ka->soft_ver_minor = 0;
+}
+
+static void emu_put_ka_can(struct emu *emu, uint8_t *buf)
+{
+	struct udt1cri_usb_msg_ka_can *ka = (void *)buf;
+
+	memset(ka, 0, sizeof(*ka));
+	ka->cmd_id = UDT1CRI_CMD_I_AM_ALIVE_FROM_CAN;
+	ka->rx_buff_ovfl = emu->rx_ovfl;
+	ka->can_bitrate = htobe16(emu->bitrate_kbps);
+	ka->rx_lost = htole16(emu->rx_lost);
+	ka->soft_ver_major = 1;
+	ka->soft_ver_minor = 0;
+
+	emu->rx_ovfl = false;
+}
+
+/* Microseconds a frame holds the bus, without bit stuffing */
+static uint64_t emu_frame_us(struct emu *emu,
+			     const struct udt1cri_usb_msg_can *msg,
+			     unsigned int len)
+{
+	unsigned int bits = (msg->flags & FLAG_CAN_EID) ? 67 : 47;
+	unsigned int data_bits = 0;
+	uint64_t ns;
+
+	if (!emu->bitrate_kbps)
+		return 0;
+
+	if (!(msg->flags & FLAG_CAN_RTR))
+		data_bits = len * 8;
+
+	ns = (uint64_t)bits * 1000000 / emu->bitrate_kbps;
+
+	if ((msg->flags & FLAG_CAN_BRS) && emu->data_bitrate_kbps)
+		ns += (uint64_t)data_bits * 1000000 / emu->data_bitrate_kbps;
+	else
+		ns += (uint64_t)data_bits * 1000000 / emu->bitrate_kbps;
+
+	return (ns + 999) / 1000;
+}
+
+static unsigned int emu_dlc2len(unsigned int dlc)
+{
+	static const uint8_t len[] = { 0,  1,  2,  3,  4,  5,  6,  7,
+				       8, 12, 16, 20, 24, 32, 48, 64 };
+
+	return len[dlc & 0xf];
+}
+
+/* A frame from the host: it goes out on the bus after the frames before it,
+ * then the device confirms it.
+ */
+static void emu_handle_tx(struct emu *emu,
+			  const struct udt1cri_usb_msg_can *msg)
+{
+	const bool fd = msg->flags & FLAG_CAN_FDF;
+	unsigned int len = fd ? emu_dlc2len(msg->dlc) : (msg->dlc & 0xf);
+	uint64_t now = emu_now_us();
+	struct emu_rsp *rsp;
+
+	if (!fd && len > 8)
+		len = 8;
+
+	emu->stat_tx_frames++;
+
+	if (emu->rsp_head - emu->rsp_tail == EMU_RSP_QUEUE_LEN) {
+		emu->stat_rsp_dropped++;
+		return;
+	}
+
+	if (emu->bus_free_us < now)
+		emu->bus_free_us = now;
+	if (emu->bus_timing)
+		emu->bus_free_us += emu_frame_us(emu, msg, len);
+
+	rsp = &emu->rsp[emu->rsp_head % EMU_RSP_QUEUE_LEN];
+	memset(&rsp->msg, 0, sizeof(rsp->msg));
+	rsp->due_us = emu->bus_free_us;
+	rsp->msg.cmd_id = UDT1CRI_CMD_TRANSMIT_MESSAGE_RSP;
+	rsp->msg.dlc = msg->dlc;
+	rsp->msg.flags = msg->flags;
+	rsp->msg.eid = msg->eid;
+	rsp->msg.timestamp = htole32((uint32_t)rsp->due_us);
+	memcpy(rsp->msg.data, msg->data, 8);
+	emu->rsp_head++;
+}
+
+static void emu_handle_out(struct emu *emu, const uint8_t *buf,
+			   unsigned int len)
+{
+	unsigned int pos = 0;
+
+	pthread_mutex_lock(&emu->lock);
+
+	while (pos + UDT1CRI_USB_MSG_SIZE <= len) {
+		const struct udt1cri_usb_msg_can *msg = (const void *)(buf + pos);
+		unsigned int msg_len = UDT1CRI_USB_MSG_SIZE;
+
+		if (msg->cmd_id == UDT1CRI_CMD_TRANSMIT_MESSAGE_EV &&
+		    emu->fd_variant && (msg->flags & FLAG_CAN_FDF))
+			msg_len = UDT1CRI_USB_FD_MSG_SIZE;
+
+		if (pos + msg_len > len) {
+			emu->stat_bad_msgs++;
+			break;
+		}
+
+		switch (msg->cmd_id) {
+		case UDT1CRI_CMD_TRANSMIT_MESSAGE_EV:
+			emu_handle_tx(emu, msg);
+			break;
+
+		case UDT1CRI_CMD_CHANGE_BIT_RATE: {
+			const struct udt1cri_usb_msg_change_bitrate *cmd =
+				(const void *)msg;
+
+			emu->bitrate_kbps = be16toh(cmd->bitrate);
+			emu->ka_can_now = true;
+			if (emu->verbose)
+				printf("bitrate %u kbps\n", emu->bitrate_kbps);
+			break;
+		}
+
+		case UDT1CRI_CMD_CHANGE_DATA_BIT_RATE: {
+			const struct udt1cri_usb_msg_change_bitrate *cmd =
+				(const void *)msg;
+
+			emu->data_bitrate_kbps = be16toh(cmd->bitrate);
+			if (emu->verbose)
+				printf("data bitrate %u kbps\n",
+				       emu->data_bitrate_kbps);
+			break;
+		}
+
+		case UDT1CRI_CMD_SETUP_TERMINATION_RESISTANCE: {
+			const struct udt1cri_usb_msg_termination *cmd =
+				(const void *)msg;
+
+			emu->termination = cmd->termination;
+			emu->ka_usb_now = true;
+			if (emu->verbose)
+				printf("termination %s\n",
+				       emu->termination ? "on" : "off");
+			break;
+		}
+
+		case UDT1CRI_CMD_READ_FW_VERSION: {
+			const struct udt1cri_usb_msg_fw_ver *cmd =
+				(const void *)msg;
+
+			/* Versions are reported in the keep-alives */
+			if (cmd->pic == UDT1CRI_VER_REQ_USB)
+				emu->ka_usb_now = true;
+			else
+				emu->ka_can_now = true;
+			break;
+		}
+
+		default:
+			emu->stat_bad_msgs++;
+			break;
+		}
+
+		pos += msg_len;
+	}
+
+	pthread_cond_signal(&emu->cond);
+	pthread_mutex_unlock(&emu->lock);
+}
+
+/* Frames generated since the last transfer. The device buffer holds
+ * dev_buf frames, the others are lost.
+ */
+static unsigned int emu_rx_due(struct emu *emu, uint64_t now)
+{
+	uint64_t due, backlog;
+
+	if (!emu->rx_rate)
+		return 0;
+
+	due = (now - emu->rx_start_us) * emu->rx_rate / 1000000;
+	backlog = due - emu->rx_generated;
+
+	if (backlog > emu->dev_buf) {
+		emu->rx_lost += backlog - emu->dev_buf;
+		emu->rx_ovfl = true;
+		emu->rx_generated = due - emu->dev_buf;
+		backlog = emu->dev_buf;
+	}
+
+	return backlog;
+}
+
+static void emu_put_rx(struct emu *emu, uint8_t *buf, uint64_t now)
+{
+	struct udt1cri_usb_msg_can *msg = (void *)buf;
+
+	memset(msg, 0, UDT1CRI_USB_MSG_SIZE);
+	msg->cmd_id = UDT1CRI_CMD_RECEIVE_MESSAGE;
+	msg->dlc = UDT1CRI_BENCH_PAYLOAD_LEN;
+	msg->eid = htole32(emu->rx_id & 0x1fffffff);
+	if (emu->rx_id > 0x7ff)
+		msg->flags |= FLAG_CAN_EID;
+	msg->timestamp = htole32((uint32_t)now);
+
+	udt1cri_bench_payload(msg->data, emu->rx_seq++);
+
+	emu->rx_generated++;
+	emu->stat_rx_frames++;
+}
+
+/* Fill one bulk IN transfer. Called with lock held. */
+static unsigned int emu_fill_in(struct emu *emu, uint8_t *buf)
+{
+	const uint64_t now = emu_now_us();
+	unsigned int len = 0, n;
+
+	if (now >= emu->next_ka_us) {
+		emu->ka_usb_now = true;
+		emu->ka_can_now = true;
+		emu->next_ka_us = now + EMU_KA_PERIOD_US;
+	}
+
+	if (emu->ka_usb_now) {
+		emu_put_ka_usb(emu, buf + len);
+		len += UDT1CRI_USB_MSG_SIZE;
+		emu->ka_usb_now = false;
+	}
+
+	if (emu->ka_can_now) {
+		emu_put_ka_can(emu, buf + len);
+		len += UDT1CRI_USB_MSG_SIZE;
+		emu->ka_can_now = false;
+	}
+
+	while (emu->rsp_tail != emu->rsp_head &&
+	       len + UDT1CRI_USB_MSG_SIZE <= UDT1CRI_USB_BUFF_SIZE) {
+		struct emu_rsp *rsp = &emu->rsp[emu->rsp_tail %
+						 EMU_RSP_QUEUE_LEN];
+
+		if (rsp->due_us > now)
+			break;
+
+		memcpy(buf + len, &rsp->msg, UDT1CRI_USB_MSG_SIZE);
+		len += UDT1CRI_USB_MSG_SIZE;
+		emu->rsp_tail++;
+	}
+
+	n = emu_rx_due(emu, now);
+	while (n-- && len + UDT1CRI_USB_MSG_SIZE <= UDT1CRI_USB_BUFF_SIZE) {
+		emu_put_rx(emu, buf + len, now);
+		len += UDT1CRI_USB_MSG_SIZE;
+	}
+
+	return len;
+}
+
+/* Time the next message is due, at most EMU_IDLE_WAIT_US from now. Called
+ * with lock held.
+ */
+static uint64_t emu_next_due_us(struct emu *emu, uint64_t now)
+{
+	uint64_t due = now + EMU_IDLE_WAIT_US;
+
+	if (emu->next_ka_us < due)
+		due = emu->next_ka_us;
+
+	if (emu->rsp_tail != emu->rsp_head &&
+	    emu->rsp[emu->rsp_tail % EMU_RSP_QUEUE_LEN].due_us < due)
+		due = emu->rsp[emu->rsp_tail % EMU_RSP_QUEUE_LEN].due_us;
+
+	if (emu->rx_rate) {
+		uint64_t rx_us = emu->rx_start_us +
+				 ((emu->rx_generated + 1) * 1000000 +
+				  emu->rx_rate - 1) / emu->rx_rate;
+
+		if (rx_us < due)
+			due = rx_us;
+	}
+
+	return due;
+}
+
+static void *emu_in_thread(void *arg)
+{
+	struct emu *emu = arg;
+	struct emu_io io;
+
+	while (!emu_stop) {
+		struct timespec deadline;
+		uint64_t ns;
+
+		pthread_mutex_lock(&emu->lock);
+		io.inner.length = emu_fill_in(emu, io.data);
+		if (!io.inner.length) {
+			/* Woken up early by emu_handle_out() */
+			ns = emu_next_due_us(emu, emu_now_us()) * 1000ull;
+			deadline.tv_sec = ns / 1000000000ull;
+			deadline.tv_nsec = ns % 1000000000ull;
+			pthread_cond_timedwait(&emu->cond, &emu->lock,
+					       &deadline);
+		}
+		pthread_mutex_unlock(&emu->lock);
+
+		if (!io.inner.length)
+			continue;
+
+		io.inner.ep = emu->ep_in;
+		io.inner.flags = 0;
+
+		if (ioctl(emu->fd, USB_RAW_IOCTL_EP_WRITE, &io) < 0) {
+			if (errno == EINTR)
+				continue;
+			if (emu->verbose)
+				perror("ioctl(USB_RAW_IOCTL_EP_WRITE)");
+			usleep(EMU_IDLE_WAIT_US);
+			continue;
+		}
+
+		emu->stat_in_xfers++;
+	}
+
+	return NULL;
+}
+
+static void *emu_out_thread(void *arg)
+{
+	struct emu *emu = arg;
+	struct emu_io io;
+	int ret;
+
+	while (!emu_stop) {
+		io.inner.ep = emu->ep_out;
+		io.inner.flags = 0;
+		io.inner.length = sizeof(io.data);
+
+		ret = ioctl(emu->fd, USB_RAW_IOCTL_EP_READ, &io);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (emu->verbose)
+				perror("ioctl(USB_RAW_IOCTL_EP_READ)");
+			usleep(EMU_IDLE_WAIT_US);
+			continue;
+		}
+
+		emu->stat_out_xfers++;
+		emu_handle_out(emu, io.data, ret);
+	}
+
+	return NULL;
+}
+
+/* Enumeration */
+
+static void emu_set_configuration(struct emu *emu)
+{
+	pthread_t in_thread, out_thread;
+
+	if (emu->configured) {
+		emu_ep0_ack(emu);
+		return;
+	}
+
+	emu->ep_in = ioctl(emu->fd, USB_RAW_IOCTL_EP_ENABLE, &emu_ep_in);
+	if (emu->ep_in < 0)
+		emu_die("ioctl(USB_RAW_IOCTL_EP_ENABLE) in");
+
+	emu->ep_out = ioctl(emu->fd, USB_RAW_IOCTL_EP_ENABLE, &emu_ep_out);
+	if (emu->ep_out < 0)
+		emu_die("ioctl(USB_RAW_IOCTL_EP_ENABLE) out");
+
+	if (ioctl(emu->fd, USB_RAW_IOCTL_VBUS_DRAW,
+		  emu_config.bMaxPower * 2) < 0)
+		perror("ioctl(USB_RAW_IOCTL_VBUS_DRAW)");
+
+	if (ioctl(emu->fd, USB_RAW_IOCTL_CONFIGURE, 0) < 0)
+		emu_die("ioctl(USB_RAW_IOCTL_CONFIGURE)");
+
+	emu->configured = true;
+	emu->rx_start_us = emu_now_us();
+	emu->next_ka_us = emu->rx_start_us;
+
+	if (pthread_create(&in_thread, NULL, emu_in_thread, emu) ||
+	    pthread_create(&out_thread, NULL, emu_out_thread, emu))
+		emu_die("pthread_create");
+
+	emu_ep0_ack(emu);
+
+	printf("configured as %s\n",
+	       emu->fd_variant ? UDT1CRI_PRODUCT_FD : UDT1CRI_PRODUCT);
+}
+
+static void emu_get_descriptor(struct emu *emu,
+			       const struct usb_ctrlrequest *ctrl)
+{
+	const unsigned int type = ctrl->wValue >> 8;
+	const unsigned int index = ctrl->wValue & 0xff;
+	uint8_t buf[256];
+	int len;
+
+	switch (type) {
+	case USB_DT_DEVICE:
+		emu_ep0_write(emu, &emu_dev_desc, sizeof(emu_dev_desc),
+			      ctrl->wLength);
+		break;
+
+	case USB_DT_DEVICE_QUALIFIER:
+		emu_ep0_write(emu, &emu_qual_desc, sizeof(emu_qual_desc),
+			      ctrl->wLength);
+		break;
+
+	case USB_DT_CONFIG:
+		len = emu_config_desc(buf);
+		emu_ep0_write(emu, buf, len, ctrl->wLength);
+		break;
+
+	case USB_DT_STRING:
+		len = emu_string_desc(emu, index, buf);
+		if (len < 0)
+			emu_ep0_stall(emu);
+		else
+			emu_ep0_write(emu, buf, len, ctrl->wLength);
+		break;
+
+	default:
+		emu_ep0_stall(emu);
+		break;
+	}
+}
+
+static void emu_handle_control(struct emu *emu,
+			       const struct usb_ctrlrequest *ctrl)
+{
+	if ((ctrl->bRequestType & USB_TYPE_MASK) != USB_TYPE_STANDARD) {
+		emu_ep0_stall(emu);
+		return;
+	}
+
+	switch (ctrl->bRequest) {
+	case USB_REQ_GET_DESCRIPTOR:
+		emu_get_descriptor(emu, ctrl);
+		break;
+
+	case USB_REQ_SET_CONFIGURATION:
+		emu_set_configuration(emu);
+		break;
+
+	case USB_REQ_SET_INTERFACE:
+		emu_ep0_ack(emu);
+		break;
+
+	case USB_REQ_GET_STATUS: {
+		const uint8_t status[2] = { 0, 0 };
+
+		emu_ep0_write(emu, status, sizeof(status), ctrl->wLength);
+		break;
+	}
+
+	default:
+		emu_ep0_stall(emu);
+		break;
+	}
+}
+
+static void emu_print_stats(struct emu *emu)
+{
+	printf("in_xfers %llu out_xfers %llu rx_frames %llu tx_frames %llu\n"
+	       "rx_lost %u rsp_dropped %llu bad_msgs %llu\n",
+	       (unsigned long long)emu->stat_in_xfers,
+	       (unsigned long long)emu->stat_out_xfers,
+	       (unsigned long long)emu->stat_rx_frames,
+	       (unsigned long long)emu->stat_tx_frames, emu->rx_lost,
+	       (unsigned long long)emu->stat_rsp_dropped,
+	       (unsigned long long)emu->stat_bad_msgs);
+}
+
+static void emu_usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -d, --udc-driver NAME  UDC driver (dummy_udc)\n"
+		"  -D, --udc-device NAME  UDC device (dummy_udc.0)\n"
+		"  -f, --fd               emulate the UDT1FR-I CAN FD variant\n"
+		"  -r, --rx-rate N        received frames per second (0)\n"
+		"  -i, --rx-id ID         identifier of received frames (0x123)\n"
+		"  -b, --dev-buf N        frames buffered by the device (64)\n"
+		"  -n, --no-bus-timing    confirm frames as soon as received\n"
+		"  -v, --verbose\n",
+		prog);
+}
+
+int main(int argc, char **argv)
+{
+	static const struct option opts[] = {
+		{ "udc-driver", required_argument, NULL, 'd' },
+		{ "udc-device", required_argument, NULL, 'D' },
+		{ "fd", no_argument, NULL, 'f' },
+		{ "rx-rate", required_argument, NULL, 'r' },
+		{ "rx-id", required_argument, NULL, 'i' },
+		{ "dev-buf", required_argument, NULL, 'b' },
+		{ "no-bus-timing", no_argument, NULL, 'n' },
+		{ "verbose", no_argument, NULL, 'v' },
+		{ "help", no_argument, NULL, 'h' },
+		{}
+	};
+	pthread_condattr_t cond_attr;
+	struct emu *emu;
+	struct sigaction sa;
+	int opt;
+
+	emu = calloc(1, sizeof(*emu));
+	if (!emu)
+		emu_die("calloc");
+
+	emu->udc_driver = "dummy_udc";
+	emu->udc_device = "dummy_udc.0";
+	emu->rx_id = 0x123;
+	emu->dev_buf = 64;
+	emu->bus_timing = true;
+	emu->bitrate_kbps = 1000;
+
+	while ((opt = getopt_long(argc, argv, "d:D:fr:i:b:nvh", opts,
+				  NULL)) != -1) {
+		switch (opt) {
+		case 'd':
+			emu->udc_driver = optarg;
+			break;
+		case 'D':
+			emu->udc_device = optarg;
+			break;
+		case 'f':
+			emu->fd_variant = true;
+			break;
+		case 'r':
+			emu->rx_rate = strtoul(optarg, NULL, 0);
+			break;
+		case 'i':
+			emu->rx_id = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			emu->dev_buf = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			emu->bus_timing = false;
+			break;
+		case 'v':
+			emu->verbose = true;
+			break;
+		default:
+			emu_usage(argv[0]);
+			return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+
+	/* emu_in_thread() waits until a CLOCK_MONOTONIC deadline */
+	pthread_mutex_init(&emu->lock, NULL);
+	pthread_condattr_init(&cond_attr);
+	pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&emu->cond, &cond_attr);
+	pthread_condattr_destroy(&cond_attr);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = emu_sigint;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	emu->fd = open("/dev/raw-gadget", O_RDWR);
+	if (emu->fd < 0)
+		emu_die("open(/dev/raw-gadget)");
+
+	emu_raw_init(emu);
+
+	while (!emu_stop) {
+		struct emu_event event;
+
+		event.inner.type = 0;
+		event.inner.length = sizeof(event.ctrl);
+
+		if (ioctl(emu->fd, USB_RAW_IOCTL_EVENT_FETCH, &event) < 0) {
+			if (errno == EINTR)
+				continue;
+			emu_die("ioctl(USB_RAW_IOCTL_EVENT_FETCH)");
+		}
+
+		switch (event.inner.type) {
+		case USB_RAW_EVENT_CONNECT:
+			if (emu->verbose)
+				printf("connected\n");
+			break;
+
+		case USB_RAW_EVENT_CONTROL:
+			emu_handle_control(emu, &event.ctrl);
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	emu_print_stats(emu);
+	close(emu->fd);
+
+	return EXIT_SUCCESS;
+}
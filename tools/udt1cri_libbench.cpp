@@ -0,0 +1,347 @@
+/* Throughput and latency benchmark for libudt1cri
+ *
+ * Copyright (C) 2018 UniSwarm
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; version 2 of the License.
+ *
+ * Runs the measurements of udt1cri_bench through the libusb library
+ * instead of a SocketCAN interface, and prints them in the same format, so
+ * both paths can be compared against the same emulated device:
+ *
+ *  - RX latency runs from the time the emulator generated the frame to the
+ *    time receive() returns it,
+ *  - TX latency runs from send() to the echo of the frame, handed back
+ *    once the device has confirmed it on the bus.
+ *
+ * The receiving thread polls the ring, yielding the CPU between empty
+ * polls or sleeping for --poll-us.
+ */
+
+#include <getopt.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include "libudt1cri.hpp"
+#include "udt1cri_proto.h"
+
+namespace {
+
+constexpr size_t BENCH_MAX_SAMPLES = 1 << 22;
+constexpr size_t BENCH_BATCH = 64;
+
+/* Latency samples of one direction, in microseconds */
+struct bench_dir {
+	std::vector<uint32_t> samples;
+	uint64_t frames = 0;
+	uint64_t lost = 0;
+	uint32_t next_seq = 0;
+	bool seq_valid = false;
+
+	void add(const uint8_t *data)
+	{
+		uint32_t seq = udt1cri_get_le32(data);
+		uint32_t stamp = udt1cri_get_le32(data + 4);
+
+		/* a sequence going backwards is a restarted sender */
+		if (seq_valid && (int32_t)(seq - next_seq) > 0)
+			lost += seq - next_seq;
+		next_seq = seq + 1;
+		seq_valid = true;
+
+		frames++;
+		if (samples.size() < BENCH_MAX_SAMPLES)
+			samples.push_back(udt1cri_mono_us() - stamp);
+	}
+
+	void report(const char *name, double seconds)
+	{
+		size_t n = samples.size();
+
+		printf("%s: %llu frames, %.0f frames/s, %llu lost", name,
+		       (unsigned long long)frames, frames / seconds,
+		       (unsigned long long)lost);
+		if (!n) {
+			printf("\n");
+			return;
+		}
+
+		std::sort(samples.begin(), samples.end());
+		printf(", latency p50 %u us p99 %u us max %u us\n",
+		       samples[n / 2], samples[(n * 99) / 100], samples[n - 1]);
+	}
+};
+
+struct bench {
+	bool do_rx = true;
+	bool do_tx = true;
+	bool fd = false;
+	unsigned int rate = 1000;
+	unsigned int duration = 10;
+	unsigned int poll_us = 0;
+	uint32_t rx_id = 0x123;
+	uint32_t tx_id = 0x321;
+
+	std::atomic<bool> stop{ false };
+	/* set once the last echoes had time to come back */
+	std::atomic<bool> rx_stop{ false };
+	uint64_t tx_written = 0;
+	uint64_t tx_ring_full = 0;
+
+	bench_dir rx;
+	bench_dir tx;
+};
+
+/* Busy and total jiffies of all CPUs */
+void bench_cpu_jiffies(uint64_t *busy, uint64_t *total)
+{
+	unsigned long long v[8] = {};
+	FILE *f;
+	int i;
+
+	f = fopen("/proc/stat", "r");
+	if (!f) {
+		perror("/proc/stat");
+		exit(EXIT_FAILURE);
+	}
+	if (fscanf(f, "cpu %llu %llu %llu %llu %llu %llu %llu %llu", &v[0],
+		   &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7]) < 4) {
+		fprintf(stderr, "cannot parse /proc/stat\n");
+		exit(EXIT_FAILURE);
+	}
+	fclose(f);
+
+	*total = 0;
+	for (i = 0; i < 8; i++)
+		*total += v[i];
+	/* idle and iowait */
+	*busy = *total - v[3] - v[4];
+}
+
+void bench_rx_loop(struct bench *bench, udt1cri::device *dev)
+{
+	udt1cri::frame frames[BENCH_BATCH];
+
+	while (!bench->rx_stop) {
+		size_t n = dev->receive(frames, BENCH_BATCH);
+		size_t i;
+
+		if (!n) {
+			if (bench->poll_us)
+				usleep(bench->poll_us);
+			else
+				sched_yield();
+			continue;
+		}
+
+		for (i = 0; i < n; i++) {
+			const udt1cri::frame &f = frames[i];
+
+			if (f.len < UDT1CRI_BENCH_PAYLOAD_LEN)
+				continue;
+
+			if (f.flags & udt1cri::FRAME_ECHO)
+				bench->tx.add(f.data);
+			else if (f.id == bench->rx_id)
+				bench->rx.add(f.data);
+		}
+	}
+}
+
+void bench_tx_loop(struct bench *bench, udt1cri::device *dev)
+{
+	udt1cri::frame frame = {};
+	uint64_t period_ns = 1000000000ull / bench->rate;
+	struct timespec next;
+	uint32_t seq = 0;
+
+	frame.id = bench->tx_id;
+	frame.len = UDT1CRI_BENCH_PAYLOAD_LEN;
+	if (bench->fd)
+		frame.flags = udt1cri::FRAME_FDF | udt1cri::FRAME_BRS;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	while (!bench->stop) {
+		udt1cri_bench_payload(frame.data, seq);
+		if (!dev->send(&frame, 1)) {
+			/* the device is behind, retry the same frame */
+			bench->tx_ring_full++;
+			usleep(100);
+			continue;
+		}
+		bench->tx_written++;
+		seq++;
+
+		next.tv_nsec += period_ns;
+		while (next.tv_nsec >= 1000000000) {
+			next.tv_nsec -= 1000000000;
+			next.tv_sec++;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+	}
+}
+
+void bench_usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -B, --bus N           USB bus of the device (any)\n"
+		"  -A, --address N       USB address of the device (any)\n"
+		"  -m, --mode MODE       rx, tx or both (both)\n"
+		"  -r, --rate N          transmitted frames per second (1000)\n"
+		"  -d, --duration S      run time in seconds (10)\n"
+		"  -R, --rx-id ID        identifier of received frames (0x123)\n"
+		"  -T, --tx-id ID        identifier of transmitted frames (0x321)\n"
+		"  -f, --fd              transmit CAN FD frames\n"
+		"  -b, --bitrate KBPS    set the bitrate first\n"
+		"  -p, --poll-us N       sleep between empty polls (yield)\n",
+		prog);
+}
+
+} /* namespace */
+
+int main(int argc, char **argv)
+{
+	static const struct option opts[] = {
+		{ "bus", required_argument, NULL, 'B' },
+		{ "address", required_argument, NULL, 'A' },
+		{ "mode", required_argument, NULL, 'm' },
+		{ "rate", required_argument, NULL, 'r' },
+		{ "duration", required_argument, NULL, 'd' },
+		{ "rx-id", required_argument, NULL, 'R' },
+		{ "tx-id", required_argument, NULL, 'T' },
+		{ "fd", no_argument, NULL, 'f' },
+		{ "bitrate", required_argument, NULL, 'b' },
+		{ "poll-us", required_argument, NULL, 'p' },
+		{ "help", no_argument, NULL, 'h' },
+		{}
+	};
+	udt1cri::options dev_opts;
+	struct bench bench;
+	unsigned int bitrate = 0;
+	uint64_t busy0, total0, busy1, total1;
+	uint64_t start_ns, frames;
+	double seconds, busy_s;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "B:A:m:r:d:R:T:fb:p:h", opts,
+				  NULL)) != -1) {
+		switch (opt) {
+		case 'B':
+			dev_opts.bus = strtol(optarg, NULL, 0);
+			break;
+		case 'A':
+			dev_opts.address = strtol(optarg, NULL, 0);
+			break;
+		case 'm':
+			bench.do_rx = strcmp(optarg, "tx") != 0;
+			bench.do_tx = strcmp(optarg, "rx") != 0;
+			break;
+		case 'r':
+			bench.rate = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			bench.duration = strtoul(optarg, NULL, 0);
+			break;
+		case 'R':
+			bench.rx_id = strtoul(optarg, NULL, 0);
+			break;
+		case 'T':
+			bench.tx_id = strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			bench.fd = true;
+			break;
+		case 'b':
+			bitrate = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			bench.poll_us = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			bench_usage(argv[0]);
+			return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+	if (!bench.rate || !bench.duration) {
+		bench_usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	try {
+		udt1cri::device dev(dev_opts);
+		std::thread tx_thread;
+
+		if (bench.fd && !dev.fd()) {
+			fprintf(stderr, "the device does not support CAN FD\n");
+			return EXIT_FAILURE;
+		}
+		if (bitrate)
+			dev.set_bitrate(bitrate);
+
+		bench.rx.samples.reserve(BENCH_MAX_SAMPLES);
+		bench.tx.samples.reserve(BENCH_MAX_SAMPLES);
+
+		bench_cpu_jiffies(&busy0, &total0);
+		start_ns = udt1cri_mono_ns();
+
+		/* echoes are received even in tx mode */
+		std::thread rx_thread(bench_rx_loop, &bench, &dev);
+		if (bench.do_tx)
+			tx_thread = std::thread(bench_tx_loop, &bench, &dev);
+
+		sleep(bench.duration);
+		bench.stop = true;
+		if (bench.do_tx)
+			tx_thread.join();
+
+		/* Let the last echoes come back while still receiving, so
+		 * their latency is not the wait
+		 */
+		usleep(200000);
+		bench.rx_stop = true;
+		rx_thread.join();
+
+		seconds = (udt1cri_mono_ns() - start_ns) / 1e9;
+		bench_cpu_jiffies(&busy1, &total1);
+		busy_s = (double)(busy1 - busy0) / sysconf(_SC_CLK_TCK);
+
+		if (bench.do_rx)
+			bench.rx.report("rx", seconds);
+		if (bench.do_tx) {
+			bench.tx.report("tx", seconds);
+			printf("tx: %llu written, %llu unconfirmed, %llu ring full\n",
+			       (unsigned long long)bench.tx_written,
+			       (unsigned long long)(bench.tx_written -
+						    bench.tx.frames),
+			       (unsigned long long)bench.tx_ring_full);
+		}
+
+		frames = bench.rx.frames + bench.tx.frames;
+		printf("cpu: %.1f%% busy, %.2f us per frame\n",
+		       total1 > total0 ?
+			       100.0 * (busy1 - busy0) / (total1 - total0) :
+			       0,
+		       frames ? busy_s * 1e6 / frames : 0);
+
+		const udt1cri::stats st = dev.stats();
+		printf("rx_overruns %llu\n", (unsigned long long)st.rx_overruns);
+		printf("xfer_errors %llu\n", (unsigned long long)st.xfer_errors);
+		printf("format_errors %llu\n",
+		       (unsigned long long)st.format_errors);
+	} catch (const udt1cri::error &e) {
+		fprintf(stderr, "%s\n", e.what());
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
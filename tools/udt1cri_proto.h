@@ -0,0 +1,167 @@
+/* UDT1CRI USB protocol, as spoken by udt1cri_usb.c, for the userspace tools
+ *
+ * Copyright (C) 2018 UniSwarm
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; version 2 of the License.
+ */
+
+#ifndef UDT1CRI_PROTO_H
+#define UDT1CRI_PROTO_H
+
+#include <stdint.h>
+#include <time.h>
+
+#define UDT1CRI_VENDOR_ID 0x04d8
+#define UDT1CRI_PRODUCT_ID 0xee0c
+#define UDT1CRI_PRODUCT "UDT1CR-I"
+#define UDT1CRI_PRODUCT_FD "UDT1FR-I"
+
+#define UDT1CRI_USB_EP_IN 0x81
+#define UDT1CRI_USB_EP_OUT 0x01
+#define UDT1CRI_USB_MAX_PACKET 512
+#define UDT1CRI_USB_BUFF_SIZE 512
+
+#define UDT1CRI_USB_MSG_SIZE 20
+#define UDT1CRI_USB_FD_MSG_SIZE 76
+
+#define UDT1CRI_CMD_RECEIVE_MESSAGE 0xE3
+#define UDT1CRI_CMD_I_AM_ALIVE_FROM_CAN 0xF5
+#define UDT1CRI_CMD_I_AM_ALIVE_FROM_USB 0xF7
+#define UDT1CRI_CMD_CHANGE_BIT_RATE 0xA1
+#define UDT1CRI_CMD_CHANGE_DATA_BIT_RATE 0xA2
+#define UDT1CRI_CMD_TRANSMIT_MESSAGE_EV 0xA3
+#define UDT1CRI_CMD_SETUP_TERMINATION_RESISTANCE 0xA8
+#define UDT1CRI_CMD_READ_FW_VERSION 0xA9
+#define UDT1CRI_CMD_NOTHING_TO_SEND 0xFF
+#define UDT1CRI_CMD_TRANSMIT_MESSAGE_RSP 0xE2
+
+#define UDT1CRI_VER_REQ_USB 1
+#define UDT1CRI_VER_REQ_CAN 2
+
+#define UDT1CRI_DLC_MASK 0x0f
+
+#define FLAG_CAN_EID 0x01
+#define FLAG_CAN_RTR 0x02
+#define FLAG_CAN_FDF 0x08
+#define FLAG_CAN_BRS 0x10
+#define FLAG_CAN_ESI 0x20
+
+/* CAN frame, classic frames use the first UDT1CRI_USB_MSG_SIZE bytes */
+struct __attribute__((packed)) udt1cri_usb_msg_can {
+	uint8_t cmd_id;
+	uint8_t dlc;
+	uint8_t flags;
+	uint8_t checksum;
+	uint32_t eid; /* little endian */
+	uint32_t timestamp; /* little endian, microseconds */
+	uint8_t data[64];
+};
+
+struct __attribute__((packed)) udt1cri_usb_msg_ka_usb {
+	uint8_t cmd_id;
+	uint8_t termination_state;
+	uint8_t soft_ver_major;
+	uint8_t soft_ver_minor;
+	uint8_t unused[16];
+};
+
+struct __attribute__((packed)) udt1cri_usb_msg_ka_can {
+	uint8_t cmd_id;
+	uint8_t tx_err_cnt;
+	uint8_t rx_err_cnt;
+	uint8_t rx_buff_ovfl;
+	uint8_t tx_bus_off;
+	uint16_t can_bitrate; /* big endian, kbps */
+	uint16_t rx_lost; /* little endian */
+	uint8_t can_stat;
+	uint8_t soft_ver_major;
+	uint8_t soft_ver_minor;
+	uint8_t debug_mode;
+	uint8_t test_complete;
+	uint8_t test_result;
+	uint8_t unused[5];
+};
+
+struct __attribute__((packed)) udt1cri_usb_msg_change_bitrate {
+	uint8_t cmd_id;
+	uint16_t bitrate; /* big endian, kbps */
+	uint8_t unused[17];
+};
+
+struct __attribute__((packed)) udt1cri_usb_msg_termination {
+	uint8_t cmd_id;
+	uint8_t termination;
+	uint8_t unused[18];
+};
+
+struct __attribute__((packed)) udt1cri_usb_msg_fw_ver {
+	uint8_t cmd_id;
+	uint8_t pic;
+	uint8_t unused[18];
+};
+
+/* USB traffic capture of the driver, read from the capture<cpu> files of
+ * its debugfs directory. Each record is this header, followed by the len
+ * bytes of a bulk transfer and padded to 8 bytes. seq counts all the
+ * records, so a gap in seq is a record dropped on a full buffer, and lost
+ * counts those dropped so far.
+ */
+enum udt1cri_capture_dir {
+	UDT1CRI_CAPTURE_RX,
+	UDT1CRI_CAPTURE_TX,
+	UDT1CRI_CAPTURE_CMD,
+};
+
+struct udt1cri_capture_hdr {
+	uint64_t time_ns; /* CLOCK_MONOTONIC */
+	uint32_t seq;
+	uint32_t lost;
+	uint16_t len;
+	uint8_t dir;
+	uint8_t reserved[5];
+};
+
+#define UDT1CRI_CAPTURE_ALIGN(len) (((len) + 7) & ~7u)
+
+/* Benchmark payload: a sequence number and the CLOCK_MONOTONIC time the
+ * frame was generated at, both little endian. The emulator and the
+ * benchmark run on the same host, so their clocks agree.
+ */
+#define UDT1CRI_BENCH_PAYLOAD_LEN 8
+
+static inline uint64_t udt1cri_mono_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline uint32_t udt1cri_mono_us(void)
+{
+	return (uint32_t)(udt1cri_mono_ns() / 1000);
+}
+
+static inline void udt1cri_put_le32(uint8_t *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static inline uint32_t udt1cri_get_le32(const uint8_t *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline void udt1cri_bench_payload(uint8_t *data, uint32_t seq)
+{
+	udt1cri_put_le32(data, seq);
+	udt1cri_put_le32(data + 4, udt1cri_mono_us());
+}
+
+#endif /* UDT1CRI_PROTO_H */
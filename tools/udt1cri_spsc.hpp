@@ -0,0 +1,115 @@
+/* Lock-free single producer, single consumer ring
+ *
+ * Copyright (C) 2018 UniSwarm
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; version 2 of the License.
+ *
+ * One thread pushes, another pops, in batches and without system calls.
+ * Each side keeps its index and a cached copy of the other side's index on
+ * its own cache line, so the shared indexes are only read again when the
+ * cached copy says the ring looks full or empty.
+ */
+
+#ifndef UDT1CRI_SPSC_HPP
+#define UDT1CRI_SPSC_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+namespace udt1cri {
+
+template <typename T> class spsc_ring {
+public:
+	/* size is rounded up to a power of 2 */
+	explicit spsc_ring(size_t size)
+	{
+		size_t cap = 1;
+
+		while (cap < size)
+			cap <<= 1;
+
+		buf_.resize(cap);
+		mask_ = cap - 1;
+	}
+
+	spsc_ring(const spsc_ring &) = delete;
+	spsc_ring &operator=(const spsc_ring &) = delete;
+
+	size_t capacity() const
+	{
+		return mask_ + 1;
+	}
+
+	/* Producer side: append up to n items, return how many fit */
+	size_t push(const T *items, size_t n)
+	{
+		const size_t head = head_.load(std::memory_order_relaxed);
+		size_t room = capacity() - (head - tail_cache_);
+		size_t i;
+
+		if (room < n) {
+			tail_cache_ = tail_.load(std::memory_order_acquire);
+			room = capacity() - (head - tail_cache_);
+		}
+
+		n = std::min(n, room);
+		for (i = 0; i < n; i++)
+			buf_[(head + i) & mask_] = items[i];
+
+		head_.store(head + n, std::memory_order_release);
+
+		return n;
+	}
+
+	/* Consumer side: take up to n items, return how many were taken */
+	size_t pop(T *items, size_t n)
+	{
+		const size_t tail = tail_.load(std::memory_order_relaxed);
+		size_t avail = head_cache_ - tail;
+		size_t i;
+
+		if (avail < n) {
+			head_cache_ = head_.load(std::memory_order_acquire);
+			avail = head_cache_ - tail;
+		}
+
+		n = std::min(n, avail);
+		for (i = 0; i < n; i++)
+			items[i] = buf_[(tail + i) & mask_];
+
+		tail_.store(tail + n, std::memory_order_release);
+
+		return n;
+	}
+
+	/* Consumer side: whether nothing is waiting */
+	bool empty()
+	{
+		if (head_cache_ != tail_.load(std::memory_order_relaxed))
+			return false;
+
+		head_cache_ = head_.load(std::memory_order_acquire);
+
+		return head_cache_ == tail_.load(std::memory_order_relaxed);
+	}
+
+private:
+	std::vector<T> buf_;
+	size_t mask_;
+
+	/* producer */
+	alignas(64) std::atomic<size_t> head_{ 0 };
+	size_t tail_cache_ = 0;
+
+	/* consumer */
+	alignas(64) std::atomic<size_t> tail_{ 0 };
+	size_t head_cache_ = 0;
+};
+
+} /* namespace udt1cri */
+
+#endif /* UDT1CRI_SPSC_HPP */
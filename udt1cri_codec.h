@@ -0,0 +1,210 @@
+/* CAN frame messages of the UniSwarm UDT1CRI CAN debugger
+ *
+ * Copyright (C) 2018 UniSwarm
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; version 2 of the License.
+ *
+ * Splitting of bulk IN transfers, decoding of received frames and encoding
+ * of sent ones, without USB, shared by udt1cri_usb.c and its KUnit suite.
+ */
+
+#ifndef _UDT1CRI_CODEC_H
+#define _UDT1CRI_CODEC_H
+
+#include <asm/byteorder.h>
+#include <linux/can.h>
+#include <linux/can/dev.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/types.h>
+#include <linux/version.h>
+
+#define UDT1CRI_USB_MSG_SIZE 20
+#define UDT1CRI_USB_FD_MSG_SIZE 76
+
+/* UDT1CRI command id */
+#define UDT1CRI_CMD_RECEIVE_MESSAGE 0xE3
+#define UDT1CRI_CMD_I_AM_ALIVE_FROM_CAN 0xF5
+#define UDT1CRI_CMD_I_AM_ALIVE_FROM_USB 0xF7
+#define UDT1CRI_CMD_CHANGE_BIT_RATE 0xA1
+#define UDT1CRI_CMD_CHANGE_DATA_BIT_RATE 0xA2
+#define UDT1CRI_CMD_TRANSMIT_MESSAGE_EV 0xA3
+#define UDT1CRI_CMD_SETUP_TERMINATION_RESISTANCE 0xA8
+#define UDT1CRI_CMD_READ_FW_VERSION 0xA9
+#define UDT1CRI_CMD_NOTHING_TO_SEND 0xFF
+#define UDT1CRI_CMD_TRANSMIT_MESSAGE_RSP 0xE2
+
+#define UDT1CRI_DLC_MASK 0xf
+#define UDT1CRI_DLC_RTR_MASK 0x40
+
+/* CAN frame */
+struct __packed udt1cri_usb_msg_can {
+	u8 cmd_id;
+	u8 dlc;
+	u8 flags;
+	u8 checksum;
+	u32 eid;
+	u32 timestamp;
+	u8 data[8];
+};
+#define FLAG_CAN_EID 0x01
+#define FLAG_CAN_RTR 0x02
+#define FLAG_CAN_FDF 0x08
+#define FLAG_CAN_BRS 0x10
+#define FLAG_CAN_ESI 0x20
+
+/* CAN FD frame, UDT1FR-I only
+ *
+ * Sent and received in place of udt1cri_usb_msg_can when FLAG_CAN_FDF is
+ * set, dlc then holds the DLC code. Transmission responses keep the short
+ * format.
+ */
+struct __packed udt1cri_usb_msg_canfd {
+	u8 cmd_id;
+	u8 dlc;
+	u8 flags;
+	u8 checksum;
+	u32 eid;
+	u32 timestamp;
+	u8 data[CANFD_MAX_DLEN];
+};
+
+/* Length of the message at the head of the len bytes at buf, or 0 if it
+ * is truncated. Only received CAN FD frames are longer than
+ * UDT1CRI_USB_MSG_SIZE.
+ */
+static inline unsigned int udt1cri_usb_msg_len(const u8 *buf,
+					       unsigned int len, bool fd)
+{
+	const struct udt1cri_usb_msg_can *can_msg =
+		(const struct udt1cri_usb_msg_can *)buf;
+	unsigned int msg_len = UDT1CRI_USB_MSG_SIZE;
+
+	if (len < UDT1CRI_USB_MSG_SIZE)
+		return 0;
+
+	if (fd && can_msg->cmd_id == UDT1CRI_CMD_RECEIVE_MESSAGE &&
+	    (can_msg->flags & FLAG_CAN_FDF))
+		msg_len = UDT1CRI_USB_FD_MSG_SIZE;
+
+	return msg_len <= len ? msg_len : 0;
+}
+
+/* Messages stacked in a bulk IN transfer */
+struct udt1cri_usb_split {
+	u8 *buf;
+	unsigned int len;
+	unsigned int pos; /* of the next message */
+	bool fd;
+};
+
+static inline void udt1cri_usb_split_init(struct udt1cri_usb_split *split,
+					  u8 *buf, unsigned int len, bool fd)
+{
+	split->buf = buf;
+	split->len = len;
+	split->pos = 0;
+	split->fd = fd;
+}
+
+/* Next message of the transfer, or NULL at its end or on a truncated
+ * message, see udt1cri_usb_split_truncated().
+ */
+static inline u8 *udt1cri_usb_split_next(struct udt1cri_usb_split *split)
+{
+	u8 *msg = split->buf + split->pos;
+	unsigned int len;
+
+	if (split->pos >= split->len)
+		return NULL;
+
+	len = udt1cri_usb_msg_len(msg, split->len - split->pos, split->fd);
+	if (!len)
+		return NULL;
+
+	split->pos += len;
+
+	return msg;
+}
+
+static inline bool
+udt1cri_usb_split_truncated(const struct udt1cri_usb_split *split)
+{
+	return split->pos < split->len;
+}
+
+/* Decode a RECEIVE_MESSAGE message into a zeroed frame. For a classic
+ * frame, cfd points to a struct can_frame, which shares the layout of its
+ * first CAN_MAX_DLEN data bytes.
+ */
+static inline void
+udt1cri_usb_decode_can(const struct udt1cri_usb_msg_can *msg, bool fd,
+		       struct canfd_frame *cfd)
+{
+	cfd->can_id = __le32_to_cpu(msg->eid);
+	if (msg->flags & FLAG_CAN_EID)
+		cfd->can_id |= CAN_EFF_FLAG;
+
+	if (fd) {
+		const struct udt1cri_usb_msg_canfd *fd_msg =
+			(const struct udt1cri_usb_msg_canfd *)msg;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 11, 0)
+		cfd->len = can_dlc2len(msg->dlc & UDT1CRI_DLC_MASK);
+#else
+		cfd->len = can_fd_dlc2len(msg->dlc & UDT1CRI_DLC_MASK);
+#endif
+		if (msg->flags & FLAG_CAN_BRS)
+			cfd->flags |= CANFD_BRS;
+		if (msg->flags & FLAG_CAN_ESI)
+			cfd->flags |= CANFD_ESI;
+
+		memcpy(cfd->data, fd_msg->data, cfd->len);
+		return;
+	}
+
+	if (msg->flags & FLAG_CAN_RTR)
+		cfd->can_id |= CAN_RTR_FLAG;
+
+	/* DLC 9 to 15 still mean 8 bytes on a classic frame */
+	cfd->len = min_t(u8, msg->dlc & UDT1CRI_DLC_MASK, CAN_MAX_DLEN);
+	memcpy(cfd->data, msg->data, cfd->len);
+}
+
+/* Encode a frame into a TRANSMIT_MESSAGE_EV message, return its length.
+ * A classic frame only uses the first UDT1CRI_USB_MSG_SIZE bytes of msg.
+ */
+static inline unsigned int
+udt1cri_usb_encode_can(const struct canfd_frame *cfd, bool fd,
+		       struct udt1cri_usb_msg_canfd *msg)
+{
+	msg->cmd_id = UDT1CRI_CMD_TRANSMIT_MESSAGE_EV;
+	msg->flags = 0;
+	msg->eid = __cpu_to_le32(cfd->can_id);
+	if (cfd->can_id & CAN_EFF_FLAG)
+		msg->flags |= FLAG_CAN_EID;
+	if (cfd->can_id & CAN_RTR_FLAG)
+		msg->flags |= FLAG_CAN_RTR;
+
+	memcpy(msg->data, cfd->data, cfd->len);
+
+	if (!fd) {
+		msg->dlc = cfd->len;
+		return UDT1CRI_USB_MSG_SIZE;
+	}
+
+	msg->flags |= FLAG_CAN_FDF;
+	if (cfd->flags & CANFD_BRS)
+		msg->flags |= FLAG_CAN_BRS;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 11, 0)
+	msg->dlc = can_len2dlc(cfd->len);
+#else
+	msg->dlc = can_fd_len2dlc(cfd->len);
+#endif
+
+	return UDT1CRI_USB_FD_MSG_SIZE;
+}
+
+#endif /* _UDT1CRI_CODEC_H */
@@ -0,0 +1,49 @@
+/* Index arithmetic of the TX context ring of the UniSwarm UDT1CRI driver
+ *
+ * Copyright (C) 2018 UniSwarm
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; version 2 of the License.
+ *
+ * The ring has cnt entries, a power of 2, and free running indexes which
+ * wrap around. Entries are claimed at head by one side and released at tail,
+ * in order, by the other. Shared by udt1cri_usb.c and its KUnit suite.
+ */
+
+#ifndef _UDT1CRI_RING_H
+#define _UDT1CRI_RING_H
+
+#include <asm/barrier.h>
+#include <linux/types.h>
+
+/* Entry of the index pos */
+static inline unsigned int udt1cri_ring_slot(unsigned int pos,
+					     unsigned int cnt)
+{
+	return pos & (cnt - 1);
+}
+
+/* Entries left to claim from head. Pairs with udt1cri_ring_release(), so
+ * an entry is only claimed again once its release is visible.
+ */
+static inline unsigned int udt1cri_ring_free(unsigned int head,
+					     const unsigned int *tail,
+					     unsigned int cnt)
+{
+	return cnt - (head - smp_load_acquire(tail));
+}
+
+/* Release the entry at tail */
+static inline void udt1cri_ring_release(unsigned int *tail)
+{
+	smp_store_release(tail, *tail + 1);
+}
+
+/* Whether the entry of the index pos was released already */
+static inline bool udt1cri_ring_released(unsigned int pos, unsigned int tail)
+{
+	return (int)(pos - tail) < 0;
+}
+
+#endif /* _UDT1CRI_RING_H */
@@ -0,0 +1,144 @@
+/* Tracepoints of the UniSwarm UDT1CRI CAN debugger driver
+ *
+ * Copyright (C) 2018 UniSwarm
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; version 2 of the License.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM udt1cri_usb
+
+#if !defined(_UDT1CRI_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _UDT1CRI_TRACE_H
+
+#include <linux/can.h>
+#include <linux/netdevice.h>
+#include <linux/tracepoint.h>
+
+/* A frame took a TX context and joined the pending transfer */
+TRACE_EVENT(udt1cri_tx_enqueue,
+	TP_PROTO(const struct net_device *netdev, u32 ctx, canid_t can_id,
+		 u8 len),
+	TP_ARGS(netdev, ctx, can_id, len),
+	TP_STRUCT__entry(
+		__field(int, ifindex)
+		__field(u32, ctx)
+		__field(canid_t, can_id)
+		__field(u8, len)
+	),
+	TP_fast_assign(
+		__entry->ifindex = netdev->ifindex;
+		__entry->ctx = ctx;
+		__entry->can_id = can_id;
+		__entry->len = len;
+	),
+	TP_printk("ifindex=%d ctx=%u can_id=0x%08x len=%u", __entry->ifindex,
+		  __entry->ctx, __entry->can_id, __entry->len)
+);
+
+/* A bulk OUT transfer was submitted, ctx and can_id are those of its
+ * first CAN frame, if any.
+ */
+TRACE_EVENT(udt1cri_tx_submit,
+	TP_PROTO(const struct net_device *netdev, u32 ctx, canid_t can_id,
+		 unsigned int nframes, unsigned int nmsgs, int err),
+	TP_ARGS(netdev, ctx, can_id, nframes, nmsgs, err),
+	TP_STRUCT__entry(
+		__field(int, ifindex)
+		__field(u32, ctx)
+		__field(canid_t, can_id)
+		__field(unsigned int, nframes)
+		__field(unsigned int, nmsgs)
+		__field(int, err)
+	),
+	TP_fast_assign(
+		__entry->ifindex = netdev->ifindex;
+		__entry->ctx = ctx;
+		__entry->can_id = can_id;
+		__entry->nframes = nframes;
+		__entry->nmsgs = nmsgs;
+		__entry->err = err;
+	),
+	TP_printk("ifindex=%d ctx=%u can_id=0x%08x nframes=%u nmsgs=%u err=%d",
+		  __entry->ifindex, __entry->ctx, __entry->can_id,
+		  __entry->nframes, __entry->nmsgs, __entry->err)
+);
+
+/* A bulk OUT transfer completed, latency_us after its submission */
+TRACE_EVENT(udt1cri_tx_complete,
+	TP_PROTO(const struct net_device *netdev, u32 ctx, canid_t can_id,
+		 unsigned int nframes, int status, s64 latency_us),
+	TP_ARGS(netdev, ctx, can_id, nframes, status, latency_us),
+	TP_STRUCT__entry(
+		__field(int, ifindex)
+		__field(u32, ctx)
+		__field(canid_t, can_id)
+		__field(unsigned int, nframes)
+		__field(int, status)
+		__field(s64, latency_us)
+	),
+	TP_fast_assign(
+		__entry->ifindex = netdev->ifindex;
+		__entry->ctx = ctx;
+		__entry->can_id = can_id;
+		__entry->nframes = nframes;
+		__entry->status = status;
+		__entry->latency_us = latency_us;
+	),
+	TP_printk("ifindex=%d ctx=%u can_id=0x%08x nframes=%u status=%d latency_us=%lld",
+		  __entry->ifindex, __entry->ctx, __entry->can_id,
+		  __entry->nframes, __entry->status, __entry->latency_us)
+);
+
+/* A bulk IN transfer was decoded into nframes frames */
+TRACE_EVENT(udt1cri_rx_xfer,
+	TP_PROTO(const struct net_device *netdev, unsigned int len,
+		 unsigned int nmsgs, unsigned int nframes),
+	TP_ARGS(netdev, len, nmsgs, nframes),
+	TP_STRUCT__entry(
+		__field(int, ifindex)
+		__field(unsigned int, len)
+		__field(unsigned int, nmsgs)
+		__field(unsigned int, nframes)
+	),
+	TP_fast_assign(
+		__entry->ifindex = netdev->ifindex;
+		__entry->len = len;
+		__entry->nmsgs = nmsgs;
+		__entry->nframes = nframes;
+	),
+	TP_printk("ifindex=%d len=%u nmsgs=%u nframes=%u", __entry->ifindex,
+		  __entry->len, __entry->nmsgs, __entry->nframes)
+);
+
+/* NAPI handed a received frame, echo or error frame to the stack */
+TRACE_EVENT(udt1cri_rx_deliver,
+	TP_PROTO(const struct net_device *netdev, canid_t can_id, u8 len,
+		 u32 timestamp),
+	TP_ARGS(netdev, can_id, len, timestamp),
+	TP_STRUCT__entry(
+		__field(int, ifindex)
+		__field(canid_t, can_id)
+		__field(u8, len)
+		__field(u32, timestamp)
+	),
+	TP_fast_assign(
+		__entry->ifindex = netdev->ifindex;
+		__entry->can_id = can_id;
+		__entry->len = len;
+		__entry->timestamp = timestamp;
+	),
+	TP_printk("ifindex=%d can_id=0x%08x len=%u timestamp=%u",
+		  __entry->ifindex, __entry->can_id, __entry->len,
+		  __entry->timestamp)
+);
+
+#endif /* _UDT1CRI_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE udt1cri_trace
+#include <trace/define_trace.h>
@@ -19,52 +19,156 @@
  */
 
 #include <asm/unaligned.h>
+#include <linux/bitmap.h>
 #include <linux/can.h>
 #include <linux/can/dev.h>
 #include <linux/can/error.h>
+#include <linux/completion.h>
+#include <linux/debugfs.h>
+#include <linux/ethtool.h>
+#include <linux/hrtimer.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/net_tstamp.h>
 #include <linux/netdevice.h>
+#include <linux/rcupdate.h>
+#include <linux/relay.h>
+#include <linux/seq_file.h>
 #include <linux/signal.h>
 #include <linux/slab.h>
+#include <linux/timecounter.h>
+#include <linux/uaccess.h>
+#include <linux/u64_stats_sync.h>
 #include <linux/usb.h>
 #include <linux/version.h>
+#include <linux/workqueue.h>
+
+#include "udt1cri_codec.h"
+#include "udt1cri_ring.h"
+
+#define CREATE_TRACE_POINTS
+#include "udt1cri_trace.h"
 
 /* vendor and product id */
 #define UDT1CRI_MODULE_NAME "udt1cri_usb"
 #define UDT1CRI_VENDOR_ID 0x04d8
 #define UDT1CRI_PRODUCT_ID 0xee0c
 
+/* The CAN FD variant enumerates with the same ids, and is told apart by its
+ * product string, as the udev rules do.
+ */
+#define UDT1CRI_PRODUCT_FD "UDT1FR-I"
+
 /* driver constants */
-#define UDT1CRI_MAX_RX_URBS 20
 #define UDT1CRI_MAX_TX_URBS 20
-#define UDT1CRI_CTX_FREE UDT1CRI_MAX_TX_URBS
+
+/* RX URB count, RX buffer size and TX context count can be changed with
+ * ethtool -G while the interface is down. The TX context count is rounded
+ * up to a power of 2.
+ */
+#define UDT1CRI_RX_URBS_DEFAULT 20
+#define UDT1CRI_RX_URBS_MAX 256
+#define UDT1CRI_TX_CTX_DEFAULT 64
+#define UDT1CRI_TX_CTX_MIN 8
+#define UDT1CRI_TX_CTX_MAX 1024
 
 /* RX buffer must be bigger than msg size since at the
- * beggining USB messages are stacked.
+ * beggining USB messages are stacked. Its size is a multiple of the high
+ * speed bulk packet size.
  */
 #define UDT1CRI_USB_RX_BUFF_SIZE 512
-#define UDT1CRI_USB_TX_BUFF_SIZE (sizeof(struct udt1cri_usb_msg))
+#define UDT1CRI_USB_RX_BUFF_SIZE_MAX 16384
+
+/* TX messages are stacked the same way, up to one full bulk transfer */
+#define UDT1CRI_USB_TX_BUFF_SIZE 512
+#define UDT1CRI_TX_MAX_MSGS (UDT1CRI_USB_TX_BUFF_SIZE / UDT1CRI_USB_MSG_SIZE)
+#define UDT1CRI_TX_FLUSH_DELAY_US 100
+#define UDT1CRI_TX_XFER_HIST_LEN 5 /* ilog2(UDT1CRI_TX_MAX_MSGS) + 1 */
+
+/* Frames in flight are echoed anyway when the device confirms none of them
+ * for this long.
+ */
+#define UDT1CRI_TX_CONFIRM_TIMEOUT HZ
+
+/* Commands wait in their own queue, a power of 2, and are sent in order on
+ * their own transfer. The whole queue fits in one transfer.
+ */
+#define UDT1CRI_CMD_QUEUE_LEN 16
+#define UDT1CRI_CMD_BUFF_SIZE (UDT1CRI_CMD_QUEUE_LEN * UDT1CRI_USB_MSG_SIZE)
+
+/* Periodic frames sent by the driver itself. Those due within the slack of
+ * each other share a transfer. They leave a few contexts to the frames of
+ * the network stack.
+ */
+#define UDT1CRI_PERIODIC_MAX 256
+#define UDT1CRI_PERIODIC_CTX_RESERVE 4
+#define UDT1CRI_PERIODIC_MIN_US 100
+#define UDT1CRI_PERIODIC_SLACK_NS (50 * NSEC_PER_USEC)
+
+/* Relay buffers of the USB traffic capture, per CPU */
+#define UDT1CRI_CAPTURE_SUBBUF_SIZE (256 * 1024)
+#define UDT1CRI_CAPTURE_SUBBUFS 8
+
+/* Received frames wait for NAPI in a queue of bounded length */
+#define UDT1CRI_RX_QUEUE_MAX 1024
+#define UDT1CRI_RX_POLL_HIST_LEN 7 /* ilog2(NAPI_POLL_WEIGHT) + 1 */
+#define UDT1CRI_RX_XFER_HIST_LEN 6
+
+/* Received frames can be held for up to this long before NAPI runs. With
+ * adaptive coalescing, they are only held while the frame rate measured
+ * over UDT1CRI_RX_ADAPT_PERIOD is high, with some hysteresis.
+ */
+#define UDT1CRI_RX_COALESCE_USECS_MAX 10000
+#define UDT1CRI_RX_ADAPT_PERIOD (HZ / 10)
+#define UDT1CRI_RX_ADAPT_RATE_HIGH 2000 /* frames per second */
+#define UDT1CRI_RX_ADAPT_RATE_LOW 1000
+
+/* debugfs histograms: bucket 0 counts zeros, bucket n values from 2^(n-1)
+ * to 2^n - 1, and the last one everything above.
+ */
+#define UDT1CRI_HIST_LEN 16
+
+/* The device timestamps frames with a free running 32-bit microsecond
+ * counter. It wraps every 71 minutes, so the timecounter is refreshed
+ * every second, and restarted from host time when no timestamp was seen
+ * for half a wrap.
+ */
+#define UDT1CRI_TS_HZ 1000000
+#define UDT1CRI_TS_HALF_WRAP_NS \
+	(((u64)1 << 31) * (NSEC_PER_SEC / UDT1CRI_TS_HZ))
+#define UDT1CRI_TS_WORK_PERIOD HZ
+
+/* The bus load is computed over the last 1, 10 and 100 periods of 100 ms
+ * from samples of the traffic totals.
+ */
+#define UDT1CRI_LOAD_PERIOD (HZ / 10)
+#define UDT1CRI_LOAD_WINDOWS 3
+#define UDT1CRI_LOAD_SAMPLES 101
+
+/* Drift against host time is estimated over 10 s windows, and the counter
+ * frequency is trusted within 1000 ppm.
+ */
+#define UDT1CRI_TS_DRIFT_WINDOW_NS (10 * NSEC_PER_SEC)
+#define UDT1CRI_TS_MAX_PPM 1000
 
 /* UDT1CRI endpoint numbers */
 #define UDT1CRI_USB_EP_IN 1
 #define UDT1CRI_USB_EP_OUT 1
 
-/* UDT1CRI command id */
-#define UDT1CRI_CMD_RECEIVE_MESSAGE 0xE3
-#define UDT1CRI_CMD_I_AM_ALIVE_FROM_CAN 0xF5
-#define UDT1CRI_CMD_I_AM_ALIVE_FROM_USB 0xF7
-#define UDT1CRI_CMD_CHANGE_BIT_RATE 0xA1
-#define UDT1CRI_CMD_TRANSMIT_MESSAGE_EV 0xA3
-#define UDT1CRI_CMD_SETUP_TERMINATION_RESISTANCE 0xA8
-#define UDT1CRI_CMD_READ_FW_VERSION 0xA9
-#define UDT1CRI_CMD_NOTHING_TO_SEND 0xFF
-#define UDT1CRI_CMD_TRANSMIT_MESSAGE_RSP 0xE2
-
 #define UDT1CRI_VER_REQ_USB 1
 #define UDT1CRI_VER_REQ_CAN 2
 
-#define UDT1CRI_DLC_MASK 0xf
-#define UDT1CRI_DLC_RTR_MASK 0x40
+/* Synchronous commands are confirmed by the keep-alives and sent again when
+ * they are not. The keep-alive that may already be on its way is skipped
+ * and the next one, up to two periods later, waited for, with two more
+ * periods for a late device.
+ */
+#define UDT1CRI_KA_PERIOD_MS 100
+#define UDT1CRI_CMD_TIMEOUT_MS (4 * UDT1CRI_KA_PERIOD_MS)
+#define UDT1CRI_CMD_TRIES 3
+
+/* Extended identifier id/mask pairs of the acceptance filter */
+#define UDT1CRI_FILTER_EFF_MAX 32
 
 #define UDT1CRI_CAN_STATE_WRN_TH 95
 #define UDT1CRI_CAN_STATE_ERR_PSV_TH 127
@@ -76,15 +180,231 @@ struct udt1cri_usb_ctx {
 	struct udt1cri_priv *priv;
 	u32 ndx;
 	u8 dlc;
-	bool can;
+	u8 frame_len; /* bytes on the bus, for BQL */
+	u16 bus_bits; /* at the nominal bitrate, for the bus load */
+	u16 bus_dbits; /* at the data bitrate */
+	bool dropped; /* echo freed, waiting to reach tx_tail */
+	bool periodic; /* sent by the periodic scheduler, without echo */
+};
+
+/* Bulk OUT transfer carrying up to UDT1CRI_TX_MAX_MSGS messages */
+struct udt1cri_tx_urb {
+	struct udt1cri_priv *priv;
+	struct urb *urb;
+	u8 *buf;
+	bool busy;
+	unsigned int first; /* tx_head of the first CAN frame */
+	unsigned int len; /* bytes used in buf */
+	unsigned int nmsgs;
+	unsigned int nframes; /* CAN frames among the messages */
+	canid_t first_id; /* of the first CAN frame, for tracing */
+	ktime_t submit_time;
+};
+
+/* Traffic over the last 100 ms, 1 s and 10 s */
+struct udt1cri_load {
+	u64 rx_fps[UDT1CRI_LOAD_WINDOWS];
+	u64 tx_fps[UDT1CRI_LOAD_WINDOWS];
+	/* share of the bus time, in 0.01 % */
+	u64 rx_load[UDT1CRI_LOAD_WINDOWS];
+	u64 tx_load[UDT1CRI_LOAD_WINDOWS];
+	u64 bus_load[UDT1CRI_LOAD_WINDOWS];
+};
+
+/* Driver private statistics, exported through ethtool -S */
+struct udt1cri_xstats {
+	u64 tx_pool_exhausted;
+	u64 tx_urb_exhausted;
+	u64 tx_xfers;
+	u64 tx_xfer_msgs;
+	/* transfers with 1, 2-3, 4-7, 8-15 and 16-25 messages */
+	u64 tx_xfer_hist[UDT1CRI_TX_XFER_HIST_LEN];
+	u64 rx_queue_overflow;
+	u64 tx_confirm_timeout;
+	u64 rx_polls;
+	u64 rx_poll_frames;
+	/* polls delivering 1, 2-3, 4-7, 8-15, 16-31, 32-63 and 64 frames */
+	u64 rx_poll_hist[UDT1CRI_RX_POLL_HIST_LEN];
+	u64 tx_ctx_exhausted;
+	u64 rx_urb_errors;
+	u64 rx_format_errors;
+	u64 rx_unknown_msgs;
+	u64 rx_xfers;
+	u64 rx_xfer_msgs;
+	/* transfers with 1, 2-3, 4-7, 8-15, 16-31 and 32 or more messages */
+	u64 rx_xfer_hist[UDT1CRI_RX_XFER_HIST_LEN];
+	u64 dev_rx_overflow; /* keep-alives reporting an overflow */
+	u64 dev_rx_lost; /* frames the device lost, rx_lost accumulated */
+	u64 pm_resumes;
+	u64 pm_resume_rx_us; /* from the last resume to the first transfer */
+	u64 cmd_sync;
+	u64 cmd_retries;
+	u64 cmd_timeouts;
+	u64 cmd_confirm_us; /* from the last command sent to its effect */
+	u64 cmd_xfers;
+	u64 cmd_queue_full;
+	u64 tx_periodic;
+	u64 tx_periodic_missed; /* periods skipped, late or without room */
+	struct udt1cri_load load;
+};
+
+enum udt1cri_dir {
+	UDT1CRI_RX,
+	UDT1CRI_TX,
+	UDT1CRI_DIRS,
+};
+
+/* Per-CPU traffic counters. Received frames are only counted under the
+ * rx_queue lock, once queued or dropped, sent and dropped echoes under
+ * tx_confirm_lock, so each direction has a single writer at a time.
+ */
+struct udt1cri_dir_stats {
+	struct u64_stats_sync syncp;
+	u64_stats_t packets;
+	u64_stats_t bytes;
+	u64_stats_t dropped;
+	u64_stats_t bits; /* on the bus, at the nominal bitrate */
+	u64_stats_t dbits; /* at the data bitrate */
+};
+
+/* Per-CPU error counters, bumped from the completion handlers, the timers
+ * and xmit alike, so updated with interrupts off. The first three are
+ * shown by ethtool -S, the last two add to the netdev stats.
+ */
+enum udt1cri_err {
+	UDT1CRI_ERR_NONE, /* not a per-CPU counter */
+	UDT1CRI_ERR_TX_URB,
+	UDT1CRI_ERR_TX_RSP_UNMATCHED,
+	UDT1CRI_ERR_RX_FILTERED,
+	UDT1CRI_ERR_RX_MISSED,
+	UDT1CRI_ERR_RX_OVER,
+	UDT1CRI_ERRS,
+};
+
+struct udt1cri_err_stats {
+	struct u64_stats_sync syncp;
+	u64_stats_t cnt[UDT1CRI_ERRS];
+};
+
+struct udt1cri_pcpu_stats {
+	struct udt1cri_dir_stats dir[UDT1CRI_DIRS];
+	struct udt1cri_err_stats err;
+};
+
+/* Per-CPU counters of one direction, summed */
+struct udt1cri_dir_sum {
+	u64 packets;
+	u64 bytes;
+	u64 dropped;
+	u64 bits;
+	u64 dbits;
+};
+
+struct udt1cri_load_sample {
+	ktime_t time;
+	struct udt1cri_dir_sum dir[UDT1CRI_DIRS];
+};
+
+/* Synchronous command waiting for a keep-alive to report its effect */
+struct udt1cri_cmd_wait {
+	u8 cmd_id; /* 0 when no command waits */
+	u32 value; /* bitrate, termination state or PIC awaited */
+	unsigned int skip; /* keep-alives that may predate the command */
+	struct completion done;
+};
+
+/* Acceptance filter for received frames, replaced as a whole under RCU.
+ * While enabled, standard frames pass if their identifier is set in sff,
+ * extended frames if they match one of the eff id/mask pairs.
+ */
+struct udt1cri_filter {
+	bool enabled;
+	DECLARE_BITMAP(sff, CAN_SFF_MASK + 1);
+	unsigned int eff_cnt;
+	struct can_filter eff[UDT1CRI_FILTER_EFF_MAX];
+	struct rcu_head rcu;
+};
+
+/* DMA buffer of a bulk IN transfer, freed when RX is stopped */
+struct udt1cri_rx_buf {
+	u8 *buf;
+	dma_addr_t dma;
+};
+
+/* Device timestamp of a frame, kept until NAPI delivers it. A received
+ * frame is only counted once it found room in rx_queue.
+ */
+struct udt1cri_skb_cb {
+	u32 timestamp;
+	bool rx; /* received CAN frame, not an echo or error frame */
+	u16 bus_bits;
+	u16 bus_dbits;
+};
+
+#define UDT1CRI_SKB_CB(skb) ((struct udt1cri_skb_cb *)(skb)->cb)
+
+static inline void udt1cri_skb_cb_init(struct sk_buff *skb, u32 timestamp)
+{
+	memset(UDT1CRI_SKB_CB(skb), 0, sizeof(struct udt1cri_skb_cb));
+	UDT1CRI_SKB_CB(skb)->timestamp = timestamp;
+}
+
+/* Frames decoded from one bulk IN transfer */
+struct udt1cri_rx_batch {
+	struct sk_buff_head queue;
+	ktime_t time; /* host time the transfer completed at */
 };
 
 /* Structure to hold all of our device specific stuff */
 struct udt1cri_priv {
 	struct can_priv can; /* must be the first member */
-	struct sk_buff *echo_skb[UDT1CRI_MAX_TX_URBS];
-	struct udt1cri_usb_ctx tx_context[UDT1CRI_MAX_TX_URBS];
+	struct udt1cri_usb_ctx *tx_context;
+	unsigned int tx_ctx_cnt; /* a power of 2 */
+	struct udt1cri_rx_buf *rx_bufs;
+	struct mutex rx_lock; /* protects rx_users */
+	unsigned int rx_users; /* open interface and synchronous commands */
+	unsigned int rx_urbs_cnt;
+	unsigned int rx_buf_size;
+	struct udt1cri_tx_urb tx_urbs[UDT1CRI_MAX_TX_URBS];
+	struct udt1cri_tx_urb *tx_pending; /* transfer being filled */
+	unsigned int free_tx_urb_cnt;
+	spinlock_t tx_lock; /* protects tx_urbs, tx_pending and the commands */
+	struct urb *cmd_urb; /* never shared with CAN frames */
+	u8 *cmd_buf;
+	bool cmd_busy; /* cmd_urb submitted */
+	u8 cmd_queue[UDT1CRI_CMD_QUEUE_LEN][UDT1CRI_USB_MSG_SIZE];
+	unsigned int cmd_head;
+	unsigned int cmd_tail;
+	struct hrtimer tx_flush_timer;
+	/* Periodic frames, protected by tx_lock */
+	struct udt1cri_periodic *periodic;
+	bool periodic_running; /* interface up, periodic_timer may be armed */
+	struct hrtimer periodic_timer;
+	atomic_t tx_urbs_in_flight;
+	struct napi_struct napi;
+	struct sk_buff_head rx_queue; /* frames waiting for NAPI */
+	/* RX coalescing, protected by the rx_queue lock */
+	struct hrtimer rx_coalesce_timer;
+	u32 rx_coalesce_usecs;
+	u32 rx_max_frames;
+	bool rx_adaptive;
+	bool rx_adaptive_hold; /* frame rate high enough to hold frames */
+	unsigned long rx_rate_start;
+	unsigned int rx_rate_frames;
+	spinlock_t tc_lock; /* protects the hardware timestamp state */
+	struct cyclecounter cc;
+	struct timecounter tc;
+	u32 cc_mult_nominal;
+	bool tc_valid;
+	u32 ts_last; /* latest device timestamp */
+	ktime_t ts_last_time; /* host time ts_last was received at */
+	u64 drift_ref_ns;
+	ktime_t drift_ref_time;
+	struct delayed_work ts_work;
+	bool hwts_rx;
+	bool hwts_tx;
 	struct usb_device *udev;
+	struct usb_interface *intf;
 	struct net_device *netdev;
 	struct usb_anchor tx_submitted;
 	struct usb_anchor rx_submitted;
@@ -92,22 +412,75 @@ struct udt1cri_priv {
 	bool usb_ka_first_pass;
 	bool can_ka_first_pass;
 	bool can_speed_check;
-	atomic_t free_ctx_cnt;
+	bool rx_lost_valid;
+	u16 rx_lost_last; /* last rx_lost reported by the device */
+	bool resume_pending; /* no transfer received since the resume */
+	ktime_t resume_time;
+	bool config_lost; /* set by a system suspend */
+	bool fd; /* UDT1FR-I */
+	unsigned int tx_msg_max; /* longest message the device takes */
+	unsigned int tx_head;
+	unsigned int tx_sent;
+	unsigned int tx_tail;
+	spinlock_t tx_confirm_lock; /* protects tx_tail and released contexts */
+	unsigned long tx_confirm_jiffies; /* last confirmation progress */
+	struct delayed_work tx_confirm_work;
+	struct delayed_work load_work;
+	struct udt1cri_load_sample load_samples[UDT1CRI_LOAD_SAMPLES];
+	unsigned int load_pos; /* of the next sample */
+	unsigned int load_cnt; /* samples before it */
+	struct udt1cri_filter __rcu *filter;
+	struct mutex filter_lock; /* serializes filter updates */
+	struct mutex cmd_lock; /* one synchronous command at a time */
+	spinlock_t cmd_wait_lock; /* protects cmd_wait */
+	struct udt1cri_cmd_wait cmd_wait;
+	struct udt1cri_pcpu_stats __percpu *stats;
+	struct udt1cri_xstats xstats;
+	struct dentry *debugfs;
+	u64 tx_urb_latency_hist[UDT1CRI_HIST_LEN]; /* microseconds */
+	u64 rx_xfer_frames_hist[UDT1CRI_HIST_LEN];
+	u64 tx_periodic_jitter_hist[UDT1CRI_HIST_LEN]; /* microseconds */
+	struct mutex capture_lock; /* serializes capture start and stop */
+	struct rchan *capture_chan; /* kept after a stop to be drained */
+	struct rchan __rcu *capture; /* while capturing */
+	bool capture_closed; /* on disconnect */
+	atomic_t capture_seq;
+	atomic_t capture_lost;
 };
 
-/* CAN frame */
-struct __packed udt1cri_usb_msg_can {
-	u8 cmd_id;
-	u8 dlc;
-	u8 flags;
-	u8 checksum;
-	u32 eid;
-	u32 timestamp;
-	u8 data[8];
+/* Frame sent every period, kept as the message the device takes */
+struct udt1cri_periodic {
+	u64 period_ns; /* 0 while the slot is free */
+	ktime_t next; /* deadline of the next transmission */
+	struct udt1cri_usb_msg_canfd msg;
+	u8 msg_len;
+	u8 len; /* data bytes */
+	u16 bus_bits;
+	u16 bus_dbits;
+	u64 sent;
+	u64 missed;
+	u64 jitter_max_ns; /* between deadlines and transmissions */
+	u64 jitter_sum_ns;
+};
+
+enum udt1cri_capture_dir {
+	UDT1CRI_CAPTURE_RX, /* bulk IN transfer */
+	UDT1CRI_CAPTURE_TX, /* bulk OUT transfer of CAN frames */
+	UDT1CRI_CAPTURE_CMD, /* bulk OUT transfer of commands */
+};
+
+/* Header of a capture record, followed by the len bytes of the transfer
+ * and padded to 8 bytes. seq counts all the records, lost those dropped on
+ * a full buffer, so a complete capture has no gap in seq.
+ */
+struct udt1cri_capture_hdr {
+	u64 time_ns; /* CLOCK_MONOTONIC */
+	u32 seq;
+	u32 lost;
+	u16 len;
+	u8 dir;
+	u8 reserved[5];
 };
-#define FLAG_CAN_EID 0x01
-#define FLAG_CAN_RTR 0x02
-#define FLAG_CAN_FDF 0x08
 
 /* command frame */
 struct __packed udt1cri_usb_msg {
@@ -158,6 +531,8 @@ struct __packed udt1cri_usb_msg_fw_ver {
 	u8 unused[18];
 };
 
+static struct dentry *udt1cri_debugfs_root;
+
 static const struct usb_device_id udt1cri_usb_table[] = {
 	{ USB_DEVICE(UDT1CRI_VENDOR_ID, UDT1CRI_PRODUCT_ID) },
 	{} /* Terminating entry */
@@ -173,609 +548,3418 @@ static const u32 udt1cri_bitrate[] = { 20000,  33333,  50000,  80000,  83333,
 				       225000, 250000, 275000, 300000, 500000,
 				       625000, 800000, 1000000 };
 
+static const u32 udt1cri_data_bitrate[] = { 1000000, 2000000, 4000000,
+					    5000000, 8000000 };
+
 static inline void udt1cri_init_ctx(struct udt1cri_priv *priv)
 {
 	int i = 0;
 
-	for (i = 0; i < UDT1CRI_MAX_TX_URBS; i++) {
-		priv->tx_context[i].ndx = UDT1CRI_CTX_FREE;
+	for (i = 0; i < priv->tx_ctx_cnt; i++) {
+		priv->tx_context[i].ndx = i;
 		priv->tx_context[i].priv = priv;
+		priv->tx_context[i].dropped = false;
 	}
 
-	atomic_set(&priv->free_ctx_cnt, ARRAY_SIZE(priv->tx_context));
+	priv->tx_head = 0;
+	priv->tx_sent = 0;
+	priv->tx_tail = 0;
 }
 
-static inline struct udt1cri_usb_ctx *
-udt1cri_usb_get_free_ctx(struct udt1cri_priv *priv, struct can_frame *cf)
+/* Size the TX context ring and the echo skb array to @cnt entries. All
+ * contexts must be free.
+ */
+static int udt1cri_alloc_ctx(struct udt1cri_priv *priv, unsigned int cnt)
 {
-	int i = 0;
-	struct udt1cri_usb_ctx *ctx = NULL;
+	struct udt1cri_usb_ctx *ctx;
+	struct sk_buff **echo_skb;
+	unsigned long flags;
 
-	for (i = 0; i < UDT1CRI_MAX_TX_URBS; i++) {
-		if (priv->tx_context[i].ndx == UDT1CRI_CTX_FREE) {
-			ctx = &priv->tx_context[i];
-			ctx->ndx = i;
-
-			if (cf) {
-				ctx->can = true;
-				ctx->dlc = cf->can_dlc;
-			} else {
-				ctx->can = false;
-				ctx->dlc = 0;
-			}
+	ctx = kcalloc(cnt, sizeof(*ctx), GFP_KERNEL);
+	echo_skb = kcalloc(cnt, sizeof(*echo_skb), GFP_KERNEL);
+	if (!ctx || !echo_skb) {
+		kfree(ctx);
+		kfree(echo_skb);
 
-			atomic_dec(&priv->free_ctx_cnt);
-			break;
-		}
+		return -ENOMEM;
 	}
 
-	if (!atomic_read(&priv->free_ctx_cnt))
-		/* That was the last free ctx. Slow down tx path */
-		netif_stop_queue(priv->netdev);
+	spin_lock_irqsave(&priv->tx_lock, flags);
+	spin_lock(&priv->tx_confirm_lock);
 
-	return ctx;
-}
+	swap(priv->tx_context, ctx);
+	swap(priv->can.echo_skb, echo_skb);
+	priv->tx_ctx_cnt = cnt;
+	priv->can.echo_skb_max = cnt;
+	udt1cri_init_ctx(priv);
 
-/* udt1cri_usb_free_ctx and udt1cri_usb_get_free_ctx are executed by different
- * threads. The order of execution in below function is important.
- */
-static inline void udt1cri_usb_free_ctx(struct udt1cri_usb_ctx *ctx)
-{
-	/* Increase number of free ctxs before freeing ctx */
-	atomic_inc(&ctx->priv->free_ctx_cnt);
+	spin_unlock(&priv->tx_confirm_lock);
+	spin_unlock_irqrestore(&priv->tx_lock, flags);
 
-	ctx->ndx = UDT1CRI_CTX_FREE;
+	kfree(ctx);
+	kfree(echo_skb);
 
-	/* Wake up the queue once ctx is marked free */
-	netif_wake_queue(ctx->priv->netdev);
+	return 0;
 }
 
-static void udt1cri_usb_write_bulk_callback(struct urb *urb)
+static void udt1cri_free_ctx(struct udt1cri_priv *priv)
 {
-	struct udt1cri_usb_ctx *ctx = urb->context;
-	struct net_device *netdev;
+	kfree(priv->tx_context);
+	kfree(priv->can.echo_skb);
 
-	WARN_ON(!ctx);
+	priv->tx_context = NULL;
+	priv->can.echo_skb = NULL;
+	priv->can.echo_skb_max = 0;
+	priv->tx_ctx_cnt = 0;
+}
 
-	netdev = ctx->priv->netdev;
+/* TX contexts form a ring with three free running indexes:
+ *  - tx_head: next context to claim, advanced under tx_lock in the order
+ *    frames are queued,
+ *  - tx_sent: contexts before it were handed to the USB core, advanced under
+ *    tx_lock,
+ *  - tx_tail: oldest context not confirmed yet, advanced under
+ *    tx_confirm_lock when the device reports the frame went out on the bus
+ *    with UDT1CRI_CMD_TRANSMIT_MESSAGE_RSP. Responses come in transmission
+ *    order.
+ *
+ * Frames lost on the way to the device are marked dropped and skipped once
+ * they reach tx_tail. Claiming and releasing a context is O(1), see
+ * udt1cri_ring.h.
+ */
+static inline struct udt1cri_usb_ctx *
+udt1cri_usb_ctx_at(struct udt1cri_priv *priv, unsigned int pos)
+{
+	return &priv->tx_context[udt1cri_ring_slot(pos, priv->tx_ctx_cnt)];
+}
 
-	/* free up our allocated buffer */
-	usb_free_coherent(urb->dev, urb->transfer_buffer_length,
-			  urb->transfer_buffer, urb->transfer_dma);
+static inline unsigned int udt1cri_usb_free_ctx_cnt(struct udt1cri_priv *priv)
+{
+	return udt1cri_ring_free(priv->tx_head, &priv->tx_tail,
+				 priv->tx_ctx_cnt);
+}
 
-	if (ctx->can) {
-		if (!netif_device_present(netdev))
-			return;
+/* Whether one more message fits in a transfer. Called with tx_lock held.
+ *
+ * A pending transfer is submitted as soon as it is full, so it always has
+ * room for one more message.
+ */
+static inline bool udt1cri_usb_tx_urb_avail(struct udt1cri_priv *priv)
+{
+	return priv->tx_pending || priv->free_tx_urb_cnt;
+}
 
-		netdev->stats.tx_packets++;
-		netdev->stats.tx_bytes += ctx->dlc;
+/* Whether one more frame can be queued. Called with tx_lock held. */
+static inline bool udt1cri_usb_tx_has_room(struct udt1cri_priv *priv)
+{
+	return udt1cri_usb_free_ctx_cnt(priv) && udt1cri_usb_tx_urb_avail(priv);
+}
 
-#if LINUX_VERSION_CODE <= KERNEL_VERSION(5, 12, 0)
-		can_get_echo_skb(netdev, ctx->ndx);
-#else
-		can_get_echo_skb(netdev, ctx->ndx, NULL);
-#endif
-	}
+/* Stop the queue once the last context or transfer is taken, and wake it up
+ * again when one is given back. Called with tx_lock held.
+ */
+static void udt1cri_usb_update_queue(struct udt1cri_priv *priv)
+{
+	struct net_device *netdev = priv->netdev;
 
-	if (urb->status)
-		netdev_info(netdev, "Tx URB aborted (%d)\n", urb->status);
+	if (!udt1cri_usb_tx_has_room(priv)) {
+		if (!netif_queue_stopped(netdev)) {
+			if (!udt1cri_usb_free_ctx_cnt(priv))
+				priv->xstats.tx_ctx_exhausted++;
+			else
+				priv->xstats.tx_urb_exhausted++;
+		}
 
-	/* Release the context */
-	udt1cri_usb_free_ctx(ctx);
+		netif_stop_queue(netdev);
+	} else if (netif_queue_stopped(netdev) &&
+		   priv->can.state != CAN_STATE_BUS_OFF) {
+		/* After a bus-off, the restart wakes the queue */
+		netif_wake_queue(netdev);
+	}
 }
 
-/* Send data to device */
-static netdev_tx_t udt1cri_usb_xmit(struct udt1cri_priv *priv,
-				    struct udt1cri_usb_msg *usb_msg,
-				    struct udt1cri_usb_ctx *ctx)
+/* Bytes a frame takes on the bus, without bit stuffing. Used for BQL. */
+static inline unsigned int
+udt1cri_usb_frame_len(const struct canfd_frame *cfd, bool fd)
 {
-	struct urb *urb;
-	u8 *buf;
-	int err;
+	/* SOF, arbitration, control, CRC, ACK, EOF and intermission fields */
+	unsigned int bits = (cfd->can_id & CAN_EFF_FLAG) ? 67 : 47;
 
-	/* create a URB, and a buffer for it, and copy the data to the URB */
-	urb = usb_alloc_urb(0, GFP_ATOMIC);
-	if (!urb)
-		return -ENOMEM;
+	/* FD adds the FDF, BRS and ESI bits, a stuff count and a longer CRC */
+	if (fd)
+		bits += 12;
 
-	buf = usb_alloc_coherent(priv->udev, UDT1CRI_USB_TX_BUFF_SIZE,
-				 GFP_ATOMIC, &urb->transfer_dma);
-	if (!buf) {
-		err = -ENOMEM;
-		goto nomembuf;
-	}
+	if (!(cfd->can_id & CAN_RTR_FLAG))
+		bits += cfd->len * 8;
+
+	return DIV_ROUND_UP(bits, 8);
+}
 
-	memcpy(buf, usb_msg, UDT1CRI_USB_TX_BUFF_SIZE);
+/* Bits a frame takes on the bus, with the worst case of stuff bits and the
+ * interframe space. With bit rate switching, *dbits of them are sent at
+ * the data bitrate, the returned ones at the nominal bitrate.
+ */
+static unsigned int udt1cri_bus_bits(const struct canfd_frame *cfd, bool fd,
+				     unsigned int *dbits)
+{
+	const bool eff = cfd->can_id & CAN_EFF_FLAG;
+	unsigned int data = cfd->len * 8;
+	unsigned int stuffed, bits, phase;
 
-	usb_fill_bulk_urb(urb, priv->udev,
-			  usb_sndbulkpipe(priv->udev, UDT1CRI_USB_EP_OUT), buf,
-			  UDT1CRI_USB_TX_BUFF_SIZE,
-			  udt1cri_usb_write_bulk_callback, ctx);
+	*dbits = 0;
 
-	urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
-	usb_anchor_urb(urb, &priv->tx_submitted);
+	if (!fd) {
+		if (cfd->can_id & CAN_RTR_FLAG)
+			data = 0;
 
-	err = usb_submit_urb(urb, GFP_ATOMIC);
-	if (unlikely(err))
-		goto failed;
+		/* SOF to CRC are stuffed, then 13 bits from the CRC
+		 * delimiter to the end of the interframe space.
+		 */
+		stuffed = (eff ? 54 : 34) + data;
 
-	/* Release our reference to this URB, the USB core will eventually free
-	 * it entirely.
-	 */
-	usb_free_urb(urb);
+		return stuffed + (stuffed - 1) / 4 + 13;
+	}
 
-	return 0;
+	/* SOF to BRS, then the CRC delimiter to the interframe space */
+	stuffed = eff ? 36 : 17;
+	bits = stuffed + (stuffed - 1) / 4 + 13;
 
-failed:
-	usb_unanchor_urb(urb);
-	usb_free_coherent(priv->udev, UDT1CRI_USB_TX_BUFF_SIZE, buf,
-			  urb->transfer_dma);
+	/* ESI, DLC and data are stuffed, the stuff count and CRC have fixed
+	 * stuff bits.
+	 */
+	stuffed = 5 + data;
+	phase = stuffed + stuffed / 4 + (cfd->len > 16 ? 25 + 7 : 21 + 6);
 
-	if (err == -ENODEV)
-		netif_device_detach(priv->netdev);
+	if (cfd->flags & CANFD_BRS)
+		*dbits = phase;
 	else
-		netdev_warn(priv->netdev, "failed tx_urb %d\n", err);
-
-nomembuf:
-	usb_free_urb(urb);
+		bits += phase;
 
-	return err;
+	return bits;
 }
 
-/* Send data to device */
-static netdev_tx_t udt1cri_usb_start_xmit(struct sk_buff *skb,
-					  struct net_device *netdev)
+static void udt1cri_stats_add(struct udt1cri_priv *priv, enum udt1cri_dir dir,
+			      unsigned int bytes, unsigned int bits,
+			      unsigned int dbits)
 {
-	struct udt1cri_priv *priv = netdev_priv(netdev);
-	struct can_frame *cf = (struct can_frame *)skb->data;
-	struct udt1cri_usb_ctx *ctx = NULL;
-	struct net_device_stats *stats = &priv->netdev->stats;
-	int err;
-	struct udt1cri_usb_msg_can usb_msg = {
-		.cmd_id = UDT1CRI_CMD_TRANSMIT_MESSAGE_EV
-	};
+	struct udt1cri_dir_stats *stats = &this_cpu_ptr(priv->stats)->dir[dir];
+
+	u64_stats_update_begin(&stats->syncp);
+	u64_stats_inc(&stats->packets);
+	u64_stats_add(&stats->bytes, bytes);
+	u64_stats_add(&stats->bits, bits);
+	u64_stats_add(&stats->dbits, dbits);
+	u64_stats_update_end(&stats->syncp);
+}
 
-	if (can_dropped_invalid_skb(netdev, skb))
-		return NETDEV_TX_OK;
+static void udt1cri_stats_drop(struct udt1cri_priv *priv, enum udt1cri_dir dir)
+{
+	struct udt1cri_dir_stats *stats = &this_cpu_ptr(priv->stats)->dir[dir];
 
-	ctx = udt1cri_usb_get_free_ctx(priv, cf);
-	if (!ctx)
-		return NETDEV_TX_BUSY;
+	u64_stats_update_begin(&stats->syncp);
+	u64_stats_inc(&stats->dropped);
+	u64_stats_update_end(&stats->syncp);
+}
 
-#if LINUX_VERSION_CODE <= KERNEL_VERSION(5, 12, 0)
-	can_put_echo_skb(skb, priv->netdev, ctx->ndx);
-#else
-	can_put_echo_skb(skb, priv->netdev, ctx->ndx, 0);
-#endif
+static void udt1cri_stats_err(struct udt1cri_priv *priv, enum udt1cri_err err,
+			      unsigned int n)
+{
+	struct udt1cri_err_stats *stats = &this_cpu_ptr(priv->stats)->err;
+	unsigned long flags;
 
-	usb_msg.cmd_id = UDT1CRI_CMD_TRANSMIT_MESSAGE_EV;
+	flags = u64_stats_update_begin_irqsave(&stats->syncp);
+	u64_stats_add(&stats->cnt[err], n);
+	u64_stats_update_end_irqrestore(&stats->syncp, flags);
+}
 
-	usb_msg.flags = 0;
-	usb_msg.eid = (cf->can_id);
-	if (cf->can_id & CAN_EFF_FLAG)
-		usb_msg.flags |= FLAG_CAN_EID;
+static void udt1cri_stats_err_sum(struct udt1cri_priv *priv,
+				  u64 sum[UDT1CRI_ERRS])
+{
+	int cpu, err;
 
-	usb_msg.dlc = cf->can_dlc;
+	memset(sum, 0, UDT1CRI_ERRS * sizeof(*sum));
 
-	memcpy(usb_msg.data, cf->data, usb_msg.dlc);
+	for_each_possible_cpu(cpu) {
+		const struct udt1cri_err_stats *stats =
+			&per_cpu_ptr(priv->stats, cpu)->err;
+		u64 val[UDT1CRI_ERRS];
+		unsigned int start;
 
-	if (cf->can_id & CAN_RTR_FLAG)
-		usb_msg.flags |= FLAG_CAN_RTR;
+		do {
+			start = u64_stats_fetch_begin(&stats->syncp);
+			for (err = 0; err < UDT1CRI_ERRS; err++)
+				val[err] = u64_stats_read(&stats->cnt[err]);
+		} while (u64_stats_fetch_retry(&stats->syncp, start));
 
-	err = udt1cri_usb_xmit(priv, (struct udt1cri_usb_msg *)&usb_msg, ctx);
-	if (err)
-		goto xmit_failed;
+		for (err = 0; err < UDT1CRI_ERRS; err++)
+			sum[err] += val[err];
+	}
+}
 
-	return NETDEV_TX_OK;
+static void udt1cri_stats_sum(struct udt1cri_priv *priv,
+			      struct udt1cri_dir_sum sum[UDT1CRI_DIRS])
+{
+	int cpu, dir;
+
+	memset(sum, 0, UDT1CRI_DIRS * sizeof(*sum));
+
+	for_each_possible_cpu(cpu) {
+		for (dir = 0; dir < UDT1CRI_DIRS; dir++) {
+			const struct udt1cri_dir_stats *stats =
+				&per_cpu_ptr(priv->stats, cpu)->dir[dir];
+			struct udt1cri_dir_sum val;
+			unsigned int start;
+
+			do {
+				start = u64_stats_fetch_begin(&stats->syncp);
+				val.packets = u64_stats_read(&stats->packets);
+				val.bytes = u64_stats_read(&stats->bytes);
+				val.dropped = u64_stats_read(&stats->dropped);
+				val.bits = u64_stats_read(&stats->bits);
+				val.dbits = u64_stats_read(&stats->dbits);
+			} while (u64_stats_fetch_retry(&stats->syncp, start));
+
+			sum[dir].packets += val.packets;
+			sum[dir].bytes += val.bytes;
+			sum[dir].dropped += val.dropped;
+			sum[dir].bits += val.bits;
+			sum[dir].dbits += val.dbits;
+		}
+	}
+}
 
-xmit_failed:
+static void udt1cri_usb_free_echo(struct udt1cri_priv *priv,
+				  struct udt1cri_usb_ctx *ctx)
+{
+	if (!ctx->periodic)
 #if LINUX_VERSION_CODE <= KERNEL_VERSION(5, 12, 0)
-	can_free_echo_skb(priv->netdev, ctx->ndx);
+		can_free_echo_skb(priv->netdev, ctx->ndx);
 #else
-	can_free_echo_skb(priv->netdev, ctx->ndx, NULL);
+		can_free_echo_skb(priv->netdev, ctx->ndx, NULL);
 #endif
-	udt1cri_usb_free_ctx(ctx);
-	dev_kfree_skb(skb);
-	stats->tx_dropped++;
-
-	return NETDEV_TX_OK;
+	udt1cri_stats_drop(priv, UDT1CRI_TX);
 }
 
-/* Send cmd to device */
-static void udt1cri_usb_xmit_cmd(struct udt1cri_priv *priv,
-				 struct udt1cri_usb_msg *usb_msg)
+/* Release the context at tx_tail, and return its echo skb unless the frame
+ * was dropped or periodic. Called with tx_confirm_lock held.
+ */
+static struct sk_buff *udt1cri_usb_pop_ctx(struct udt1cri_priv *priv,
+					   unsigned int *bytes)
 {
-	struct udt1cri_usb_ctx *ctx = NULL;
-	int err;
+	struct udt1cri_usb_ctx *ctx = udt1cri_usb_ctx_at(priv, priv->tx_tail);
+	struct net_device *netdev = priv->netdev;
+	struct sk_buff *skb = NULL;
 
-	ctx = udt1cri_usb_get_free_ctx(priv, NULL);
-	if (!ctx) {
-		netdev_err(priv->netdev,
-			   "Lack of free ctx. Sending (%d) cmd aborted",
-			   usb_msg->cmd_id);
+	if (!ctx->dropped && !ctx->periodic) {
+#if LINUX_VERSION_CODE <= KERNEL_VERSION(5, 12, 0)
+		u8 len;
 
-		return;
-	}
+		skb = __can_get_echo_skb(netdev, ctx->ndx, &len);
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(6, 0, 0)
+		u8 len;
 
-	err = udt1cri_usb_xmit(priv, usb_msg, ctx);
-	if (err)
-		netdev_err(priv->netdev, "Failed to send cmd (%d)",
-			   usb_msg->cmd_id);
-}
+		skb = __can_get_echo_skb(netdev, ctx->ndx, &len, NULL);
+#else
+		unsigned int len;
 
-static void udt1cri_usb_xmit_change_bitrate(struct udt1cri_priv *priv,
-					    u16 bitrate)
-{
-	struct udt1cri_usb_msg_change_bitrate usb_msg = {
-		.cmd_id = UDT1CRI_CMD_CHANGE_BIT_RATE
-	};
+		skb = __can_get_echo_skb(netdev, ctx->ndx, &len, NULL);
+#endif
+	}
+	if (!ctx->dropped)
+		udt1cri_stats_add(priv, UDT1CRI_TX, ctx->dlc, ctx->bus_bits,
+				  ctx->bus_dbits);
 
-	put_unaligned_be16(bitrate, &usb_msg.bitrate);
+	*bytes += ctx->frame_len;
+	udt1cri_ring_release(&priv->tx_tail);
 
-	udt1cri_usb_xmit_cmd(priv, (struct udt1cri_usb_msg *)&usb_msg);
+	return skb;
 }
 
-static void udt1cri_usb_xmit_read_fw_ver(struct udt1cri_priv *priv, u8 pic)
+/* Release the dropped contexts at tx_tail. Called with tx_confirm_lock
+ * held. Returns the number of contexts released.
+ */
+static unsigned int udt1cri_usb_reap_ctx(struct udt1cri_priv *priv,
+					 unsigned int *bytes)
 {
-	struct udt1cri_usb_msg_fw_ver usb_msg = {
-		.cmd_id = UDT1CRI_CMD_READ_FW_VERSION, .pic = pic
-	};
+	unsigned int n = 0;
 
-	udt1cri_usb_xmit_cmd(priv, (struct udt1cri_usb_msg *)&usb_msg);
+	while (priv->tx_tail != smp_load_acquire(&priv->tx_sent) &&
+	       udt1cri_usb_ctx_at(priv, priv->tx_tail)->dropped) {
+		udt1cri_usb_pop_ctx(priv, bytes);
+		n++;
+	}
+
+	return n;
 }
 
-static void udt1cri_usb_process_can(struct udt1cri_priv *priv,
-				    struct udt1cri_usb_msg_can *msg)
+/* Drop frames of a transfer the device did not get. Their contexts are
+ * released once they reach tx_tail.
+ */
+static void udt1cri_usb_drop_ctx(struct udt1cri_priv *priv,
+				 unsigned int first, unsigned int nframes)
 {
-	struct can_frame *cf;
-	struct sk_buff *skb;
-	struct net_device_stats *stats = &priv->netdev->stats;
+	unsigned int i, n, bytes = 0;
+	unsigned long flags;
 
-	skb = alloc_can_skb(priv->netdev, &cf);
-	if (!skb)
-		return;
+	spin_lock_irqsave(&priv->tx_confirm_lock, flags);
 
-	cf->can_id = __le32_to_cpu(msg->eid);
-	if (msg->flags & FLAG_CAN_EID)
-		cf->can_id |= CAN_EFF_FLAG;
+	for (i = 0; i < nframes; i++) {
+		struct udt1cri_usb_ctx *ctx;
 
-	if (msg->flags & FLAG_CAN_RTR)
-		cf->can_id |= CAN_RTR_FLAG;
+		/* Already released */
+		if (udt1cri_ring_released(first + i, priv->tx_tail))
+			continue;
 
-	cf->can_dlc = msg->dlc & UDT1CRI_DLC_MASK;
+		ctx = udt1cri_usb_ctx_at(priv, first + i);
+		if (ctx->dropped)
+			continue;
 
-	memcpy(cf->data, msg->data, cf->can_dlc);
+		udt1cri_usb_free_echo(priv, ctx);
+		ctx->dropped = true;
+	}
 
-	stats->rx_packets++;
-	stats->rx_bytes += cf->can_dlc;
+	n = udt1cri_usb_reap_ctx(priv, &bytes);
+	if (n)
+		netdev_completed_queue(priv->netdev, n, bytes);
 
-	netif_rx(skb);
+	spin_unlock_irqrestore(&priv->tx_confirm_lock, flags);
 }
 
-static void udt1cri_usb_process_ka_usb(struct udt1cri_priv *priv,
-				       struct udt1cri_usb_msg_ka_usb *msg)
+/* Drop the frames claimed from @first on, which never reached the USB core,
+ * and give their contexts back by rewinding tx_head. They are always the
+ * most recently claimed ones. Called with tx_lock held.
+ */
+static void udt1cri_usb_unclaim_ctx(struct udt1cri_priv *priv,
+				    unsigned int first)
 {
-	if (unlikely(priv->usb_ka_first_pass)) {
-		netdev_info(priv->netdev, "PIC USB version %hhu.%hhu\n",
-			    msg->soft_ver_major, msg->soft_ver_minor);
+	unsigned int pos, n = 0, bytes = 0;
 
-		priv->usb_ka_first_pass = false;
+	spin_lock(&priv->tx_confirm_lock);
+
+	/* A stray response may have released some of them already */
+	if (udt1cri_ring_released(first, priv->tx_tail))
+		first = priv->tx_tail;
+
+	for (pos = first; pos != priv->tx_head; pos++) {
+		struct udt1cri_usb_ctx *ctx = udt1cri_usb_ctx_at(priv, pos);
+
+		udt1cri_usb_free_echo(priv, ctx);
+		bytes += ctx->frame_len;
+		n++;
 	}
 
-	if (msg->termination_state)
-		priv->can.termination = UDT1CRI_TERMINATION_ENABLED;
-	else
-		priv->can.termination = UDT1CRI_TERMINATION_DISABLED;
-}
+	priv->tx_head = first;
+	smp_store_release(&priv->tx_sent, first);
 
-static u32 convert_can2host_bitrate(struct udt1cri_usb_msg_ka_can *msg)
-{
-	const u32 bitrate = get_unaligned_be16(&msg->can_bitrate);
+	if (n)
+		netdev_completed_queue(priv->netdev, n, bytes);
 
-	if ((bitrate == 33) || (bitrate == 83))
-		return bitrate * 1000 + 333;
-	else
-		return bitrate * 1000;
+	spin_unlock(&priv->tx_confirm_lock);
 }
 
-static void udt1cri_usb_process_ka_can(struct udt1cri_priv *priv,
-				       struct udt1cri_usb_msg_ka_can *msg)
+/* Get a free bulk OUT transfer. Called with tx_lock held. */
+static struct udt1cri_tx_urb *
+udt1cri_usb_get_free_tx_urb(struct udt1cri_priv *priv)
 {
-	if (unlikely(priv->can_ka_first_pass)) {
-		netdev_info(priv->netdev, "PIC CAN version %hhu.%hhu\n",
-			    msg->soft_ver_major, msg->soft_ver_minor);
+	int i;
 
-		priv->can_ka_first_pass = false;
+	for (i = 0; i < UDT1CRI_MAX_TX_URBS; i++) {
+		struct udt1cri_tx_urb *txu = &priv->tx_urbs[i];
+
+		if (!txu->busy) {
+			txu->busy = true;
+			txu->first = priv->tx_head;
+			txu->len = 0;
+			txu->nmsgs = 0;
+			txu->nframes = 0;
+			txu->first_id = 0;
+			priv->free_tx_urb_cnt--;
+
+			return txu;
+		}
 	}
 
-	if (unlikely(priv->can_speed_check)) {
-		const u32 bitrate = convert_can2host_bitrate(msg);
-
-		priv->can_speed_check = false;
+	return NULL;
+}
 
-		if (bitrate != priv->can.bittiming.bitrate)
-			netdev_err(
-				priv->netdev,
-				"Wrong bitrate reported by the device (%u). Expected %u",
-				bitrate, priv->can.bittiming.bitrate);
-	}
+/* Called with tx_lock held */
+static void udt1cri_usb_put_tx_urb(struct udt1cri_tx_urb *txu)
+{
+	txu->busy = false;
+	txu->priv->free_tx_urb_cnt++;
+}
 
-	priv->bec.txerr = msg->tx_err_cnt;
-	priv->bec.rxerr = msg->rx_err_cnt;
+static inline void udt1cri_hist_add(u64 *hist, u64 val)
+{
+	hist[min_t(unsigned int, fls64(val), UDT1CRI_HIST_LEN - 1)]++;
+}
 
-	if (msg->tx_bus_off)
-		priv->can.state = CAN_STATE_BUS_OFF;
+#if IS_ENABLED(CONFIG_RELAY)
+/* Copy a transfer to the capture buffer of this CPU, if capturing */
+static void udt1cri_capture(struct udt1cri_priv *priv,
+			    enum udt1cri_capture_dir dir, const void *data,
+			    unsigned int len)
+{
+	struct udt1cri_capture_hdr *hdr;
+	struct rchan *chan;
+	unsigned long flags;
+	u32 seq;
+
+	rcu_read_lock();
+
+	chan = rcu_dereference(priv->capture);
+	if (!chan)
+		goto out;
+
+	seq = atomic_inc_return(&priv->capture_seq) - 1;
+
+	/* The buffer of a CPU has one writer at a time */
+	local_irq_save(flags);
+	hdr = relay_reserve(chan, ALIGN(sizeof(*hdr) + len, 8));
+	if (hdr) {
+		hdr->time_ns = ktime_get_ns();
+		hdr->seq = seq;
+		hdr->lost = atomic_read(&priv->capture_lost);
+		hdr->len = len;
+		hdr->dir = dir;
+		memset(hdr->reserved, 0, sizeof(hdr->reserved));
+		memcpy(hdr + 1, data, len);
+	}
+	local_irq_restore(flags);
 
-	else if ((priv->bec.txerr > UDT1CRI_CAN_STATE_ERR_PSV_TH) ||
-		 (priv->bec.rxerr > UDT1CRI_CAN_STATE_ERR_PSV_TH))
-		priv->can.state = CAN_STATE_ERROR_PASSIVE;
+	if (!hdr)
+		atomic_inc(&priv->capture_lost);
 
-	else if ((priv->bec.txerr > UDT1CRI_CAN_STATE_WRN_TH) ||
-		 (priv->bec.rxerr > UDT1CRI_CAN_STATE_WRN_TH))
-		priv->can.state = CAN_STATE_ERROR_WARNING;
+out:
+	rcu_read_unlock();
 }
-
-static void udt1cri_usb_process_rx(struct udt1cri_priv *priv,
-				   struct udt1cri_usb_msg *msg)
+#else
+static inline void udt1cri_capture(struct udt1cri_priv *priv,
+				   enum udt1cri_capture_dir dir,
+				   const void *data, unsigned int len)
 {
-	switch (msg->cmd_id) {
-	case UDT1CRI_CMD_I_AM_ALIVE_FROM_CAN:
-		udt1cri_usb_process_ka_can(
-			priv, (struct udt1cri_usb_msg_ka_can *)msg);
-		break;
+}
+#endif
 
-	case UDT1CRI_CMD_I_AM_ALIVE_FROM_USB:
-		udt1cri_usb_process_ka_usb(
-			priv, (struct udt1cri_usb_msg_ka_usb *)msg);
-		break;
+/* The frames of a transfer are only released when the device confirms
+ * them, so only failed transfers touch the contexts here.
+ */
+static void udt1cri_usb_write_bulk_callback(struct urb *urb)
+{
+	struct udt1cri_tx_urb *txu = urb->context;
+	struct udt1cri_priv *priv;
+	struct net_device *netdev;
+	unsigned long flags;
+	s64 latency;
 
-	case UDT1CRI_CMD_RECEIVE_MESSAGE:
-		udt1cri_usb_process_can(priv,
-					(struct udt1cri_usb_msg_can *)msg);
-		break;
+	WARN_ON(!txu);
 
-	case UDT1CRI_CMD_NOTHING_TO_SEND:
-		/* Side effect of communication between PIC_USB and PIC_CAN.
-		 * PIC_CAN is telling us that it has nothing to send
-		 */
+	priv = txu->priv;
+	netdev = priv->netdev;
+
+	atomic_dec(&priv->tx_urbs_in_flight);
+
+	latency = ktime_us_delta(ktime_get(), txu->submit_time);
+	udt1cri_hist_add(priv->tx_urb_latency_hist, max_t(s64, latency, 0));
+	trace_udt1cri_tx_complete(netdev,
+				  udt1cri_usb_ctx_at(priv, txu->first)->ndx,
+				  txu->first_id, txu->nframes, urb->status,
+				  latency);
+
+	if (urb->status) {
+		udt1cri_stats_err(priv, UDT1CRI_ERR_TX_URB, 1);
+		netdev_info(netdev, "Tx URB aborted (%d)\n", urb->status);
+	}
+
+	if (urb->status || !netif_device_present(netdev))
+		udt1cri_usb_drop_ctx(priv, txu->first, txu->nframes);
+
+	/* Give the transfer back and wake up the queue under the lock the
+	 * queue was stopped with, so a wake up is never missed.
+	 */
+	spin_lock_irqsave(&priv->tx_lock, flags);
+	udt1cri_usb_put_tx_urb(txu);
+	udt1cri_usb_update_queue(priv);
+	spin_unlock_irqrestore(&priv->tx_lock, flags);
+}
+
+static void udt1cri_usb_account_tx_xfer(struct udt1cri_priv *priv,
+					unsigned int nmsgs)
+{
+	priv->xstats.tx_xfers++;
+	priv->xstats.tx_xfer_msgs += nmsgs;
+	priv->xstats.tx_xfer_hist[min_t(unsigned int, fls(nmsgs) - 1,
+					UDT1CRI_TX_XFER_HIST_LEN - 1)]++;
+}
+
+/* Submit the pending bulk OUT transfer. Called with tx_lock held.
+ *
+ * On failure, the messages of the transfer are dropped.
+ */
+static void udt1cri_usb_flush_tx(struct udt1cri_priv *priv)
+{
+	struct udt1cri_tx_urb *txu = priv->tx_pending;
+	int err;
+
+	if (!txu)
+		return;
+
+	priv->tx_pending = NULL;
+
+	/* Confirmation timeouts count from the first frame in flight */
+	if (priv->tx_tail == priv->tx_sent)
+		WRITE_ONCE(priv->tx_confirm_jiffies, jiffies);
+
+	/* The device may confirm the frames before usb_submit_urb() returns */
+	smp_store_release(&priv->tx_sent, priv->tx_head);
+
+	txu->urb->transfer_buffer_length = txu->len;
+	usb_anchor_urb(txu->urb, &priv->tx_submitted);
+	atomic_inc(&priv->tx_urbs_in_flight);
+
+	txu->submit_time = ktime_get();
+	err = usb_submit_urb(txu->urb, GFP_ATOMIC);
+	trace_udt1cri_tx_submit(priv->netdev,
+				udt1cri_usb_ctx_at(priv, txu->first)->ndx,
+				txu->first_id, txu->nframes, txu->nmsgs, err);
+	if (unlikely(err)) {
+		usb_unanchor_urb(txu->urb);
+		atomic_dec(&priv->tx_urbs_in_flight);
+		udt1cri_stats_err(priv, UDT1CRI_ERR_TX_URB, 1);
+
+		if (err == -ENODEV)
+			netif_device_detach(priv->netdev);
+		else
+			netdev_warn(priv->netdev, "failed tx_urb %d\n", err);
+
+		udt1cri_usb_unclaim_ctx(priv, txu->first);
+		udt1cri_usb_put_tx_urb(txu);
+	} else {
+		udt1cri_usb_account_tx_xfer(priv, txu->nmsgs);
+		/* The buffer stays untouched until the completion */
+		udt1cri_capture(priv, UDT1CRI_CAPTURE_TX, txu->buf, txu->len);
+	}
+
+	udt1cri_usb_update_queue(priv);
+}
+
+static enum hrtimer_restart udt1cri_usb_tx_flush_timer(struct hrtimer *timer)
+{
+	struct udt1cri_priv *priv =
+		container_of(timer, struct udt1cri_priv, tx_flush_timer);
+	unsigned long flags;
+
+	spin_lock_irqsave(&priv->tx_lock, flags);
+	udt1cri_usb_flush_tx(priv);
+	spin_unlock_irqrestore(&priv->tx_lock, flags);
+
+	return HRTIMER_NORESTART;
+}
+
+/* Send all the queued commands in one transfer. Called with tx_lock held,
+ * while cmd_urb is idle.
+ *
+ * The frames queued before the commands are sent first. On failure, the
+ * commands are dropped.
+ */
+static void udt1cri_usb_submit_cmds(struct udt1cri_priv *priv)
+{
+	unsigned int len = 0;
+	int err;
+
+	if (priv->cmd_tail == priv->cmd_head)
+		return;
+
+	udt1cri_usb_flush_tx(priv);
+
+	while (priv->cmd_tail != priv->cmd_head) {
+		memcpy(priv->cmd_buf + len,
+		       priv->cmd_queue[priv->cmd_tail++ &
+				       (UDT1CRI_CMD_QUEUE_LEN - 1)],
+		       UDT1CRI_USB_MSG_SIZE);
+		len += UDT1CRI_USB_MSG_SIZE;
+	}
+
+	priv->cmd_urb->transfer_buffer_length = len;
+	usb_anchor_urb(priv->cmd_urb, &priv->tx_submitted);
+
+	err = usb_submit_urb(priv->cmd_urb, GFP_ATOMIC);
+	if (unlikely(err)) {
+		usb_unanchor_urb(priv->cmd_urb);
+		udt1cri_stats_err(priv, UDT1CRI_ERR_TX_URB, 1);
+
+		if (err == -ENODEV)
+			netif_device_detach(priv->netdev);
+		else
+			netdev_warn(priv->netdev, "failed cmd_urb %d\n", err);
+
+		return;
+	}
+
+	priv->cmd_busy = true;
+	priv->xstats.cmd_xfers++;
+	udt1cri_capture(priv, UDT1CRI_CAPTURE_CMD, priv->cmd_buf, len);
+}
+
+/* Send the commands queued meanwhile, if any */
+static void udt1cri_usb_cmd_write_callback(struct urb *urb)
+{
+	struct udt1cri_priv *priv = urb->context;
+	unsigned long flags;
+
+	spin_lock_irqsave(&priv->tx_lock, flags);
+
+	priv->cmd_busy = false;
+
+	switch (urb->status) {
+	case 0:
+		udt1cri_usb_submit_cmds(priv);
 		break;
 
-	case UDT1CRI_CMD_TRANSMIT_MESSAGE_RSP:
-		/* Transmission response from the device containing timestamp */
+	case -ENOENT:
+	case -ESHUTDOWN:
+		/* Killed, the commands queued meanwhile are dropped too */
+		priv->cmd_tail = priv->cmd_head;
 		break;
 
 	default:
-		netdev_warn(priv->netdev, "Unsupported msg (0x%hhX)",
-			    msg->cmd_id);
+		udt1cri_stats_err(priv, UDT1CRI_ERR_TX_URB, 1);
+		netdev_info(priv->netdev, "Cmd URB aborted (%d)\n",
+			    urb->status);
+		udt1cri_usb_submit_cmds(priv);
 		break;
 	}
+
+	spin_unlock_irqrestore(&priv->tx_lock, flags);
 }
 
-/* Callback for reading data from device
+/* Release the TX pool. All TX URBs must have been killed before. */
+static void udt1cri_usb_free_tx_pool(struct udt1cri_priv *priv)
+{
+	int i;
+
+	for (i = 0; i < UDT1CRI_MAX_TX_URBS; i++) {
+		struct udt1cri_tx_urb *txu = &priv->tx_urbs[i];
+
+		if (!txu->urb)
+			continue;
+
+		usb_free_coherent(priv->udev, UDT1CRI_USB_TX_BUFF_SIZE,
+				  txu->buf, txu->urb->transfer_dma);
+		usb_free_urb(txu->urb);
+
+		txu->urb = NULL;
+		txu->buf = NULL;
+	}
+
+	if (priv->cmd_urb) {
+		usb_free_coherent(priv->udev, UDT1CRI_CMD_BUFF_SIZE,
+				  priv->cmd_buf, priv->cmd_urb->transfer_dma);
+		usb_free_urb(priv->cmd_urb);
+
+		priv->cmd_urb = NULL;
+		priv->cmd_buf = NULL;
+	}
+}
+
+/* Preallocate the bulk OUT transfers and their DMA buffers, so the TX path
+ * never allocates memory.
+ */
+static int udt1cri_usb_alloc_tx_pool(struct udt1cri_priv *priv)
+{
+	int i;
+
+	for (i = 0; i < UDT1CRI_MAX_TX_URBS; i++) {
+		struct udt1cri_tx_urb *txu = &priv->tx_urbs[i];
+		struct urb *urb;
+		u8 *buf;
+
+		urb = usb_alloc_urb(0, GFP_KERNEL);
+		if (!urb)
+			goto nomem;
+
+		buf = usb_alloc_coherent(priv->udev, UDT1CRI_USB_TX_BUFF_SIZE,
+					 GFP_KERNEL, &urb->transfer_dma);
+		if (!buf) {
+			usb_free_urb(urb);
+			goto nomem;
+		}
+
+		usb_fill_bulk_urb(urb, priv->udev,
+				  usb_sndbulkpipe(priv->udev,
+						  UDT1CRI_USB_EP_OUT),
+				  buf, UDT1CRI_USB_TX_BUFF_SIZE,
+				  udt1cri_usb_write_bulk_callback, txu);
+		urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+
+		txu->priv = priv;
+		txu->urb = urb;
+		txu->buf = buf;
+		txu->busy = false;
+	}
+
+	priv->tx_pending = NULL;
+	priv->free_tx_urb_cnt = UDT1CRI_MAX_TX_URBS;
+
+	priv->cmd_urb = usb_alloc_urb(0, GFP_KERNEL);
+	if (!priv->cmd_urb)
+		goto nomem;
+
+	priv->cmd_buf = usb_alloc_coherent(priv->udev, UDT1CRI_CMD_BUFF_SIZE,
+					   GFP_KERNEL,
+					   &priv->cmd_urb->transfer_dma);
+	if (!priv->cmd_buf) {
+		usb_free_urb(priv->cmd_urb);
+		priv->cmd_urb = NULL;
+		goto nomem;
+	}
+
+	usb_fill_bulk_urb(priv->cmd_urb, priv->udev,
+			  usb_sndbulkpipe(priv->udev, UDT1CRI_USB_EP_OUT),
+			  priv->cmd_buf, UDT1CRI_CMD_BUFF_SIZE,
+			  udt1cri_usb_cmd_write_callback, priv);
+	priv->cmd_urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+	priv->cmd_busy = false;
+	priv->cmd_head = 0;
+	priv->cmd_tail = 0;
+
+	return 0;
+
+nomem:
+	netdev_err(priv->netdev, "No memory left for TX pool\n");
+	udt1cri_usb_free_tx_pool(priv);
+
+	return -ENOMEM;
+}
+
+/* Append a message of @len bytes to the pending bulk OUT transfer. Called
+ * with tx_lock held, after udt1cri_usb_tx_urb_avail(). A CAN frame also
+ * claims the context at tx_head, which @ctx must be.
  *
- * Check urb status, call read function and resubmit urb read operation.
+ * The transfer is submitted as soon as the longest message would not fit.
+ * Otherwise it is submitted right away if @flush is set, or when the flush
+ * deadline expires.
  */
-static void udt1cri_usb_read_bulk_callback(struct urb *urb)
+static void udt1cri_usb_queue_msg(struct udt1cri_priv *priv,
+				  struct udt1cri_usb_msg *usb_msg,
+				  unsigned int len, struct udt1cri_usb_ctx *ctx,
+				  bool flush)
 {
-	struct udt1cri_priv *priv = urb->context;
-	struct net_device *netdev;
-	int retval;
-	int pos = 0;
+	struct udt1cri_tx_urb *txu = priv->tx_pending;
 
-	netdev = priv->netdev;
+	if (!txu) {
+		txu = udt1cri_usb_get_free_tx_urb(priv);
+		priv->tx_pending = txu;
+	}
 
-	if (!netif_device_present(netdev))
-		return;
+	memcpy(txu->buf + txu->len, usb_msg, len);
+	txu->len += len;
+	txu->nmsgs++;
 
-	switch (urb->status) {
-	case 0: /* success */
-		break;
+	if (ctx) {
+		if (!txu->nframes++)
+			txu->first_id = __le32_to_cpu(
+				((struct udt1cri_usb_msg_can *)usb_msg)->eid);
+		priv->tx_head++;
+	}
+
+	if (flush ||
+	    txu->len + priv->tx_msg_max > UDT1CRI_USB_TX_BUFF_SIZE)
+		udt1cri_usb_flush_tx(priv);
+	else if (!hrtimer_active(&priv->tx_flush_timer))
+		hrtimer_start(&priv->tx_flush_timer,
+			      ns_to_ktime(UDT1CRI_TX_FLUSH_DELAY_US *
+					  NSEC_PER_USEC),
+			      HRTIMER_MODE_REL_SOFT);
+}
+
+/* Drop the transfer being filled, if any. Called with tx_lock held, a
+ * flush timer still armed finds nothing to send.
+ */
+static void __udt1cri_usb_drop_pending_tx(struct udt1cri_priv *priv)
+{
+	struct udt1cri_tx_urb *txu = priv->tx_pending;
+
+	priv->tx_pending = NULL;
+
+	if (txu) {
+		udt1cri_usb_unclaim_ctx(priv, txu->first);
+		udt1cri_usb_put_tx_urb(txu);
+	}
+}
+
+static void udt1cri_usb_drop_pending_tx(struct udt1cri_priv *priv)
+{
+	unsigned long flags;
+
+	hrtimer_cancel(&priv->tx_flush_timer);
+
+	spin_lock_irqsave(&priv->tx_lock, flags);
+	__udt1cri_usb_drop_pending_tx(priv);
+	spin_unlock_irqrestore(&priv->tx_lock, flags);
+}
+
+/* Send data to device */
+static netdev_tx_t udt1cri_usb_start_xmit(struct sk_buff *skb,
+					  struct net_device *netdev)
+{
+	struct udt1cri_priv *priv = netdev_priv(netdev);
+	struct canfd_frame *cfd = (struct canfd_frame *)skb->data;
+	struct udt1cri_usb_ctx *ctx = NULL;
+	unsigned int frame_len, msg_len, bits, dbits;
+	unsigned long flags;
+	bool flush, fd;
+	struct udt1cri_usb_msg_canfd usb_msg = {};
+
+	if (can_dropped_invalid_skb(netdev, skb))
+		return NETDEV_TX_OK;
+
+	fd = can_is_canfd_skb(skb);
+	msg_len = udt1cri_usb_encode_can(cfd, fd, &usb_msg);
+	frame_len = udt1cri_usb_frame_len(cfd, fd);
+	bits = udt1cri_bus_bits(cfd, fd, &dbits);
+
+	spin_lock_irqsave(&priv->tx_lock, flags);
+
+	/* The queue is stopped as soon as the last context or transfer is
+	 * taken, so this should never happen.
+	 */
+	if (unlikely(!udt1cri_usb_tx_has_room(priv))) {
+		priv->xstats.tx_pool_exhausted++;
+		netif_stop_queue(netdev);
+		spin_unlock_irqrestore(&priv->tx_lock, flags);
+
+		return NETDEV_TX_BUSY;
+	}
+
+	ctx = udt1cri_usb_ctx_at(priv, priv->tx_head);
+	ctx->dlc = cfd->len;
+	ctx->frame_len = frame_len;
+	ctx->bus_bits = bits;
+	ctx->bus_dbits = dbits;
+	ctx->dropped = false;
+	ctx->periodic = false;
+
+	trace_udt1cri_tx_enqueue(netdev, ctx->ndx, cfd->can_id, cfd->len);
+
+#if LINUX_VERSION_CODE <= KERNEL_VERSION(5, 12, 0)
+	can_put_echo_skb(skb, priv->netdev, ctx->ndx);
+#else
+	can_put_echo_skb(skb, priv->netdev, ctx->ndx, 0);
+#endif
+
+	/* Keep packing while the stack has more frames for us and BQL lets
+	 * it send them. Otherwise, send right away if the bus is idle, or
+	 * give the following frames a short deadline to join this transfer.
+	 */
+	flush = __netdev_sent_queue(netdev, frame_len, netdev_xmit_more()) &&
+		!atomic_read(&priv->tx_urbs_in_flight);
+
+	udt1cri_usb_queue_msg(priv, (struct udt1cri_usb_msg *)&usb_msg, msg_len,
+			      ctx, flush);
+	udt1cri_usb_update_queue(priv);
+
+	spin_unlock_irqrestore(&priv->tx_lock, flags);
+
+	return NETDEV_TX_OK;
+}
+
+/* Periodic frames
+ *
+ * Each slot of the table holds a prebuilt message and its next deadline.
+ * One timer is armed for the earliest deadline of all slots. When it
+ * fires, every slot due within UDT1CRI_PERIODIC_SLACK_NS is queued like a
+ * frame from the stack, claiming a TX context but no echo skb, so the
+ * transmission responses stay in order, and the transfer is submitted at
+ * once. A slot that finds no room, or a bus-off, skips its period.
+ */
+
+/* First deadline of a slot, a multiple of its period, so that slots with
+ * harmonic periods come due together.
+ */
+static ktime_t udt1cri_periodic_first(u64 period_ns, ktime_t now)
+{
+	return ns_to_ktime(div64_u64(ktime_to_ns(now) + period_ns - 1,
+				     period_ns) * period_ns);
+}
+
+/* Arm the timer for the earliest deadline. Called with tx_lock held. */
+static void udt1cri_usb_periodic_arm(struct udt1cri_priv *priv, ktime_t next)
+{
+	if (priv->periodic_running && next != KTIME_MAX)
+		hrtimer_start_range_ns(&priv->periodic_timer, next,
+				       UDT1CRI_PERIODIC_SLACK_NS,
+				       HRTIMER_MODE_ABS_SOFT);
+}
+
+/* Earliest deadline of all slots. Called with tx_lock held. */
+static ktime_t udt1cri_usb_periodic_next(struct udt1cri_priv *priv)
+{
+	ktime_t next = KTIME_MAX;
+	unsigned int i;
+
+	for (i = 0; i < UDT1CRI_PERIODIC_MAX; i++)
+		if (priv->periodic[i].period_ns)
+			next = min(next, priv->periodic[i].next);
+
+	return next;
+}
+
+/* Queue a due slot and move its deadline past @now. Called with tx_lock
+ * held.
+ */
+static void udt1cri_usb_send_periodic(struct udt1cri_priv *priv,
+				      struct udt1cri_periodic *p, ktime_t now)
+{
+	s64 late = ktime_to_ns(ktime_sub(now, p->next));
+	struct udt1cri_usb_ctx *ctx;
+	u64 jitter, n;
+
+	if (priv->can.state == CAN_STATE_BUS_OFF ||
+	    !netif_device_present(priv->netdev) ||
+	    udt1cri_usb_free_ctx_cnt(priv) <= UDT1CRI_PERIODIC_CTX_RESERVE ||
+	    !udt1cri_usb_tx_urb_avail(priv)) {
+		p->missed++;
+		priv->xstats.tx_periodic_missed++;
+	} else {
+		ctx = udt1cri_usb_ctx_at(priv, priv->tx_head);
+		ctx->dlc = p->len;
+		ctx->frame_len = 0; /* not accounted by BQL */
+		ctx->bus_bits = p->bus_bits;
+		ctx->bus_dbits = p->bus_dbits;
+		ctx->dropped = false;
+		ctx->periodic = true;
+
+		udt1cri_usb_queue_msg(priv, (struct udt1cri_usb_msg *)&p->msg,
+				      p->msg_len, ctx, false);
+
+		jitter = abs(late);
+		p->sent++;
+		p->jitter_sum_ns += jitter;
+		p->jitter_max_ns = max(p->jitter_max_ns, jitter);
+		priv->xstats.tx_periodic++;
+		udt1cri_hist_add(priv->tx_periodic_jitter_hist,
+				 div_u64(jitter, NSEC_PER_USEC));
+	}
+
+	p->next = ktime_add_ns(p->next, p->period_ns);
+
+	/* Periods that already went by are skipped */
+	if (!ktime_after(p->next, now)) {
+		n = div64_u64(ktime_to_ns(ktime_sub(now, p->next)),
+			      p->period_ns) + 1;
+		p->next = ktime_add_ns(p->next, n * p->period_ns);
+		p->missed += n;
+		priv->xstats.tx_periodic_missed += n;
+	}
+}
+
+static enum hrtimer_restart udt1cri_usb_periodic_timer(struct hrtimer *timer)
+{
+	struct udt1cri_priv *priv =
+		container_of(timer, struct udt1cri_priv, periodic_timer);
+	ktime_t now = ktime_get();
+	ktime_t due = ktime_add_ns(now, UDT1CRI_PERIODIC_SLACK_NS);
+	ktime_t next = KTIME_MAX;
+	unsigned long flags;
+	unsigned int i;
+
+	spin_lock_irqsave(&priv->tx_lock, flags);
+
+	for (i = 0; i < UDT1CRI_PERIODIC_MAX; i++) {
+		struct udt1cri_periodic *p = &priv->periodic[i];
+
+		if (!p->period_ns)
+			continue;
+
+		if (!ktime_after(p->next, due))
+			udt1cri_usb_send_periodic(priv, p, now);
+		next = min(next, p->next);
+	}
+
+	udt1cri_usb_flush_tx(priv);
+	udt1cri_usb_update_queue(priv);
+	udt1cri_usb_periodic_arm(priv, next);
+
+	spin_unlock_irqrestore(&priv->tx_lock, flags);
+
+	return HRTIMER_NORESTART;
+}
+
+/* Start sending the periodic frames, from the next multiple of their
+ * periods.
+ */
+static void udt1cri_usb_periodic_start(struct udt1cri_priv *priv)
+{
+	ktime_t now = ktime_get();
+	unsigned long flags;
+	unsigned int i;
+
+	spin_lock_irqsave(&priv->tx_lock, flags);
+
+	for (i = 0; i < UDT1CRI_PERIODIC_MAX; i++) {
+		struct udt1cri_periodic *p = &priv->periodic[i];
+
+		if (p->period_ns)
+			p->next = udt1cri_periodic_first(p->period_ns, now);
+	}
+
+	priv->periodic_running = true;
+	udt1cri_usb_periodic_arm(priv, udt1cri_usb_periodic_next(priv));
+
+	spin_unlock_irqrestore(&priv->tx_lock, flags);
+}
+
+static void udt1cri_usb_periodic_stop(struct udt1cri_priv *priv)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&priv->tx_lock, flags);
+	priv->periodic_running = false;
+	spin_unlock_irqrestore(&priv->tx_lock, flags);
+
+	/* A running callback sees periodic_running cleared, and stops */
+	hrtimer_cancel(&priv->periodic_timer);
+}
+
+/* Fill slot @slot with @new, or free it when its period is 0. With the
+ * same period, only the frame is replaced: the next transmission sends the
+ * new one, at the deadline of the old one.
+ */
+static void udt1cri_usb_periodic_set(struct udt1cri_priv *priv,
+				     unsigned int slot,
+				     const struct udt1cri_periodic *new)
+{
+	struct udt1cri_periodic *p = &priv->periodic[slot];
+	unsigned long flags;
+
+	spin_lock_irqsave(&priv->tx_lock, flags);
+
+	if (p->period_ns != new->period_ns) {
+		*p = *new;
+		if (p->period_ns) {
+			p->next = udt1cri_periodic_first(p->period_ns,
+							 ktime_get());
+			udt1cri_usb_periodic_arm(
+				priv, udt1cri_usb_periodic_next(priv));
+		}
+	} else {
+		p->msg = new->msg;
+		p->msg_len = new->msg_len;
+		p->len = new->len;
+		p->bus_bits = new->bus_bits;
+		p->bus_dbits = new->bus_dbits;
+	}
+
+	spin_unlock_irqrestore(&priv->tx_lock, flags);
+}
+
+/* Send cmd to device, after the frames already queued. Commands neither
+ * use nor wait for the transfers and contexts of CAN frames.
+ */
+static int udt1cri_usb_xmit_cmd(struct udt1cri_priv *priv,
+				struct udt1cri_usb_msg *usb_msg)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&priv->tx_lock, flags);
+
+	if (priv->cmd_head - priv->cmd_tail == UDT1CRI_CMD_QUEUE_LEN) {
+		priv->xstats.cmd_queue_full++;
+		spin_unlock_irqrestore(&priv->tx_lock, flags);
+
+		netdev_err(priv->netdev,
+			   "Command queue full. Sending (%d) cmd aborted",
+			   usb_msg->cmd_id);
+
+		return -ENOBUFS;
+	}
+
+	memcpy(priv->cmd_queue[priv->cmd_head++ & (UDT1CRI_CMD_QUEUE_LEN - 1)],
+	       usb_msg, UDT1CRI_USB_MSG_SIZE);
+
+	if (!priv->cmd_busy)
+		udt1cri_usb_submit_cmds(priv);
+
+	spin_unlock_irqrestore(&priv->tx_lock, flags);
+
+	return 0;
+}
+
+static void
+udt1cri_usb_init_bitrate_msg(struct udt1cri_usb_msg_change_bitrate *usb_msg,
+			     u8 cmd_id, u16 bitrate)
+{
+	memset(usb_msg, 0, sizeof(*usb_msg));
+	usb_msg->cmd_id = cmd_id;
+	put_unaligned_be16(bitrate, &usb_msg->bitrate);
+}
+
+static void
+udt1cri_usb_init_termination_msg(struct udt1cri_usb_msg_termination *usb_msg,
+				 u16 term)
+{
+	memset(usb_msg, 0, sizeof(*usb_msg));
+	usb_msg->cmd_id = UDT1CRI_CMD_SETUP_TERMINATION_RESISTANCE;
+	usb_msg->termination = term == UDT1CRI_TERMINATION_ENABLED;
+}
+
+static void udt1cri_usb_xmit_change_bitrate(struct udt1cri_priv *priv,
+					    u16 bitrate)
+{
+	struct udt1cri_usb_msg_change_bitrate usb_msg;
+
+	udt1cri_usb_init_bitrate_msg(&usb_msg, UDT1CRI_CMD_CHANGE_BIT_RATE,
+				     bitrate);
+
+	udt1cri_usb_xmit_cmd(priv, (struct udt1cri_usb_msg *)&usb_msg);
+}
+
+static void udt1cri_usb_xmit_change_data_bitrate(struct udt1cri_priv *priv,
+						 u16 bitrate)
+{
+	struct udt1cri_usb_msg_change_bitrate usb_msg;
+
+	udt1cri_usb_init_bitrate_msg(&usb_msg, UDT1CRI_CMD_CHANGE_DATA_BIT_RATE,
+				     bitrate);
+
+	udt1cri_usb_xmit_cmd(priv, (struct udt1cri_usb_msg *)&usb_msg);
+}
+
+static void udt1cri_usb_xmit_termination(struct udt1cri_priv *priv, u16 term)
+{
+	struct udt1cri_usb_msg_termination usb_msg;
+
+	udt1cri_usb_init_termination_msg(&usb_msg, term);
+
+	udt1cri_usb_xmit_cmd(priv, (struct udt1cri_usb_msg *)&usb_msg);
+}
+
+static void udt1cri_usb_xmit_read_fw_ver(struct udt1cri_priv *priv, u8 pic)
+{
+	struct udt1cri_usb_msg_fw_ver usb_msg = {
+		.cmd_id = UDT1CRI_CMD_READ_FW_VERSION, .pic = pic
+	};
+
+	udt1cri_usb_xmit_cmd(priv, (struct udt1cri_usb_msg *)&usb_msg);
+}
+
+/* A keep-alive from the PIC ka_id reports value, the bitrate for the CAN
+ * PIC and the termination state for the USB PIC. Complete the synchronous
+ * command it confirms, if any. The data bitrate is not reported, so it is
+ * never waited for.
+ */
+static void udt1cri_usb_cmd_match(struct udt1cri_priv *priv, u8 ka_id,
+				  u32 value)
+{
+	struct udt1cri_cmd_wait *wait = &priv->cmd_wait;
+	unsigned long flags;
+	bool done = false;
+
+	spin_lock_irqsave(&priv->cmd_wait_lock, flags);
+
+	switch (wait->cmd_id) {
+	case UDT1CRI_CMD_CHANGE_BIT_RATE:
+		done = ka_id == UDT1CRI_CMD_I_AM_ALIVE_FROM_CAN &&
+		       value == wait->value;
+		break;
+
+	case UDT1CRI_CMD_SETUP_TERMINATION_RESISTANCE:
+		done = ka_id == UDT1CRI_CMD_I_AM_ALIVE_FROM_USB &&
+		       value == wait->value;
+		break;
+
+	default:
+		break;
+	}
+
+	if (done && wait->skip) {
+		wait->skip--;
+		done = false;
+	}
+
+	if (done) {
+		wait->cmd_id = 0;
+		complete(&wait->done);
+	}
+
+	spin_unlock_irqrestore(&priv->cmd_wait_lock, flags);
+}
+
+static u64 udt1cri_cc_read(const struct cyclecounter *cc)
+{
+	struct udt1cri_priv *priv = container_of(cc, struct udt1cri_priv, cc);
+
+	return priv->ts_last;
+}
+
+static void udt1cri_ts_init(struct udt1cri_priv *priv)
+{
+	spin_lock_init(&priv->tc_lock);
+
+	priv->cc.read = udt1cri_cc_read;
+	priv->cc.mask = CYCLECOUNTER_MASK(32);
+	clocks_calc_mult_shift(&priv->cc.mult, &priv->cc.shift, UDT1CRI_TS_HZ,
+			       NSEC_PER_SEC, 3600);
+	priv->cc_mult_nominal = priv->cc.mult;
+	priv->tc_valid = false;
+}
+
+/* Restart the timecounter from host time. Called with tc_lock held. */
+static void udt1cri_ts_reset(struct udt1cri_priv *priv, u32 ts, ktime_t time)
+{
+	priv->ts_last = ts;
+	priv->ts_last_time = time;
+	priv->cc.mult = priv->cc_mult_nominal;
+	timecounter_init(&priv->tc, &priv->cc, ktime_to_ns(time));
+
+	priv->drift_ref_ns = priv->tc.nsec;
+	priv->drift_ref_time = time;
+	priv->tc_valid = true;
+}
+
+/* Convert a device timestamp, received at host time @time, to nanoseconds */
+static ktime_t udt1cri_ts_to_ktime(struct udt1cri_priv *priv, u32 ts,
+				   ktime_t time)
+{
+	unsigned long flags;
+	u64 ns;
+
+	spin_lock_irqsave(&priv->tc_lock, flags);
+
+	if (!priv->tc_valid ||
+	    ktime_to_ns(ktime_sub(time, priv->ts_last_time)) >
+		    UDT1CRI_TS_HALF_WRAP_NS) {
+		udt1cri_ts_reset(priv, ts, time);
+	} else if ((s32)(ts - priv->ts_last) > 0) {
+		priv->ts_last = ts;
+		priv->ts_last_time = time;
+	}
+
+	ns = timecounter_cyc2time(&priv->tc, ts);
+
+	spin_unlock_irqrestore(&priv->tc_lock, flags);
+
+	return ns_to_ktime(ns);
+}
+
+/* Track the counter wrap around, and steer the counter frequency and phase
+ * towards host time once per drift window.
+ */
+static void udt1cri_ts_work(struct work_struct *work)
+{
+	struct udt1cri_priv *priv =
+		container_of(to_delayed_work(work), struct udt1cri_priv,
+			     ts_work);
+	unsigned long flags;
+
+	spin_lock_irqsave(&priv->tc_lock, flags);
+
+	if (priv->tc_valid) {
+		const s64 host_ns = ktime_to_ns(priv->ts_last_time);
+		s64 d_host, d_dev;
+		u64 dev_ns;
+
+		/* cycle_last catches up with ts_last, received at host_ns */
+		dev_ns = timecounter_read(&priv->tc);
+
+		d_host = host_ns - ktime_to_ns(priv->drift_ref_time);
+		d_dev = dev_ns - priv->drift_ref_ns;
+
+		if (d_host >= UDT1CRI_TS_DRIFT_WINDOW_NS && d_dev > 0) {
+			const u32 nominal = priv->cc_mult_nominal;
+			const u32 delta = div_u64((u64)nominal *
+							  UDT1CRI_TS_MAX_PPM,
+						  USEC_PER_SEC);
+			u64 mult;
+
+			/* Frequency: filtered ratio of the elapsed times */
+			mult = div64_u64((u64)priv->cc.mult * d_host, d_dev);
+			mult = clamp_t(u64, mult, nominal - delta,
+				       nominal + delta);
+			mult = ((u64)priv->cc.mult * 3 + mult) / 4;
+			priv->cc.mult = (u32)mult;
+
+			/* Phase: remove an eighth of the offset */
+			timecounter_adjtime(&priv->tc,
+					    div_s64(host_ns - (s64)dev_ns, 8));
+
+			priv->drift_ref_ns = priv->tc.nsec;
+			priv->drift_ref_time = priv->ts_last_time;
+		}
+	}
+
+	spin_unlock_irqrestore(&priv->tc_lock, flags);
+
+	schedule_delayed_work(&priv->ts_work, UDT1CRI_TS_WORK_PERIOD);
+}
+
+static bool udt1cri_filter_match(const struct udt1cri_filter *filter,
+				 const struct udt1cri_usb_msg_can *msg)
+{
+	u32 id = __le32_to_cpu(msg->eid);
+	unsigned int i;
+
+	if (!(msg->flags & FLAG_CAN_EID))
+		return test_bit(id & CAN_SFF_MASK, filter->sff);
+
+	for (i = 0; i < filter->eff_cnt; i++)
+		if (!((id ^ filter->eff[i].can_id) & filter->eff[i].can_mask &
+		      CAN_EFF_MASK))
+			return true;
+
+	return false;
+}
+
+static bool udt1cri_filter_accept(struct udt1cri_priv *priv,
+				  const struct udt1cri_usb_msg_can *msg)
+{
+	const struct udt1cri_filter *filter;
+	bool accept;
+
+	rcu_read_lock();
+	filter = rcu_dereference(priv->filter);
+	accept = !filter->enabled || udt1cri_filter_match(filter, msg);
+	rcu_read_unlock();
+
+	return accept;
+}
+
+static void udt1cri_usb_process_can(struct udt1cri_priv *priv,
+				    struct udt1cri_usb_msg_can *msg,
+				    struct udt1cri_rx_batch *batch)
+{
+	struct canfd_frame *cfd;
+	struct can_frame *cf;
+	struct sk_buff *skb;
+	unsigned int bits, dbits;
+	bool fd = priv->fd && (msg->flags & FLAG_CAN_FDF);
+
+	/* Nobody reads frames while the interface is down */
+	if (!netif_running(priv->netdev))
+		return;
+
+	/* Drop unwanted frames before paying for an skb */
+	if (!udt1cri_filter_accept(priv, msg)) {
+		udt1cri_stats_err(priv, UDT1CRI_ERR_RX_FILTERED, 1);
+		return;
+	}
+
+	if (fd) {
+		skb = alloc_canfd_skb(priv->netdev, &cfd);
+	} else {
+		skb = alloc_can_skb(priv->netdev, &cf);
+		cfd = (struct canfd_frame *)cf;
+	}
+	if (!skb)
+		return;
+
+	udt1cri_usb_decode_can(msg, fd, cfd);
+
+	udt1cri_skb_cb_init(skb, __le32_to_cpu(msg->timestamp));
+	bits = udt1cri_bus_bits(cfd, fd, &dbits);
+	UDT1CRI_SKB_CB(skb)->rx = true;
+	UDT1CRI_SKB_CB(skb)->bus_bits = bits;
+	UDT1CRI_SKB_CB(skb)->bus_dbits = dbits;
+
+	if (priv->hwts_rx)
+		skb_hwtstamps(skb)->hwtstamp = udt1cri_ts_to_ktime(
+			priv, UDT1CRI_SKB_CB(skb)->timestamp, batch->time);
+
+	__skb_queue_tail(&batch->queue, skb);
+}
+
+/* The device sent the oldest frame in flight on the bus. Release its
+ * context, and deliver its echo in timestamp order with received frames.
+ */
+static void udt1cri_usb_process_tx_rsp(struct udt1cri_priv *priv,
+				       struct udt1cri_usb_msg_can *msg,
+				       struct udt1cri_rx_batch *batch)
+{
+	const u32 ts = __le32_to_cpu(msg->timestamp);
+	struct sk_buff *skb = NULL;
+	unsigned int n, bytes = 0;
+	struct can_frame *cf;
+	unsigned long flags;
+	bool matched;
+
+	spin_lock_irqsave(&priv->tx_confirm_lock, flags);
+
+	n = udt1cri_usb_reap_ctx(priv, &bytes);
+	matched = priv->tx_tail != smp_load_acquire(&priv->tx_sent);
+	if (matched) {
+		skb = udt1cri_usb_pop_ctx(priv, &bytes);
+		n++;
+		WRITE_ONCE(priv->tx_confirm_jiffies, jiffies);
+	}
+	if (n)
+		netdev_completed_queue(priv->netdev, n, bytes);
+
+	spin_unlock_irqrestore(&priv->tx_confirm_lock, flags);
+
+	if (!matched)
+		udt1cri_stats_err(priv, UDT1CRI_ERR_TX_RSP_UNMATCHED, 1);
+	if (!n)
+		return;
+
+	spin_lock_irqsave(&priv->tx_lock, flags);
+	udt1cri_usb_update_queue(priv);
+	spin_unlock_irqrestore(&priv->tx_lock, flags);
+
+	if (!skb)
+		return;
+
+	cf = (struct can_frame *)skb->data;
+	if ((cf->can_id & CAN_EFF_MASK) !=
+	    (__le32_to_cpu(msg->eid) & CAN_EFF_MASK))
+		udt1cri_stats_err(priv, UDT1CRI_ERR_TX_RSP_UNMATCHED, 1);
+
+	udt1cri_skb_cb_init(skb, ts);
+	if (priv->hwts_tx)
+		skb_hwtstamps(skb)->hwtstamp =
+			udt1cri_ts_to_ktime(priv, ts, batch->time);
+
+	__skb_queue_tail(&batch->queue, skb);
+}
+
+static void udt1cri_usb_process_ka_usb(struct udt1cri_priv *priv,
+				       struct udt1cri_usb_msg_ka_usb *msg)
+{
+	if (unlikely(priv->usb_ka_first_pass)) {
+		netdev_info(priv->netdev, "PIC USB version %hhu.%hhu\n",
+			    msg->soft_ver_major, msg->soft_ver_minor);
+
+		priv->usb_ka_first_pass = false;
+	}
+
+	if (msg->termination_state)
+		priv->can.termination = UDT1CRI_TERMINATION_ENABLED;
+	else
+		priv->can.termination = UDT1CRI_TERMINATION_DISABLED;
+
+	udt1cri_usb_cmd_match(priv, msg->cmd_id, !!msg->termination_state);
+}
+
+static u32 convert_can2host_bitrate(struct udt1cri_usb_msg_ka_can *msg)
+{
+	const u32 bitrate = get_unaligned_be16(&msg->can_bitrate);
+
+	if ((bitrate == 33) || (bitrate == 83))
+		return bitrate * 1000 + 333;
+	else
+		return bitrate * 1000;
+}
+
+static enum can_state udt1cri_err_cnt_to_state(u8 err_cnt)
+{
+	if (err_cnt > UDT1CRI_CAN_STATE_ERR_PSV_TH)
+		return CAN_STATE_ERROR_PASSIVE;
+
+	if (err_cnt > UDT1CRI_CAN_STATE_WRN_TH)
+		return CAN_STATE_ERROR_WARNING;
+
+	return CAN_STATE_ERROR_ACTIVE;
+}
+
+/* Report state transitions through can_change_state(), which also counts
+ * them in can_device_stats, and an error frame queued in order with the
+ * received frames. Once in bus-off, the state is left alone until the
+ * interface is restarted.
+ */
+static void udt1cri_usb_update_state(struct udt1cri_priv *priv,
+				     struct udt1cri_usb_msg_ka_can *msg,
+				     struct udt1cri_rx_batch *batch)
+{
+	struct net_device *netdev = priv->netdev;
+	enum can_state tx_state, rx_state;
+	struct can_frame *cf;
+	struct sk_buff *skb;
+	unsigned long flags;
+
+	if (priv->can.state == CAN_STATE_BUS_OFF)
+		return;
+
+	tx_state = msg->tx_bus_off ? CAN_STATE_BUS_OFF :
+				     udt1cri_err_cnt_to_state(msg->tx_err_cnt);
+	rx_state = udt1cri_err_cnt_to_state(msg->rx_err_cnt);
+
+	if (max(tx_state, rx_state) == priv->can.state)
+		return;
+
+	skb = alloc_can_err_skb(netdev, &cf);
+	can_change_state(netdev, skb ? cf : NULL, tx_state, rx_state);
+
+	if (skb && priv->can.state != CAN_STATE_BUS_OFF) {
+#ifdef CAN_ERR_CNT
+		cf->can_id |= CAN_ERR_CNT;
+#endif
+		cf->data[6] = msg->tx_err_cnt;
+		cf->data[7] = msg->rx_err_cnt;
+	}
+
+	if (priv->can.state == CAN_STATE_BUS_OFF) {
+		netif_stop_queue(netdev);
+
+		/* Nothing queued leaves the bus any more. Release the frames
+		 * and their echo skbs now, so the echo skbs can_restart()
+		 * flushes are not counted twice or confirmed once freed.
+		 */
+		spin_lock_irqsave(&priv->tx_lock, flags);
+		__udt1cri_usb_drop_pending_tx(priv);
+		udt1cri_usb_drop_ctx(priv, priv->tx_tail,
+				     priv->tx_sent - priv->tx_tail);
+		spin_unlock_irqrestore(&priv->tx_lock, flags);
+
+		/* Restarts the interface after restart-ms, if set */
+		can_bus_off(netdev);
+	}
+
+	if (!skb)
+		return;
+
+	udt1cri_skb_cb_init(skb, priv->ts_last);
+	if (priv->hwts_rx)
+		skb_hwtstamps(skb)->hwtstamp = udt1cri_ts_to_ktime(
+			priv, priv->ts_last, batch->time);
+
+	__skb_queue_tail(&batch->queue, skb);
+}
+
+/* Signal a gap in the received frames with an error frame, placed after
+ * the frames the device received before reporting it.
+ */
+static void udt1cri_usb_rx_overflow_frame(struct udt1cri_priv *priv,
+					  struct udt1cri_rx_batch *batch)
+{
+	struct can_frame *cf;
+	struct sk_buff *skb;
+
+	if (!netif_running(priv->netdev))
+		return;
+
+	skb = alloc_can_err_skb(priv->netdev, &cf);
+	if (!skb)
+		return;
+
+	cf->can_id |= CAN_ERR_CRTL;
+	cf->data[1] = CAN_ERR_CRTL_RX_OVERFLOW;
+
+	udt1cri_skb_cb_init(skb, priv->ts_last);
+	if (priv->hwts_rx)
+		skb_hwtstamps(skb)->hwtstamp = udt1cri_ts_to_ktime(
+			priv, priv->ts_last, batch->time);
+
+	__skb_queue_tail(&batch->queue, skb);
+}
+
+/* Device side drops. rx_lost is a free running 16-bit counter. Each report
+ * of an overflow or of new lost frames is one overflow event.
+ */
+static void udt1cri_usb_account_rx_lost(struct udt1cri_priv *priv,
+					struct udt1cri_usb_msg_ka_can *msg,
+					struct udt1cri_rx_batch *batch)
+{
+	const u16 rx_lost = get_unaligned_le16(&msg->rx_lost);
+	bool overflow = msg->rx_buff_ovfl;
+	u16 delta;
+
+	if (msg->rx_buff_ovfl)
+		priv->xstats.dev_rx_overflow++;
+
+	/* The first report after open is the reference */
+	delta = priv->rx_lost_valid ? (u16)(rx_lost - priv->rx_lost_last) : 0;
+	if (delta)
+		overflow = true;
+	priv->rx_lost_last = rx_lost;
+	priv->rx_lost_valid = true;
+
+	priv->xstats.dev_rx_lost += delta;
+	if (delta)
+		udt1cri_stats_err(priv, UDT1CRI_ERR_RX_MISSED, delta);
+
+	if (overflow) {
+		udt1cri_stats_err(priv, UDT1CRI_ERR_RX_OVER, 1);
+		udt1cri_usb_rx_overflow_frame(priv, batch);
+	}
+}
+
+static void udt1cri_usb_process_ka_can(struct udt1cri_priv *priv,
+				       struct udt1cri_usb_msg_ka_can *msg,
+				       struct udt1cri_rx_batch *batch)
+{
+	if (unlikely(priv->can_ka_first_pass)) {
+		netdev_info(priv->netdev, "PIC CAN version %hhu.%hhu\n",
+			    msg->soft_ver_major, msg->soft_ver_minor);
+
+		priv->can_ka_first_pass = false;
+	}
+
+	if (unlikely(priv->can_speed_check)) {
+		const u32 bitrate = convert_can2host_bitrate(msg);
+
+		priv->can_speed_check = false;
+
+		if (bitrate != priv->can.bittiming.bitrate)
+			netdev_err(
+				priv->netdev,
+				"Wrong bitrate reported by the device (%u). Expected %u",
+				bitrate, priv->can.bittiming.bitrate);
+	}
+
+	udt1cri_usb_account_rx_lost(priv, msg, batch);
+
+	udt1cri_usb_cmd_match(priv, msg->cmd_id,
+			      convert_can2host_bitrate(msg));
+
+	priv->bec.txerr = msg->tx_err_cnt;
+	priv->bec.rxerr = msg->rx_err_cnt;
+
+	/* The state is only tracked while the interface is up */
+	if (priv->can.state != CAN_STATE_STOPPED)
+		udt1cri_usb_update_state(priv, msg, batch);
+}
+
+static void udt1cri_usb_process_rx(struct udt1cri_priv *priv,
+				   struct udt1cri_usb_msg *msg,
+				   struct udt1cri_rx_batch *batch)
+{
+	switch (msg->cmd_id) {
+	case UDT1CRI_CMD_I_AM_ALIVE_FROM_CAN:
+		udt1cri_usb_process_ka_can(
+			priv, (struct udt1cri_usb_msg_ka_can *)msg, batch);
+		break;
+
+	case UDT1CRI_CMD_I_AM_ALIVE_FROM_USB:
+		udt1cri_usb_process_ka_usb(
+			priv, (struct udt1cri_usb_msg_ka_usb *)msg);
+		break;
+
+	case UDT1CRI_CMD_RECEIVE_MESSAGE:
+		udt1cri_usb_process_can(priv, (struct udt1cri_usb_msg_can *)msg,
+					batch);
+		break;
+
+	case UDT1CRI_CMD_NOTHING_TO_SEND:
+		/* Side effect of communication between PIC_USB and PIC_CAN.
+		 * PIC_CAN is telling us that it has nothing to send
+		 */
+		break;
+
+	case UDT1CRI_CMD_TRANSMIT_MESSAGE_RSP:
+		/* Transmission response from the device containing timestamp */
+		udt1cri_usb_process_tx_rsp(
+			priv, (struct udt1cri_usb_msg_can *)msg, batch);
+		break;
+
+	default:
+		priv->xstats.rx_unknown_msgs++;
+		netdev_warn(priv->netdev, "Unsupported msg (0x%hhX)",
+			    msg->cmd_id);
+		break;
+	}
+}
+
+/* Insert skb in device timestamp order. Frames normally arrive in that
+ * order, so the insertion point is found at the tail of the queue.
+ */
+static void udt1cri_usb_rx_queue_sorted(struct sk_buff_head *rx_queue,
+					struct sk_buff *skb)
+{
+	const u32 ts = UDT1CRI_SKB_CB(skb)->timestamp;
+	struct sk_buff *pos;
+
+	skb_queue_reverse_walk(rx_queue, pos) {
+		if ((s32)(ts - UDT1CRI_SKB_CB(pos)->timestamp) >= 0) {
+			__skb_queue_after(rx_queue, pos, skb);
+			return;
+		}
+	}
+
+	__skb_queue_head(rx_queue, skb);
+}
+
+/* Whether to hold the queued frames for coalescing, after frames more
+ * were queued. Called with the rx_queue lock held.
+ */
+static bool udt1cri_usb_rx_hold(struct udt1cri_priv *priv,
+				unsigned int frames)
+{
+	unsigned long now = jiffies;
+	unsigned long rate;
+
+	if (!priv->rx_coalesce_usecs)
+		return false;
+
+	if (priv->rx_adaptive) {
+		priv->rx_rate_frames += frames;
+		if (time_after_eq(now, priv->rx_rate_start +
+					       UDT1CRI_RX_ADAPT_PERIOD)) {
+			rate = priv->rx_rate_frames * HZ /
+			       (now - priv->rx_rate_start);
+			if (rate >= UDT1CRI_RX_ADAPT_RATE_HIGH)
+				priv->rx_adaptive_hold = true;
+			else if (rate < UDT1CRI_RX_ADAPT_RATE_LOW)
+				priv->rx_adaptive_hold = false;
+
+			priv->rx_rate_start = now;
+			priv->rx_rate_frames = 0;
+		}
+
+		if (!priv->rx_adaptive_hold)
+			return false;
+	}
+
+	return !priv->rx_max_frames ||
+	       skb_queue_len(&priv->rx_queue) < priv->rx_max_frames;
+}
+
+/* Hand the frames decoded from one transfer over to NAPI, now or when the
+ * coalescing time or frame limit is reached.
+ */
+static void udt1cri_usb_rx_enqueue(struct udt1cri_priv *priv,
+				   struct sk_buff_head *queue)
+{
+	struct sk_buff_head *rx_queue = &priv->rx_queue;
+	unsigned int frames = skb_queue_len(queue);
+	struct sk_buff *skb;
+	unsigned long flags;
+
+	if (!frames)
+		return;
+
+	spin_lock_irqsave(&rx_queue->lock, flags);
+
+	while ((skb = __skb_dequeue(queue))) {
+		const struct udt1cri_skb_cb *cb = UDT1CRI_SKB_CB(skb);
+		const struct canfd_frame *cfd = (struct canfd_frame *)skb->data;
+
+		if (skb_queue_len(rx_queue) >= UDT1CRI_RX_QUEUE_MAX) {
+			priv->xstats.rx_queue_overflow++;
+			udt1cri_stats_drop(priv, UDT1CRI_RX);
+			dev_kfree_skb_any(skb);
+			continue;
+		}
+
+		if (cb->rx)
+			udt1cri_stats_add(priv, UDT1CRI_RX, cfd->len,
+					  cb->bus_bits, cb->bus_dbits);
+		udt1cri_usb_rx_queue_sorted(rx_queue, skb);
+	}
+
+	if (udt1cri_usb_rx_hold(priv, frames)) {
+		if (!hrtimer_active(&priv->rx_coalesce_timer))
+			hrtimer_start(&priv->rx_coalesce_timer,
+				      ns_to_ktime(priv->rx_coalesce_usecs *
+						  NSEC_PER_USEC),
+				      HRTIMER_MODE_REL_SOFT);
+		spin_unlock_irqrestore(&rx_queue->lock, flags);
+		return;
+	}
+
+	hrtimer_try_to_cancel(&priv->rx_coalesce_timer);
+
+	spin_unlock_irqrestore(&rx_queue->lock, flags);
+
+	napi_schedule(&priv->napi);
+}
+
+static enum hrtimer_restart udt1cri_usb_rx_coalesce_timer(struct hrtimer *timer)
+{
+	struct udt1cri_priv *priv =
+		container_of(timer, struct udt1cri_priv, rx_coalesce_timer);
+
+	napi_schedule(&priv->napi);
+
+	return HRTIMER_NORESTART;
+}
+
+/* Release all the frames in flight. With @echo, they are assumed sent and
+ * echoed without a timestamp, otherwise they are dropped.
+ */
+static void udt1cri_usb_flush_confirm(struct udt1cri_priv *priv, bool echo)
+{
+	unsigned int n = 0, bytes = 0;
+	struct sk_buff_head queue;
+	unsigned long flags;
+
+	__skb_queue_head_init(&queue);
+
+	spin_lock_irqsave(&priv->tx_confirm_lock, flags);
+
+	while (priv->tx_tail != smp_load_acquire(&priv->tx_sent)) {
+		struct udt1cri_usb_ctx *ctx;
+		struct sk_buff *skb;
+
+		ctx = udt1cri_usb_ctx_at(priv, priv->tx_tail);
+		if (!echo && !ctx->dropped) {
+			udt1cri_usb_free_echo(priv, ctx);
+			ctx->dropped = true;
+		}
+
+		skb = udt1cri_usb_pop_ctx(priv, &bytes);
+		if (skb) {
+			udt1cri_skb_cb_init(skb, priv->ts_last);
+			__skb_queue_tail(&queue, skb);
+		}
+		n++;
+	}
+
+	if (n)
+		netdev_completed_queue(priv->netdev, n, bytes);
+
+	spin_unlock_irqrestore(&priv->tx_confirm_lock, flags);
+
+	if (!skb_queue_empty(&queue))
+		udt1cri_usb_rx_enqueue(priv, &queue);
+}
+
+/* Do not wait forever for confirmations a device may never send */
+static void udt1cri_usb_tx_confirm_work(struct work_struct *work)
+{
+	struct udt1cri_priv *priv =
+		container_of(to_delayed_work(work), struct udt1cri_priv,
+			     tx_confirm_work);
+	unsigned long flags;
+
+	if (READ_ONCE(priv->tx_tail) != smp_load_acquire(&priv->tx_sent) &&
+	    time_after(jiffies, READ_ONCE(priv->tx_confirm_jiffies) +
+					UDT1CRI_TX_CONFIRM_TIMEOUT)) {
+		priv->xstats.tx_confirm_timeout++;
+		/* Nothing leaves the bus while in bus-off */
+		udt1cri_usb_flush_confirm(priv,
+					  priv->can.state != CAN_STATE_BUS_OFF);
+
+		spin_lock_irqsave(&priv->tx_lock, flags);
+		udt1cri_usb_update_queue(priv);
+		spin_unlock_irqrestore(&priv->tx_lock, flags);
+	}
+
+	schedule_delayed_work(&priv->tx_confirm_work,
+			      UDT1CRI_TX_CONFIRM_TIMEOUT / 4);
+}
+
+static void udt1cri_usb_account_rx_poll(struct udt1cri_priv *priv,
+					unsigned int frames)
+{
+	priv->xstats.rx_polls++;
+	priv->xstats.rx_poll_frames += frames;
+
+	if (!frames)
+		return;
+
+	priv->xstats.rx_poll_hist[min_t(unsigned int, fls(frames) - 1,
+					UDT1CRI_RX_POLL_HIST_LEN - 1)]++;
+}
+
+/* NAPI poll: deliver up to budget frames to the stack */
+static int udt1cri_usb_poll(struct napi_struct *napi, int budget)
+{
+	struct udt1cri_priv *priv =
+		container_of(napi, struct udt1cri_priv, napi);
+	struct sk_buff_head batch;
+	struct sk_buff *skb;
+	unsigned long flags;
+	int work_done = 0;
+
+	__skb_queue_head_init(&batch);
+
+	spin_lock_irqsave(&priv->rx_queue.lock, flags);
+	while (work_done < budget &&
+	       (skb = __skb_dequeue(&priv->rx_queue))) {
+		__skb_queue_tail(&batch, skb);
+		work_done++;
+	}
+	spin_unlock_irqrestore(&priv->rx_queue.lock, flags);
+
+	while ((skb = __skb_dequeue(&batch))) {
+		const struct canfd_frame *cfd =
+			(const struct canfd_frame *)skb->data;
+
+		trace_udt1cri_rx_deliver(priv->netdev, cfd->can_id, cfd->len,
+					 UDT1CRI_SKB_CB(skb)->timestamp);
+		netif_receive_skb(skb);
+	}
+
+	udt1cri_usb_account_rx_poll(priv, work_done);
+
+	if (work_done < budget)
+		napi_complete_done(napi, work_done);
+
+	return work_done;
+}
+
+static void udt1cri_usb_account_rx_xfer(struct udt1cri_priv *priv,
+					unsigned int nmsgs)
+{
+	if (!nmsgs)
+		return;
+
+	priv->xstats.rx_xfers++;
+	priv->xstats.rx_xfer_msgs += nmsgs;
+	priv->xstats.rx_xfer_hist[min_t(unsigned int, fls(nmsgs) - 1,
+					UDT1CRI_RX_XFER_HIST_LEN - 1)]++;
+}
+
+/* Callback for reading data from device
+ *
+ * Check urb status, call read function and resubmit urb read operation.
+ */
+static void udt1cri_usb_read_bulk_callback(struct urb *urb)
+{
+	struct udt1cri_priv *priv = urb->context;
+	struct net_device *netdev;
+	struct udt1cri_usb_split split;
+	struct udt1cri_rx_batch batch;
+	unsigned int nmsgs = 0;
+	u8 *msg;
+	int retval;
+
+	netdev = priv->netdev;
+
+	if (!netif_device_present(netdev))
+		return;
+
+	switch (urb->status) {
+	case 0: /* success */
+		break;
+
+	case -ENOENT:
+	case -EPIPE:
+	case -EPROTO:
+	case -ESHUTDOWN:
+		return;
+
+	default:
+		priv->xstats.rx_urb_errors++;
+		netdev_info(netdev, "Rx URB aborted (%d)\n", urb->status);
+
+		goto resubmit_urb;
+	}
+
+	if (unlikely(priv->resume_pending)) {
+		priv->resume_pending = false;
+		priv->xstats.pm_resume_rx_us =
+			ktime_us_delta(ktime_get(), priv->resume_time);
+		netdev_dbg(netdev, "first transfer %llu us after resume\n",
+			   priv->xstats.pm_resume_rx_us);
+	}
+
+	udt1cri_capture(priv, UDT1CRI_CAPTURE_RX, urb->transfer_buffer,
+			urb->actual_length);
+
+	__skb_queue_head_init(&batch.queue);
+	batch.time = ktime_get_real();
+
+	udt1cri_usb_split_init(&split, urb->transfer_buffer,
+			       urb->actual_length, priv->fd);
+	while ((msg = udt1cri_usb_split_next(&split))) {
+		udt1cri_usb_process_rx(priv, (struct udt1cri_usb_msg *)msg,
+				       &batch);
+		nmsgs++;
+	}
+
+	if (udt1cri_usb_split_truncated(&split)) {
+		priv->xstats.rx_format_errors++;
+		netdev_err(priv->netdev, "format error\n");
+	}
+
+	udt1cri_usb_account_rx_xfer(priv, nmsgs);
+	udt1cri_hist_add(priv->rx_xfer_frames_hist,
+			 skb_queue_len(&batch.queue));
+	trace_udt1cri_rx_xfer(netdev, urb->actual_length, nmsgs,
+			      skb_queue_len(&batch.queue));
+
+	/* Only keep-alives matter while a command is waiting on a down
+	 * interface
+	 */
+	if (netif_running(netdev))
+		udt1cri_usb_rx_enqueue(priv, &batch.queue);
+	else
+		__skb_queue_purge(&batch.queue);
+
+resubmit_urb:
+
+	usb_fill_bulk_urb(urb, priv->udev,
+			  usb_rcvbulkpipe(priv->udev, UDT1CRI_USB_EP_OUT),
+			  urb->transfer_buffer, priv->rx_buf_size,
+			  udt1cri_usb_read_bulk_callback, priv);
+
+	retval = usb_submit_urb(urb, GFP_ATOMIC);
+
+	if (retval == -ENODEV) {
+		netif_device_detach(netdev);
+	} else if (retval) {
+		priv->xstats.rx_urb_errors++;
+		netdev_err(netdev, "failed resubmitting read bulk urb: %d\n",
+			   retval);
+	}
+}
+
+/* Allocate and submit the bulk IN transfers */
+static int udt1cri_usb_start_rx(struct udt1cri_priv *priv)
+{
+	struct net_device *netdev = priv->netdev;
+	int err = 0, i;
+
+	priv->rx_bufs = kcalloc(priv->rx_urbs_cnt, sizeof(*priv->rx_bufs),
+				GFP_KERNEL);
+	if (!priv->rx_bufs)
+		return -ENOMEM;
+
+	for (i = 0; i < priv->rx_urbs_cnt; i++) {
+		struct urb *urb = NULL;
+		u8 *buf;
+
+		/* create a URB, and a buffer for it */
+		urb = usb_alloc_urb(0, GFP_KERNEL);
+		if (!urb) {
+			err = -ENOMEM;
+			break;
+		}
+
+		buf = usb_alloc_coherent(priv->udev, priv->rx_buf_size,
+					 GFP_KERNEL, &urb->transfer_dma);
+		if (!buf) {
+			netdev_err(netdev, "No memory left for USB buffer\n");
+			usb_free_urb(urb);
+			err = -ENOMEM;
+			break;
+		}
+
+		usb_fill_bulk_urb(urb, priv->udev,
+				  usb_rcvbulkpipe(priv->udev,
+						  UDT1CRI_USB_EP_IN),
+				  buf, priv->rx_buf_size,
+				  udt1cri_usb_read_bulk_callback, priv);
+		urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+		usb_anchor_urb(urb, &priv->rx_submitted);
+
+		err = usb_submit_urb(urb, GFP_KERNEL);
+		if (err) {
+			usb_unanchor_urb(urb);
+			usb_free_coherent(priv->udev, priv->rx_buf_size, buf,
+					  urb->transfer_dma);
+			usb_free_urb(urb);
+			break;
+		}
+
+		priv->rx_bufs[i].buf = buf;
+		priv->rx_bufs[i].dma = urb->transfer_dma;
+
+		/* Drop reference, USB core will take care of freeing it */
+		usb_free_urb(urb);
+	}
+
+	/* Did we submit any URBs */
+	if (i == 0) {
+		netdev_warn(netdev, "couldn't setup read URBs\n");
+		kfree(priv->rx_bufs);
+		priv->rx_bufs = NULL;
+
+		return err;
+	}
+
+	/* Warn if we've couldn't transmit all the URBs */
+	if (i < priv->rx_urbs_cnt)
+		netdev_warn(netdev, "rx performance may be slow\n");
+
+	return 0;
+}
+
+/* Kill the bulk IN transfers and free their buffers */
+static void udt1cri_usb_stop_rx(struct udt1cri_priv *priv)
+{
+	int i;
+
+	usb_kill_anchored_urbs(&priv->rx_submitted);
+
+	if (!priv->rx_bufs)
+		return;
+
+	for (i = 0; i < priv->rx_urbs_cnt; i++) {
+		if (!priv->rx_bufs[i].buf)
+			continue;
+
+		usb_free_coherent(priv->udev, priv->rx_buf_size,
+				  priv->rx_bufs[i].buf, priv->rx_bufs[i].dma);
+	}
+
+	kfree(priv->rx_bufs);
+	priv->rx_bufs = NULL;
+}
+
+/* Received transfers are read while the interface is up, or while a
+ * synchronous command waits for a keep-alive.
+ */
+static int udt1cri_usb_get_rx(struct udt1cri_priv *priv)
+{
+	int err = 0;
+
+	mutex_lock(&priv->rx_lock);
+
+	if (!priv->rx_users)
+		err = udt1cri_usb_start_rx(priv);
+	if (!err)
+		priv->rx_users++;
+
+	mutex_unlock(&priv->rx_lock);
+
+	return err;
+}
+
+static void udt1cri_usb_put_rx(struct udt1cri_priv *priv)
+{
+	mutex_lock(&priv->rx_lock);
+
+	if (!--priv->rx_users)
+		udt1cri_usb_stop_rx(priv);
+
+	mutex_unlock(&priv->rx_lock);
+}
+
+/* Send a command and wait for the keep-alives to report its effect, see
+ * udt1cri_usb_cmd_match(). The command is sent again when it is not
+ * confirmed in time.
+ */
+static int udt1cri_usb_cmd_sync(struct udt1cri_priv *priv,
+				struct udt1cri_usb_msg *usb_msg, u32 value)
+{
+	struct udt1cri_cmd_wait *wait = &priv->cmd_wait;
+	unsigned long flags;
+	ktime_t sent;
+	int err, try;
+
+	mutex_lock(&priv->cmd_lock);
+
+	err = usb_autopm_get_interface(priv->intf);
+	if (err)
+		goto out_unlock;
+
+	err = udt1cri_usb_get_rx(priv);
+	if (err)
+		goto out_autopm;
+
+	priv->xstats.cmd_sync++;
+
+	for (try = 0; try < UDT1CRI_CMD_TRIES; try++) {
+		if (try)
+			priv->xstats.cmd_retries++;
+
+		reinit_completion(&wait->done);
+
+		spin_lock_irqsave(&priv->cmd_wait_lock, flags);
+		wait->cmd_id = usb_msg->cmd_id;
+		wait->value = value;
+		/* A keep-alive may already be on its way */
+		wait->skip = 1;
+		spin_unlock_irqrestore(&priv->cmd_wait_lock, flags);
+
+		sent = ktime_get();
+		err = udt1cri_usb_xmit_cmd(priv, usb_msg);
+
+		if (!wait_for_completion_timeout(&wait->done,
+				msecs_to_jiffies(UDT1CRI_CMD_TIMEOUT_MS))) {
+			if (!err)
+				err = -ETIMEDOUT;
+			continue;
+		}
+
+		err = 0;
+		priv->xstats.cmd_confirm_us = ktime_us_delta(ktime_get(), sent);
+		netdev_dbg(priv->netdev, "cmd 0x%02x confirmed in %llu us\n",
+			   usb_msg->cmd_id, priv->xstats.cmd_confirm_us);
+		break;
+	}
+
+	spin_lock_irqsave(&priv->cmd_wait_lock, flags);
+	wait->cmd_id = 0;
+	spin_unlock_irqrestore(&priv->cmd_wait_lock, flags);
+
+	if (err) {
+		priv->xstats.cmd_timeouts++;
+		netdev_err(priv->netdev, "cmd 0x%02x not confirmed: %d\n",
+			   usb_msg->cmd_id, err);
+	}
+
+	udt1cri_usb_put_rx(priv);
+out_autopm:
+	usb_autopm_put_interface(priv->intf);
+out_unlock:
+	mutex_unlock(&priv->cmd_lock);
+
+	return err;
+}
+
+/* Start USB device. Received transfers are only read while the interface
+ * is up.
+ */
+static int udt1cri_usb_start(struct udt1cri_priv *priv)
+{
+	int err;
+
+	err = udt1cri_usb_alloc_tx_pool(priv);
+	if (err)
+		return err;
+
+	/* The versions are logged from the keep-alives answering these */
+	udt1cri_usb_xmit_read_fw_ver(priv, UDT1CRI_VER_REQ_USB);
+	udt1cri_usb_xmit_read_fw_ver(priv, UDT1CRI_VER_REQ_CAN);
+
+	return 0;
+}
+
+static u16 udt1cri_data_bitrate_kbps(struct udt1cri_priv *priv)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 16, 0)
+	return priv->can.data_bittiming.bitrate / 1000;
+#else
+	return priv->can.fd.data_bittiming.bitrate / 1000;
+#endif
+}
+
+/* Bus time taken by bits and dbits, in ns */
+static u64 udt1cri_bus_ns(struct udt1cri_priv *priv, u64 bits, u64 dbits)
+{
+	const u32 bitrate = priv->can.bittiming.bitrate;
+	const u32 data_bitrate = udt1cri_data_bitrate_kbps(priv) * 1000;
+	u64 ns = 0;
+
+	if (bitrate)
+		ns += div_u64(bits * NSEC_PER_SEC, bitrate);
+	if (data_bitrate)
+		ns += div_u64(dbits * NSEC_PER_SEC, data_bitrate);
+
+	return ns;
+}
+
+/* Sample the traffic totals and update the frame rates and bus load of
+ * each window.
+ */
+static void udt1cri_load_work(struct work_struct *work)
+{
+	static const unsigned int periods[UDT1CRI_LOAD_WINDOWS] = {
+		1, 10, 100
+	};
+	struct udt1cri_priv *priv =
+		container_of(work, struct udt1cri_priv, load_work.work);
+	struct udt1cri_load_sample *now = &priv->load_samples[priv->load_pos];
+	struct udt1cri_load *load = &priv->xstats.load;
+	int i;
+
+	now->time = ktime_get();
+	udt1cri_stats_sum(priv, now->dir);
+
+	for (i = 0; i < UDT1CRI_LOAD_WINDOWS; i++) {
+		const unsigned int n = min(periods[i], priv->load_cnt);
+		const struct udt1cri_load_sample *then;
+		u64 fps[UDT1CRI_DIRS], busy[UDT1CRI_DIRS];
+		s64 elapsed;
+		int dir;
+
+		if (!n)
+			break;
+
+		then = &priv->load_samples[(priv->load_pos +
+					    UDT1CRI_LOAD_SAMPLES - n) %
+					   UDT1CRI_LOAD_SAMPLES];
+		elapsed = ktime_to_ns(ktime_sub(now->time, then->time));
+		if (elapsed <= 0)
+			break;
+
+		for (dir = 0; dir < UDT1CRI_DIRS; dir++) {
+			const struct udt1cri_dir_sum *from = &then->dir[dir];
+			const struct udt1cri_dir_sum *to = &now->dir[dir];
+			u64 ns;
+
+			fps[dir] = div64_u64((to->packets - from->packets) *
+					     NSEC_PER_SEC, elapsed);
+			ns = udt1cri_bus_ns(priv, to->bits - from->bits,
+					    to->dbits - from->dbits);
+			busy[dir] = div64_u64(ns * 10000, elapsed);
+		}
+
+		load->rx_fps[i] = fps[UDT1CRI_RX];
+		load->tx_fps[i] = fps[UDT1CRI_TX];
+		load->rx_load[i] = busy[UDT1CRI_RX];
+		load->tx_load[i] = busy[UDT1CRI_TX];
+		load->bus_load[i] = load->rx_load[i] + load->tx_load[i];
+	}
+
+	priv->load_pos = (priv->load_pos + 1) % UDT1CRI_LOAD_SAMPLES;
+	if (priv->load_cnt < UDT1CRI_LOAD_SAMPLES - 1)
+		priv->load_cnt++;
+
+	schedule_delayed_work(&priv->load_work, UDT1CRI_LOAD_PERIOD);
+}
+
+/* Open USB device */
+static int udt1cri_usb_open(struct net_device *netdev)
+{
+	struct udt1cri_priv *priv = netdev_priv(netdev);
+	int err;
+
+	/* The device may only autosuspend while the interface is down */
+	err = usb_autopm_get_interface(priv->intf);
+	if (err)
+		return err;
+
+	/* common open */
+	err = open_candev(netdev);
+	if (err) {
+		usb_autopm_put_interface(priv->intf);
+		return err;
+	}
+
+	priv->can_speed_check = true;
+	priv->can.state = CAN_STATE_ERROR_ACTIVE;
+	/* The device kept counting lost frames while nobody was reading */
+	priv->rx_lost_valid = false;
+
+	napi_enable(&priv->napi);
+
+	err = udt1cri_usb_get_rx(priv);
+	if (err) {
+		napi_disable(&priv->napi);
+		priv->can.state = CAN_STATE_STOPPED;
+		close_candev(netdev);
+		usb_autopm_put_interface(priv->intf);
+
+		return err;
+	}
+
+	schedule_delayed_work(&priv->ts_work, UDT1CRI_TS_WORK_PERIOD);
+	schedule_delayed_work(&priv->tx_confirm_work,
+			      UDT1CRI_TX_CONFIRM_TIMEOUT / 4);
+	priv->load_pos = 0;
+	priv->load_cnt = 0;
+	schedule_delayed_work(&priv->load_work, 0);
+	netdev_reset_queue(netdev);
+	netif_start_queue(netdev);
+	udt1cri_usb_periodic_start(priv);
+
+	return 0;
+}
+
+/* Close USB device */
+static int udt1cri_usb_close(struct net_device *netdev)
+{
+	struct udt1cri_priv *priv = netdev_priv(netdev);
+
+	priv->can.state = CAN_STATE_STOPPED;
+
+	netif_stop_queue(netdev);
+
+	udt1cri_usb_periodic_stop(priv);
+	udt1cri_usb_drop_pending_tx(priv);
+
+	/* Stop polling, the transfers are set up again on open */
+	udt1cri_usb_put_rx(priv);
+	usb_kill_anchored_urbs(&priv->tx_submitted);
+
+	/* Frames still waiting for their confirmation are lost */
+	cancel_delayed_work_sync(&priv->tx_confirm_work);
+	udt1cri_usb_flush_confirm(priv, false);
+	netdev_reset_queue(netdev);
+
+	hrtimer_cancel(&priv->rx_coalesce_timer);
+	napi_disable(&priv->napi);
+	skb_queue_purge(&priv->rx_queue);
+
+	cancel_delayed_work_sync(&priv->ts_work);
+	priv->tc_valid = false;
+
+	cancel_delayed_work_sync(&priv->load_work);
+	memset(&priv->xstats.load, 0, sizeof(priv->xstats.load));
+
+	close_candev(netdev);
+
+	usb_autopm_put_interface(priv->intf);
+
+	return 0;
+}
+
+/* Restart after a bus-off, by hand or after restart-ms. Setting the
+ * bitrate again reinitializes the CAN controller of the device.
+ */
+static int udt1cri_net_set_mode(struct net_device *netdev, enum can_mode mode)
+{
+	struct udt1cri_priv *priv = netdev_priv(netdev);
+	unsigned long flags;
+
+	switch (mode) {
+	case CAN_MODE_START:
+		/* The frames in flight were dropped on bus-off */
+		udt1cri_usb_xmit_change_bitrate(
+			priv, priv->can.bittiming.bitrate / 1000);
+
+		priv->can.state = CAN_STATE_ERROR_ACTIVE;
+
+		spin_lock_irqsave(&priv->tx_lock, flags);
+		udt1cri_usb_update_queue(priv);
+		spin_unlock_irqrestore(&priv->tx_lock, flags);
+
+		return 0;
+
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+static int udt1cri_net_get_berr_counter(const struct net_device *netdev,
+					struct can_berr_counter *bec)
+{
+	struct udt1cri_priv *priv = netdev_priv(netdev);
+
+	bec->txerr = priv->bec.txerr;
+	bec->rxerr = priv->bec.rxerr;
+
+	return 0;
+}
+
+static int udt1cri_usb_hwtstamp_get(struct net_device *netdev,
+				    struct ifreq *ifr)
+{
+	struct udt1cri_priv *priv = netdev_priv(netdev);
+	struct hwtstamp_config cfg = {
+		.tx_type = priv->hwts_tx ? HWTSTAMP_TX_ON : HWTSTAMP_TX_OFF,
+		.rx_filter = priv->hwts_rx ? HWTSTAMP_FILTER_ALL :
+					     HWTSTAMP_FILTER_NONE,
+	};
+
+	return copy_to_user(ifr->ifr_data, &cfg, sizeof(cfg)) ? -EFAULT : 0;
+}
+
+static int udt1cri_usb_hwtstamp_set(struct net_device *netdev,
+				    struct ifreq *ifr)
+{
+	struct udt1cri_priv *priv = netdev_priv(netdev);
+	struct hwtstamp_config cfg;
+
+	if (copy_from_user(&cfg, ifr->ifr_data, sizeof(cfg)))
+		return -EFAULT;
+
+	switch (cfg.tx_type) {
+	case HWTSTAMP_TX_OFF:
+	case HWTSTAMP_TX_ON:
+		break;
+	default:
+		return -ERANGE;
+	}
+
+	/* Every received frame carries a timestamp */
+	if (cfg.rx_filter != HWTSTAMP_FILTER_NONE)
+		cfg.rx_filter = HWTSTAMP_FILTER_ALL;
+
+	priv->hwts_tx = cfg.tx_type == HWTSTAMP_TX_ON;
+	priv->hwts_rx = cfg.rx_filter == HWTSTAMP_FILTER_ALL;
+
+	return copy_to_user(ifr->ifr_data, &cfg, sizeof(cfg)) ? -EFAULT : 0;
+}
+
+static int udt1cri_usb_ioctl(struct net_device *netdev, struct ifreq *ifr,
+			     int cmd)
+{
+	switch (cmd) {
+	case SIOCSHWTSTAMP:
+		return udt1cri_usb_hwtstamp_set(netdev, ifr);
+	case SIOCGHWTSTAMP:
+		return udt1cri_usb_hwtstamp_get(netdev, ifr);
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+/* The traffic and receive error counters are kept per CPU, the others,
+ * updated by the CAN core, in netdev->stats.
+ */
+static void udt1cri_usb_get_stats64(struct net_device *netdev,
+				    struct rtnl_link_stats64 *stats)
+{
+	struct udt1cri_priv *priv = netdev_priv(netdev);
+	struct udt1cri_dir_sum sum[UDT1CRI_DIRS];
+	u64 err[UDT1CRI_ERRS];
+
+	netdev_stats_to_stats64(stats, &netdev->stats);
+	udt1cri_stats_sum(priv, sum);
+	udt1cri_stats_err_sum(priv, err);
+
+	stats->rx_missed_errors += err[UDT1CRI_ERR_RX_MISSED];
+	stats->rx_over_errors += err[UDT1CRI_ERR_RX_OVER];
+	stats->rx_errors += err[UDT1CRI_ERR_RX_OVER];
+
+	stats->rx_packets += sum[UDT1CRI_RX].packets;
+	stats->rx_bytes += sum[UDT1CRI_RX].bytes;
+	stats->rx_dropped += sum[UDT1CRI_RX].dropped;
+	stats->tx_packets += sum[UDT1CRI_TX].packets;
+	stats->tx_bytes += sum[UDT1CRI_TX].bytes;
+	stats->tx_dropped += sum[UDT1CRI_TX].dropped;
+}
+
+static const struct net_device_ops udt1cri_netdev_ops = {
+	.ndo_open = udt1cri_usb_open,
+	.ndo_stop = udt1cri_usb_close,
+	.ndo_start_xmit = udt1cri_usb_start_xmit,
+	.ndo_get_stats64 = udt1cri_usb_get_stats64,
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 15, 0)
+	.ndo_do_ioctl = udt1cri_usb_ioctl,
+#else
+	.ndo_eth_ioctl = udt1cri_usb_ioctl,
+#endif
+};
+
+#define UDT1CRI_XSTAT_NAMED(_str, _field)                                      \
+	{                                                                      \
+		_str, offsetof(struct udt1cri_xstats, _field)                  \
+	}
+#define UDT1CRI_XSTAT(_name) UDT1CRI_XSTAT_NAMED(#_name, _name)
+#define UDT1CRI_XSTAT_ERR(_name, _err)                                         \
+	{                                                                      \
+		#_name, 0, UDT1CRI_ERR_##_err                                  \
+	}
+
+static const struct udt1cri_xstat_desc {
+	char name[ETH_GSTRING_LEN];
+	size_t offset;
+	enum udt1cri_err err; /* per-CPU counter, or UDT1CRI_ERR_NONE */
+} udt1cri_xstats_desc[] = {
+	UDT1CRI_XSTAT(tx_pool_exhausted),
+	UDT1CRI_XSTAT(tx_urb_exhausted),
+	UDT1CRI_XSTAT(tx_xfers),
+	UDT1CRI_XSTAT(tx_xfer_msgs),
+	UDT1CRI_XSTAT_NAMED("tx_xfer_1", tx_xfer_hist[0]),
+	UDT1CRI_XSTAT_NAMED("tx_xfer_2_3", tx_xfer_hist[1]),
+	UDT1CRI_XSTAT_NAMED("tx_xfer_4_7", tx_xfer_hist[2]),
+	UDT1CRI_XSTAT_NAMED("tx_xfer_8_15", tx_xfer_hist[3]),
+	UDT1CRI_XSTAT_NAMED("tx_xfer_16_25", tx_xfer_hist[4]),
+	UDT1CRI_XSTAT(rx_queue_overflow),
+	UDT1CRI_XSTAT_ERR(tx_rsp_unmatched, TX_RSP_UNMATCHED),
+	UDT1CRI_XSTAT(tx_confirm_timeout),
+	UDT1CRI_XSTAT(rx_polls),
+	UDT1CRI_XSTAT(rx_poll_frames),
+	UDT1CRI_XSTAT_NAMED("rx_poll_1", rx_poll_hist[0]),
+	UDT1CRI_XSTAT_NAMED("rx_poll_2_3", rx_poll_hist[1]),
+	UDT1CRI_XSTAT_NAMED("rx_poll_4_7", rx_poll_hist[2]),
+	UDT1CRI_XSTAT_NAMED("rx_poll_8_15", rx_poll_hist[3]),
+	UDT1CRI_XSTAT_NAMED("rx_poll_16_31", rx_poll_hist[4]),
+	UDT1CRI_XSTAT_NAMED("rx_poll_32_63", rx_poll_hist[5]),
+	UDT1CRI_XSTAT_NAMED("rx_poll_64", rx_poll_hist[6]),
+	UDT1CRI_XSTAT(tx_ctx_exhausted),
+	UDT1CRI_XSTAT_ERR(tx_urb_errors, TX_URB),
+	UDT1CRI_XSTAT(rx_urb_errors),
+	UDT1CRI_XSTAT(rx_format_errors),
+	UDT1CRI_XSTAT(rx_unknown_msgs),
+	UDT1CRI_XSTAT(rx_xfers),
+	UDT1CRI_XSTAT(rx_xfer_msgs),
+	UDT1CRI_XSTAT_NAMED("rx_xfer_1", rx_xfer_hist[0]),
+	UDT1CRI_XSTAT_NAMED("rx_xfer_2_3", rx_xfer_hist[1]),
+	UDT1CRI_XSTAT_NAMED("rx_xfer_4_7", rx_xfer_hist[2]),
+	UDT1CRI_XSTAT_NAMED("rx_xfer_8_15", rx_xfer_hist[3]),
+	UDT1CRI_XSTAT_NAMED("rx_xfer_16_31", rx_xfer_hist[4]),
+	UDT1CRI_XSTAT_NAMED("rx_xfer_32", rx_xfer_hist[5]),
+	UDT1CRI_XSTAT(dev_rx_overflow),
+	UDT1CRI_XSTAT(dev_rx_lost),
+	UDT1CRI_XSTAT_ERR(rx_filtered, RX_FILTERED),
+	UDT1CRI_XSTAT(pm_resumes),
+	UDT1CRI_XSTAT(pm_resume_rx_us),
+	UDT1CRI_XSTAT(cmd_sync),
+	UDT1CRI_XSTAT(cmd_retries),
+	UDT1CRI_XSTAT(cmd_timeouts),
+	UDT1CRI_XSTAT(cmd_confirm_us),
+	UDT1CRI_XSTAT(cmd_xfers),
+	UDT1CRI_XSTAT(cmd_queue_full),
+	UDT1CRI_XSTAT(tx_periodic),
+	UDT1CRI_XSTAT(tx_periodic_missed),
+	UDT1CRI_XSTAT_NAMED("rx_fps_100ms", load.rx_fps[0]),
+	UDT1CRI_XSTAT_NAMED("rx_fps_1s", load.rx_fps[1]),
+	UDT1CRI_XSTAT_NAMED("rx_fps_10s", load.rx_fps[2]),
+	UDT1CRI_XSTAT_NAMED("tx_fps_100ms", load.tx_fps[0]),
+	UDT1CRI_XSTAT_NAMED("tx_fps_1s", load.tx_fps[1]),
+	UDT1CRI_XSTAT_NAMED("tx_fps_10s", load.tx_fps[2]),
+	UDT1CRI_XSTAT_NAMED("rx_load_100ms", load.rx_load[0]),
+	UDT1CRI_XSTAT_NAMED("rx_load_1s", load.rx_load[1]),
+	UDT1CRI_XSTAT_NAMED("rx_load_10s", load.rx_load[2]),
+	UDT1CRI_XSTAT_NAMED("tx_load_100ms", load.tx_load[0]),
+	UDT1CRI_XSTAT_NAMED("tx_load_1s", load.tx_load[1]),
+	UDT1CRI_XSTAT_NAMED("tx_load_10s", load.tx_load[2]),
+	UDT1CRI_XSTAT_NAMED("bus_load_100ms", load.bus_load[0]),
+	UDT1CRI_XSTAT_NAMED("bus_load_1s", load.bus_load[1]),
+	UDT1CRI_XSTAT_NAMED("bus_load_10s", load.bus_load[2]),
+};
+
+static int udt1cri_get_sset_count(struct net_device *netdev, int sset)
+{
+	switch (sset) {
+	case ETH_SS_STATS:
+		return ARRAY_SIZE(udt1cri_xstats_desc);
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+static void udt1cri_get_strings(struct net_device *netdev, u32 sset, u8 *data)
+{
+	int i;
+
+	if (sset != ETH_SS_STATS)
+		return;
+
+	for (i = 0; i < ARRAY_SIZE(udt1cri_xstats_desc); i++)
+		memcpy(data + i * ETH_GSTRING_LEN, udt1cri_xstats_desc[i].name,
+		       ETH_GSTRING_LEN);
+}
+
+static void udt1cri_get_ethtool_stats(struct net_device *netdev,
+				      struct ethtool_stats *stats, u64 *data)
+{
+	struct udt1cri_priv *priv = netdev_priv(netdev);
+	const u8 *xstats = (const u8 *)&priv->xstats;
+	u64 err[UDT1CRI_ERRS];
+	int i;
+
+	udt1cri_stats_err_sum(priv, err);
+
+	for (i = 0; i < ARRAY_SIZE(udt1cri_xstats_desc); i++) {
+		const struct udt1cri_xstat_desc *desc = &udt1cri_xstats_desc[i];
+
+		data[i] = desc->err ? err[desc->err] :
+				      *(const u64 *)(xstats + desc->offset);
+	}
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 11, 0)
+static int udt1cri_get_ts_info(struct net_device *netdev,
+			       struct ethtool_ts_info *info)
+#else
+static int udt1cri_get_ts_info(struct net_device *netdev,
+			       struct kernel_ethtool_ts_info *info)
+#endif
+{
+	info->so_timestamping = SOF_TIMESTAMPING_TX_SOFTWARE |
+				SOF_TIMESTAMPING_RX_SOFTWARE |
+				SOF_TIMESTAMPING_SOFTWARE |
+				SOF_TIMESTAMPING_TX_HARDWARE |
+				SOF_TIMESTAMPING_RX_HARDWARE |
+				SOF_TIMESTAMPING_RAW_HARDWARE;
+	info->phc_index = -1;
+	info->tx_types = BIT(HWTSTAMP_TX_OFF) | BIT(HWTSTAMP_TX_ON);
+	info->rx_filters = BIT(HWTSTAMP_FILTER_NONE) | BIT(HWTSTAMP_FILTER_ALL);
+
+	return 0;
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 17, 0)
+static void udt1cri_get_ringparam(struct net_device *netdev,
+				  struct ethtool_ringparam *ring)
+#else
+static void udt1cri_get_ringparam(struct net_device *netdev,
+				  struct ethtool_ringparam *ring,
+				  struct kernel_ethtool_ringparam *kring,
+				  struct netlink_ext_ack *extack)
+#endif
+{
+	struct udt1cri_priv *priv = netdev_priv(netdev);
+
+	ring->rx_max_pending = UDT1CRI_RX_URBS_MAX;
+	ring->tx_max_pending = UDT1CRI_TX_CTX_MAX;
+	ring->rx_pending = priv->rx_urbs_cnt;
+	ring->tx_pending = priv->tx_ctx_cnt;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 17, 0)
+	kring->rx_buf_len = priv->rx_buf_size;
+#endif
+}
+
+/* Resize the RX URBs and TX contexts. Only allowed while the interface is
+ * down, when no frame is in flight.
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 17, 0)
+static int udt1cri_set_ringparam(struct net_device *netdev,
+				 struct ethtool_ringparam *ring)
+#else
+static int udt1cri_set_ringparam(struct net_device *netdev,
+				 struct ethtool_ringparam *ring,
+				 struct kernel_ethtool_ringparam *kring,
+				 struct netlink_ext_ack *extack)
+#endif
+{
+	struct udt1cri_priv *priv = netdev_priv(netdev);
+	unsigned int rx_buf_size = priv->rx_buf_size;
+	unsigned int tx_ctx_cnt;
+	int err;
+
+	if (netif_running(netdev))
+		return -EBUSY;
+
+	if (ring->rx_mini_pending || ring->rx_jumbo_pending)
+		return -EINVAL;
+
+	if (!ring->rx_pending || ring->rx_pending > UDT1CRI_RX_URBS_MAX ||
+	    ring->tx_pending < UDT1CRI_TX_CTX_MIN ||
+	    ring->tx_pending > UDT1CRI_TX_CTX_MAX)
+		return -EINVAL;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 17, 0)
+	if (kring->rx_buf_len)
+		rx_buf_size = kring->rx_buf_len;
+#endif
+	if (rx_buf_size < UDT1CRI_USB_RX_BUFF_SIZE ||
+	    rx_buf_size > UDT1CRI_USB_RX_BUFF_SIZE_MAX ||
+	    rx_buf_size % UDT1CRI_USB_RX_BUFF_SIZE)
+		return -EINVAL;
+
+	tx_ctx_cnt = roundup_pow_of_two(ring->tx_pending);
+	if (tx_ctx_cnt != priv->tx_ctx_cnt) {
+		err = udt1cri_alloc_ctx(priv, tx_ctx_cnt);
+		if (err)
+			return err;
+	}
+
+	/* RX transfers are set up with the new sizes on open */
+	priv->rx_urbs_cnt = ring->rx_pending;
+	priv->rx_buf_size = rx_buf_size;
+
+	return 0;
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 15, 0)
+static int udt1cri_get_coalesce(struct net_device *netdev,
+				struct ethtool_coalesce *ec)
+#else
+static int udt1cri_get_coalesce(struct net_device *netdev,
+				struct ethtool_coalesce *ec,
+				struct kernel_ethtool_coalesce *kec,
+				struct netlink_ext_ack *extack)
+#endif
+{
+	struct udt1cri_priv *priv = netdev_priv(netdev);
+
+	ec->rx_coalesce_usecs = priv->rx_coalesce_usecs;
+	ec->rx_max_coalesced_frames = priv->rx_max_frames;
+	ec->use_adaptive_rx_coalesce = priv->rx_adaptive;
+
+	return 0;
+}
+
+/* Received frames are delivered rx-usecs after the first of them was
+ * queued, or as soon as rx-frames are queued. rx-usecs 0 delivers the
+ * frames of each transfer right away.
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 15, 0)
+static int udt1cri_set_coalesce(struct net_device *netdev,
+				struct ethtool_coalesce *ec)
+#else
+static int udt1cri_set_coalesce(struct net_device *netdev,
+				struct ethtool_coalesce *ec,
+				struct kernel_ethtool_coalesce *kec,
+				struct netlink_ext_ack *extack)
+#endif
+{
+	struct udt1cri_priv *priv = netdev_priv(netdev);
+	unsigned long flags;
+
+	if (ec->rx_coalesce_usecs > UDT1CRI_RX_COALESCE_USECS_MAX ||
+	    ec->rx_max_coalesced_frames > UDT1CRI_RX_QUEUE_MAX)
+		return -EINVAL;
+
+	/* Without rx-usecs, frames are never held, so rx-frames has no use */
+	if (!ec->rx_coalesce_usecs && ec->rx_max_coalesced_frames)
+		return -EINVAL;
+
+	/* Frames already held are delivered by the armed timer */
+	spin_lock_irqsave(&priv->rx_queue.lock, flags);
+	priv->rx_coalesce_usecs = ec->rx_coalesce_usecs;
+	priv->rx_max_frames = ec->rx_max_coalesced_frames;
+	priv->rx_adaptive = ec->use_adaptive_rx_coalesce;
+	priv->rx_adaptive_hold = false;
+	priv->rx_rate_start = jiffies;
+	priv->rx_rate_frames = 0;
+	spin_unlock_irqrestore(&priv->rx_queue.lock, flags);
+
+	return 0;
+}
+
+static const struct ethtool_ops udt1cri_ethtool_ops = {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 7, 0)
+	.supported_coalesce_params = ETHTOOL_COALESCE_RX_USECS |
+				     ETHTOOL_COALESCE_RX_MAX_FRAMES |
+				     ETHTOOL_COALESCE_USE_ADAPTIVE_RX,
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 17, 0)
+	.supported_ring_params = ETHTOOL_RING_USE_RX_BUF_LEN,
+#endif
+	.get_coalesce = udt1cri_get_coalesce,
+	.set_coalesce = udt1cri_set_coalesce,
+	.get_ringparam = udt1cri_get_ringparam,
+	.set_ringparam = udt1cri_set_ringparam,
+	.get_ts_info = udt1cri_get_ts_info,
+	.get_sset_count = udt1cri_get_sset_count,
+	.get_strings = udt1cri_get_strings,
+	.get_ethtool_stats = udt1cri_get_ethtool_stats,
+};
+
+/* Copy of the acceptance filter to modify, with filter_lock held */
+static struct udt1cri_filter *udt1cri_filter_dup(struct udt1cri_priv *priv)
+{
+	struct udt1cri_filter *filter;
+
+	mutex_lock(&priv->filter_lock);
+
+	filter = kmemdup(rcu_dereference_protected(priv->filter,
+				lockdep_is_held(&priv->filter_lock)),
+			 sizeof(*filter), GFP_KERNEL);
+	if (!filter)
+		mutex_unlock(&priv->filter_lock);
+
+	return filter;
+}
+
+/* Install the filter from udt1cri_filter_dup(), or discard it on error */
+static int udt1cri_filter_commit(struct udt1cri_priv *priv,
+				 struct udt1cri_filter *filter, int err)
+{
+	struct udt1cri_filter *old = NULL;
+
+	if (!err) {
+		old = rcu_dereference_protected(priv->filter,
+				lockdep_is_held(&priv->filter_lock));
+		rcu_assign_pointer(priv->filter, filter);
+	} else {
+		kfree(filter);
+	}
+
+	mutex_unlock(&priv->filter_lock);
+
+	if (old)
+		kfree_rcu(old, rcu);
+
+	return err;
+}
+
+static ssize_t rx_filter_show(struct device *dev,
+			      struct device_attribute *attr, char *buf)
+{
+	struct udt1cri_priv *priv = netdev_priv(to_net_dev(dev));
+	bool enabled;
+
+	rcu_read_lock();
+	enabled = rcu_dereference(priv->filter)->enabled;
+	rcu_read_unlock();
+
+	return sprintf(buf, "%d\n", enabled);
+}
+
+static ssize_t rx_filter_store(struct device *dev,
+			       struct device_attribute *attr, const char *buf,
+			       size_t count)
+{
+	struct udt1cri_priv *priv = netdev_priv(to_net_dev(dev));
+	struct udt1cri_filter *filter;
+	int err;
+
+	filter = udt1cri_filter_dup(priv);
+	if (!filter)
+		return -ENOMEM;
+
+	err = kstrtobool(buf, &filter->enabled);
+
+	return udt1cri_filter_commit(priv, filter, err) ?: count;
+}
+
+/* Standard identifiers as a decimal range list, e.g. 256-271,1024 */
+static ssize_t rx_filter_sff_show(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	struct udt1cri_priv *priv = netdev_priv(to_net_dev(dev));
+	ssize_t len;
+
+	rcu_read_lock();
+	len = bitmap_print_to_pagebuf(true, buf,
+				      rcu_dereference(priv->filter)->sff,
+				      CAN_SFF_MASK + 1);
+	rcu_read_unlock();
+
+	return len;
+}
+
+static ssize_t rx_filter_sff_store(struct device *dev,
+				   struct device_attribute *attr,
+				   const char *buf, size_t count)
+{
+	struct udt1cri_priv *priv = netdev_priv(to_net_dev(dev));
+	struct udt1cri_filter *filter;
+	int err;
+
+	filter = udt1cri_filter_dup(priv);
+	if (!filter)
+		return -ENOMEM;
+
+	err = bitmap_parselist(buf, filter->sff, CAN_SFF_MASK + 1);
+
+	return udt1cri_filter_commit(priv, filter, err) ?: count;
+}
+
+/* Extended identifiers as hexadecimal id/mask pairs, e.g. 18fe0000/1fff0000 */
+static ssize_t rx_filter_eff_show(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	struct udt1cri_priv *priv = netdev_priv(to_net_dev(dev));
+	const struct udt1cri_filter *filter;
+	unsigned int i;
+	ssize_t len = 0;
+
+	rcu_read_lock();
+	filter = rcu_dereference(priv->filter);
+	for (i = 0; i < filter->eff_cnt; i++)
+		len += sprintf(buf + len, "%s%08x/%08x", i ? " " : "",
+			       filter->eff[i].can_id, filter->eff[i].can_mask);
+	rcu_read_unlock();
 
-	case -ENOENT:
-	case -EPIPE:
-	case -EPROTO:
-	case -ESHUTDOWN:
-		return;
+	len += sprintf(buf + len, "\n");
 
-	default:
-		netdev_info(netdev, "Rx URB aborted (%d)\n", urb->status);
+	return len;
+}
 
-		goto resubmit_urb;
-	}
+static int udt1cri_filter_parse_eff(struct udt1cri_filter *filter,
+				    const char *buf)
+{
+	unsigned int n = 0;
 
-	while (pos < urb->actual_length) {
-		struct udt1cri_usb_msg *msg;
+	for (;;) {
+		u32 id, mask;
+		int len;
 
-		if (pos + sizeof(struct udt1cri_usb_msg) > urb->actual_length) {
-			netdev_err(priv->netdev, "format error\n");
+		buf = skip_spaces(buf);
+		if (!*buf)
 			break;
-		}
 
-		msg = (struct udt1cri_usb_msg *)(urb->transfer_buffer + pos);
-		udt1cri_usb_process_rx(priv, msg);
+		if (sscanf(buf, "%x/%x%n", &id, &mask, &len) != 2)
+			return -EINVAL;
+		if (n == UDT1CRI_FILTER_EFF_MAX)
+			return -ENOSPC;
 
-		pos += sizeof(struct udt1cri_usb_msg);
+		filter->eff[n].can_id = id & CAN_EFF_MASK;
+		filter->eff[n].can_mask = mask & CAN_EFF_MASK;
+		n++;
+		buf += len;
 	}
 
-resubmit_urb:
+	filter->eff_cnt = n;
 
-	usb_fill_bulk_urb(urb, priv->udev,
-			  usb_rcvbulkpipe(priv->udev, UDT1CRI_USB_EP_OUT),
-			  urb->transfer_buffer, UDT1CRI_USB_RX_BUFF_SIZE,
-			  udt1cri_usb_read_bulk_callback, priv);
+	return 0;
+}
 
-	retval = usb_submit_urb(urb, GFP_ATOMIC);
+static ssize_t rx_filter_eff_store(struct device *dev,
+				   struct device_attribute *attr,
+				   const char *buf, size_t count)
+{
+	struct udt1cri_priv *priv = netdev_priv(to_net_dev(dev));
+	struct udt1cri_filter *filter;
+	int err;
 
-	if (retval == -ENODEV)
-		netif_device_detach(netdev);
-	else if (retval)
-		netdev_err(netdev, "failed resubmitting read bulk urb: %d\n",
-			   retval);
+	filter = udt1cri_filter_dup(priv);
+	if (!filter)
+		return -ENOMEM;
+
+	err = udt1cri_filter_parse_eff(filter, buf);
+
+	return udt1cri_filter_commit(priv, filter, err) ?: count;
 }
 
-/* Start USB device */
-static int udt1cri_usb_start(struct udt1cri_priv *priv)
+/* Frame in the cansend format: 123#1122, 12345678#R or, for CAN FD,
+ * 123##1aabb, where the digit after ## holds the CANFD_BRS and CANFD_ESI
+ * flags. Returns the number of characters parsed.
+ */
+static int udt1cri_periodic_parse_frame(const char *buf,
+					struct canfd_frame *cfd, bool *fd)
 {
-	struct net_device *netdev = priv->netdev;
-	int err, i;
-
-	udt1cri_init_ctx(priv);
+	unsigned int n, max;
+	int hi, lo;
+
+	memset(cfd, 0, sizeof(*cfd));
+
+	for (n = 0; n < 8 && (hi = hex_to_bin(buf[n])) >= 0; n++)
+		cfd->can_id = cfd->can_id << 4 | hi;
+
+	if (n == 8 && cfd->can_id <= CAN_EFF_MASK)
+		cfd->can_id |= CAN_EFF_FLAG;
+	else if (n != 3 || cfd->can_id > CAN_SFF_MASK)
+		return -EINVAL;
+
+	if (buf[n++] != '#')
+		return -EINVAL;
+
+	*fd = buf[n] == '#';
+	if (*fd) {
+		hi = hex_to_bin(buf[++n]);
+		if (hi < 0)
+			return -EINVAL;
+		cfd->flags = hi & (CANFD_BRS | CANFD_ESI);
+		n++;
+	} else if (buf[n] == 'R') {
+		cfd->can_id |= CAN_RTR_FLAG;
+		return n + 1;
+	}
 
-	for (i = 0; i < UDT1CRI_MAX_RX_URBS; i++) {
-		struct urb *urb = NULL;
-		u8 *buf;
+	max = *fd ? CANFD_MAX_DLEN : CAN_MAX_DLEN;
+	for (;;) {
+		if (buf[n] == '.')
+			n++;
 
-		/* create a URB, and a buffer for it */
-		urb = usb_alloc_urb(0, GFP_KERNEL);
-		if (!urb) {
-			err = -ENOMEM;
+		hi = hex_to_bin(buf[n]);
+		if (hi < 0)
 			break;
-		}
+		lo = hex_to_bin(buf[n + 1]);
+		if (lo < 0 || cfd->len == max)
+			return -EINVAL;
 
-		buf = usb_alloc_coherent(priv->udev, UDT1CRI_USB_RX_BUFF_SIZE,
-					 GFP_KERNEL, &urb->transfer_dma);
-		if (!buf) {
-			netdev_err(netdev, "No memory left for USB buffer\n");
-			usb_free_urb(urb);
-			err = -ENOMEM;
-			break;
-		}
+		cfd->data[cfd->len++] = hi << 4 | lo;
+		n += 2;
+	}
 
-		usb_fill_bulk_urb(urb, priv->udev,
-				  usb_rcvbulkpipe(priv->udev,
-						  UDT1CRI_USB_EP_IN),
-				  buf, UDT1CRI_USB_RX_BUFF_SIZE,
-				  udt1cri_usb_read_bulk_callback, priv);
-		urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
-		usb_anchor_urb(urb, &priv->rx_submitted);
+	/* A CAN FD frame longer than 8 bytes has one of the DLC lengths */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 11, 0)
+	if (can_dlc2len(can_len2dlc(cfd->len)) != cfd->len)
+#else
+	if (can_fd_dlc2len(can_fd_len2dlc(cfd->len)) != cfd->len)
+#endif
+		return -EINVAL;
 
-		err = usb_submit_urb(urb, GFP_KERNEL);
-		if (err) {
-			usb_unanchor_urb(urb);
-			usb_free_coherent(priv->udev, UDT1CRI_USB_RX_BUFF_SIZE,
-					  buf, urb->transfer_dma);
-			usb_free_urb(urb);
-			break;
-		}
+	return n;
+}
 
-		/* Drop reference, USB core will take care of freeing it */
-		usb_free_urb(urb);
+/* Write "<slot> <period in us> <frame>" to send a frame periodically, or
+ * "<slot> 0" to stop. Writing a slot again with the same period updates
+ * its frame atomically.
+ */
+static ssize_t tx_periodic_store(struct device *dev,
+				 struct device_attribute *attr,
+				 const char *buf, size_t count)
+{
+	struct udt1cri_priv *priv = netdev_priv(to_net_dev(dev));
+	struct udt1cri_periodic new = {};
+	unsigned int slot, period_us, bits, dbits;
+	struct canfd_frame cfd;
+	bool fd;
+	int n;
+
+	if (sscanf(buf, "%u %u%n", &slot, &period_us, &n) != 2)
+		return -EINVAL;
+	if (slot >= UDT1CRI_PERIODIC_MAX)
+		return -ERANGE;
+	buf = skip_spaces(buf + n);
+
+	if (period_us) {
+		if (period_us < UDT1CRI_PERIODIC_MIN_US)
+			return -EINVAL;
+
+		n = udt1cri_periodic_parse_frame(buf, &cfd, &fd);
+		if (n < 0)
+			return n;
+		if (fd && !priv->fd)
+			return -EOPNOTSUPP;
+		buf = skip_spaces(buf + n);
+
+		new.period_ns = (u64)period_us * NSEC_PER_USEC;
+		new.msg_len = udt1cri_usb_encode_can(&cfd, fd, &new.msg);
+		new.len = cfd.len;
+		bits = udt1cri_bus_bits(&cfd, fd, &dbits);
+		new.bus_bits = bits;
+		new.bus_dbits = dbits;
 	}
 
-	/* Did we submit any URBs */
-	if (i == 0) {
-		netdev_warn(netdev, "couldn't setup read URBs\n");
-		return err;
+	if (*buf)
+		return -EINVAL;
+
+	udt1cri_usb_periodic_set(priv, slot, &new);
+
+	return count;
+}
+
+static DEVICE_ATTR_RW(rx_filter);
+static DEVICE_ATTR_RW(rx_filter_sff);
+static DEVICE_ATTR_RW(rx_filter_eff);
+static DEVICE_ATTR_WO(tx_periodic);
+
+static struct attribute *udt1cri_sysfs_attrs[] = {
+	&dev_attr_rx_filter.attr,
+	&dev_attr_rx_filter_sff.attr,
+	&dev_attr_rx_filter_eff.attr,
+	&dev_attr_tx_periodic.attr,
+	NULL
+};
+
+static const struct attribute_group udt1cri_sysfs_group = {
+	.attrs = udt1cri_sysfs_attrs,
+};
+
+static void udt1cri_hist_show(struct seq_file *m, const u64 *hist)
+{
+	unsigned int i;
+
+	for (i = 0; i < UDT1CRI_HIST_LEN; i++) {
+		seq_printf(m, "%u", i ? 1U << (i - 1) : 0);
+		if (i == UDT1CRI_HIST_LEN - 1)
+			seq_puts(m, "+");
+		else if (i > 1)
+			seq_printf(m, "-%u", (1U << i) - 1);
+		seq_printf(m, "\t%llu\n", hist[i]);
 	}
+}
 
-	/* Warn if we've couldn't transmit all the URBs */
-	if (i < UDT1CRI_MAX_RX_URBS)
-		netdev_warn(netdev, "rx performance may be slow\n");
+static int udt1cri_tx_urb_latency_show(struct seq_file *m, void *v)
+{
+	struct udt1cri_priv *priv = m->private;
 
-	udt1cri_usb_xmit_read_fw_ver(priv, UDT1CRI_VER_REQ_USB);
-	udt1cri_usb_xmit_read_fw_ver(priv, UDT1CRI_VER_REQ_CAN);
+	udt1cri_hist_show(m, priv->tx_urb_latency_hist);
 
-	return err;
+	return 0;
 }
+DEFINE_SHOW_ATTRIBUTE(udt1cri_tx_urb_latency);
 
-/* Open USB device */
-static int udt1cri_usb_open(struct net_device *netdev)
+static int udt1cri_rx_xfer_frames_show(struct seq_file *m, void *v)
 {
-	struct udt1cri_priv *priv = netdev_priv(netdev);
-	int err;
+	struct udt1cri_priv *priv = m->private;
 
-	/* common open */
-	err = open_candev(netdev);
-	if (err)
-		return err;
+	udt1cri_hist_show(m, priv->rx_xfer_frames_hist);
 
-	priv->can_speed_check = true;
-	priv->can.state = CAN_STATE_ERROR_ACTIVE;
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(udt1cri_rx_xfer_frames);
 
-	netif_start_queue(netdev);
+static int udt1cri_tx_periodic_jitter_show(struct seq_file *m, void *v)
+{
+	struct udt1cri_priv *priv = m->private;
+
+	udt1cri_hist_show(m, priv->tx_periodic_jitter_hist);
 
 	return 0;
 }
+DEFINE_SHOW_ATTRIBUTE(udt1cri_tx_periodic_jitter);
 
-static void udt1cri_urb_unlink(struct udt1cri_priv *priv)
+/* Slots in use: period, identifier, sent and missed periods, mean and
+ * maximum jitter in microseconds
+ */
+static int udt1cri_tx_periodic_show(struct seq_file *m, void *v)
 {
-	usb_kill_anchored_urbs(&priv->rx_submitted);
-	usb_kill_anchored_urbs(&priv->tx_submitted);
+	struct udt1cri_priv *priv = m->private;
+	struct udt1cri_periodic p;
+	unsigned long flags;
+	unsigned int i;
+
+	seq_puts(m, "slot\tperiod_us\tid\tsent\tmissed\tjitter_us\tmax_us\n");
+
+	for (i = 0; i < UDT1CRI_PERIODIC_MAX; i++) {
+		spin_lock_irqsave(&priv->tx_lock, flags);
+		p = priv->periodic[i];
+		spin_unlock_irqrestore(&priv->tx_lock, flags);
+
+		if (!p.period_ns)
+			continue;
+
+		seq_printf(m, "%u\t%llu\t%08x\t%llu\t%llu\t%llu\t%llu\n", i,
+			   div_u64(p.period_ns, NSEC_PER_USEC),
+			   __le32_to_cpu(p.msg.eid) & CAN_EFF_MASK, p.sent,
+			   p.missed,
+			   p.sent ? div64_u64(p.jitter_sum_ns,
+					      p.sent * NSEC_PER_USEC) : 0,
+			   div_u64(p.jitter_max_ns, NSEC_PER_USEC));
+	}
+
+	return 0;
 }
+DEFINE_SHOW_ATTRIBUTE(udt1cri_tx_periodic);
 
-/* Close USB device */
-static int udt1cri_usb_close(struct net_device *netdev)
+#if IS_ENABLED(CONFIG_RELAY)
+static struct dentry *
+udt1cri_capture_create_buf_file(const char *filename, struct dentry *parent,
+				umode_t mode, struct rchan_buf *buf,
+				int *is_global)
 {
-	struct udt1cri_priv *priv = netdev_priv(netdev);
+	return debugfs_create_file(filename, mode, parent, buf,
+				   &relay_file_operations);
+}
 
-	priv->can.state = CAN_STATE_STOPPED;
+static int udt1cri_capture_remove_buf_file(struct dentry *dentry)
+{
+	debugfs_remove(dentry);
 
-	netif_stop_queue(netdev);
+	return 0;
+}
 
-	/* Stop polling */
-	udt1cri_urb_unlink(priv);
+/* Records are dropped, never overwritten, while the buffer is full */
+static struct rchan_callbacks udt1cri_capture_callbacks = {
+	.create_buf_file = udt1cri_capture_create_buf_file,
+	.remove_buf_file = udt1cri_capture_remove_buf_file,
+};
 
-	close_candev(netdev);
+static int udt1cri_capture_get(void *data, u64 *val)
+{
+	struct udt1cri_priv *priv = data;
+
+	*val = !!rcu_access_pointer(priv->capture);
 
 	return 0;
 }
 
-/* Set network device mode
- *
- * Maybe we should leave this function empty, because the device
- * set mode variable with open command.
+/* Writing 1 starts a new capture in capture0 to capture<N>, one file per
+ * CPU. Writing 0 stops it and makes the last records readable, the files
+ * stay until the next start.
  */
-static int udt1cri_net_set_mode(struct net_device *netdev, enum can_mode mode)
+static int udt1cri_capture_set(void *data, u64 val)
 {
-	return 0;
+	struct udt1cri_priv *priv = data;
+	struct rchan *chan;
+	int err = 0;
+
+	mutex_lock(&priv->capture_lock);
+
+	chan = priv->capture_chan;
+	if (priv->capture_closed) {
+		err = -ENODEV;
+	} else if (val && !rcu_access_pointer(priv->capture)) {
+		if (chan) {
+			relay_reset(chan);
+		} else {
+			chan = relay_open("capture", priv->debugfs,
+					  UDT1CRI_CAPTURE_SUBBUF_SIZE,
+					  UDT1CRI_CAPTURE_SUBBUFS,
+					  &udt1cri_capture_callbacks, NULL);
+			if (!chan) {
+				err = -ENOMEM;
+				goto out;
+			}
+			priv->capture_chan = chan;
+		}
+
+		atomic_set(&priv->capture_seq, 0);
+		atomic_set(&priv->capture_lost, 0);
+		rcu_assign_pointer(priv->capture, chan);
+	} else if (!val && rcu_access_pointer(priv->capture)) {
+		RCU_INIT_POINTER(priv->capture, NULL);
+		/* Wait for the records being written */
+		synchronize_rcu();
+		relay_flush(chan);
+	}
+
+out:
+	mutex_unlock(&priv->capture_lock);
+
+	return err;
 }
+DEFINE_DEBUGFS_ATTRIBUTE(udt1cri_capture_fops, udt1cri_capture_get,
+			 udt1cri_capture_set, "%llu\n");
 
-static int udt1cri_net_get_berr_counter(const struct net_device *netdev,
-					struct can_berr_counter *bec)
+/* Stop the capture and remove its files, before the debugfs directory */
+static void udt1cri_capture_close(struct udt1cri_priv *priv)
 {
-	struct udt1cri_priv *priv = netdev_priv(netdev);
+	udt1cri_capture_set(priv, 0);
 
-	bec->txerr = priv->bec.txerr;
-	bec->rxerr = priv->bec.rxerr;
+	mutex_lock(&priv->capture_lock);
 
-	return 0;
+	if (priv->capture_chan)
+		relay_close(priv->capture_chan);
+	priv->capture_chan = NULL;
+	priv->capture_closed = true;
+
+	mutex_unlock(&priv->capture_lock);
+}
+#else
+static inline void udt1cri_capture_close(struct udt1cri_priv *priv)
+{
 }
+#endif
 
-static const struct net_device_ops udt1cri_netdev_ops = {
-	.ndo_open = udt1cri_usb_open,
-	.ndo_stop = udt1cri_usb_close,
-	.ndo_start_xmit = udt1cri_usb_start_xmit,
-};
+/* Histograms in debugfs, under udt1cri_usb/<USB interface>/ */
+static void udt1cri_debugfs_init(struct udt1cri_priv *priv,
+				 struct usb_interface *intf)
+{
+	priv->debugfs = debugfs_create_dir(dev_name(&intf->dev),
+					   udt1cri_debugfs_root);
+
+	debugfs_create_file("tx_urb_latency_us", 0444, priv->debugfs, priv,
+			    &udt1cri_tx_urb_latency_fops);
+	debugfs_create_file("rx_xfer_frames", 0444, priv->debugfs, priv,
+			    &udt1cri_rx_xfer_frames_fops);
+	debugfs_create_file("tx_periodic", 0444, priv->debugfs, priv,
+			    &udt1cri_tx_periodic_fops);
+	debugfs_create_file("tx_periodic_jitter_us", 0444, priv->debugfs, priv,
+			    &udt1cri_tx_periodic_jitter_fops);
+#if IS_ENABLED(CONFIG_RELAY)
+	debugfs_create_file_unsafe("capture", 0600, priv->debugfs, priv,
+				   &udt1cri_capture_fops);
+	debugfs_create_atomic_t("capture_lost", 0444, priv->debugfs,
+				&priv->capture_lost);
+#endif
+}
 
 /* UDT1CRI CANBUS has hardcoded bittiming values by default.
  * This function sends request via USB to change the speed and align bittiming
- * values for presentation purposes only
+ * values for presentation purposes only. The device reports the bitrate it
+ * runs at in its CAN keep-alives.
  */
 static int udt1cri_net_set_bittiming(struct net_device *netdev)
 {
 	struct udt1cri_priv *priv = netdev_priv(netdev);
-	const u16 bitrate_kbps = priv->can.bittiming.bitrate / 1000;
+	const u32 bitrate = priv->can.bittiming.bitrate;
+	struct udt1cri_usb_msg_change_bitrate usb_msg;
 
-	udt1cri_usb_xmit_change_bitrate(priv, bitrate_kbps);
+	udt1cri_usb_init_bitrate_msg(&usb_msg, UDT1CRI_CMD_CHANGE_BIT_RATE,
+				     bitrate / 1000);
 
-	return 0;
+	return udt1cri_usb_cmd_sync(priv, (struct udt1cri_usb_msg *)&usb_msg,
+				    bitrate);
+}
+
+/* The keep-alives do not report the data bitrate, so there is nothing to
+ * wait for: the command is only queued, and not counted as a synchronous
+ * command.
+ */
+static int udt1cri_net_set_data_bittiming(struct net_device *netdev)
+{
+	struct udt1cri_priv *priv = netdev_priv(netdev);
+	struct udt1cri_usb_msg_change_bitrate usb_msg;
+	int err;
+
+	err = usb_autopm_get_interface(priv->intf);
+	if (err)
+		return err;
+
+	udt1cri_usb_init_bitrate_msg(&usb_msg, UDT1CRI_CMD_CHANGE_DATA_BIT_RATE,
+				     udt1cri_data_bitrate_kbps(priv));
+
+	err = udt1cri_usb_xmit_cmd(priv, (struct udt1cri_usb_msg *)&usb_msg);
+
+	usb_autopm_put_interface(priv->intf);
+
+	return err;
 }
 
+/* The device reports its termination state in its USB keep-alives */
 static int udt1cri_set_termination(struct net_device *netdev, u16 term)
 {
 	struct udt1cri_priv *priv = netdev_priv(netdev);
-	struct udt1cri_usb_msg_termination usb_msg = {
-		.cmd_id = UDT1CRI_CMD_SETUP_TERMINATION_RESISTANCE
-	};
+	struct udt1cri_usb_msg_termination usb_msg;
 
-	if (term == UDT1CRI_TERMINATION_ENABLED)
-		usb_msg.termination = 1;
-	else
-		usb_msg.termination = 0;
+	udt1cri_usb_init_termination_msg(&usb_msg, term);
 
-	udt1cri_usb_xmit_cmd(priv, (struct udt1cri_usb_msg *)&usb_msg);
+	return udt1cri_usb_cmd_sync(priv, (struct udt1cri_usb_msg *)&usb_msg,
+				    usb_msg.termination);
+}
 
-	return 0;
+/* Send the bus configuration again, the device may have lost it while
+ * suspended.
+ */
+static void udt1cri_usb_apply_config(struct udt1cri_priv *priv)
+{
+	if (priv->can.bittiming.bitrate)
+		udt1cri_usb_xmit_change_bitrate(
+			priv, priv->can.bittiming.bitrate / 1000);
+
+	if ((priv->can.ctrlmode & CAN_CTRLMODE_FD) &&
+	    udt1cri_data_bitrate_kbps(priv))
+		udt1cri_usb_xmit_change_data_bitrate(
+			priv, udt1cri_data_bitrate_kbps(priv));
+
+	udt1cri_usb_xmit_termination(priv, priv->can.termination);
 }
 
 static int udt1cri_usb_probe(struct usb_interface *intf,
@@ -784,9 +3968,11 @@ static int udt1cri_usb_probe(struct usb_interface *intf,
 	struct net_device *netdev;
 	struct udt1cri_priv *priv;
 	int err = -ENOMEM;
+	int cpu;
 	struct usb_device *usbdev = interface_to_usbdev(intf);
 
-	netdev = alloc_candev(sizeof(struct udt1cri_priv), UDT1CRI_MAX_TX_URBS);
+	/* The echo skb array is sized with the TX context ring */
+	netdev = alloc_candev(sizeof(struct udt1cri_priv), 0);
 	if (!netdev) {
 		dev_err(&intf->dev, "Couldn't alloc candev\n");
 		return -ENOMEM;
@@ -795,14 +3981,99 @@ static int udt1cri_usb_probe(struct usb_interface *intf,
 	priv = netdev_priv(netdev);
 
 	priv->udev = usbdev;
+	priv->intf = intf;
 	priv->netdev = netdev;
 	priv->usb_ka_first_pass = true;
 	priv->can_ka_first_pass = true;
 	priv->can_speed_check = false;
+	priv->fd = usbdev->product &&
+		   !strcmp(usbdev->product, UDT1CRI_PRODUCT_FD);
+	priv->tx_msg_max = priv->fd ? UDT1CRI_USB_FD_MSG_SIZE :
+				      UDT1CRI_USB_MSG_SIZE;
 
 	init_usb_anchor(&priv->rx_submitted);
 	init_usb_anchor(&priv->tx_submitted);
 
+	skb_queue_head_init(&priv->rx_queue);
+	mutex_init(&priv->rx_lock);
+	mutex_init(&priv->cmd_lock);
+	mutex_init(&priv->capture_lock);
+	spin_lock_init(&priv->cmd_wait_lock);
+	init_completion(&priv->cmd_wait.done);
+	spin_lock_init(&priv->tx_confirm_lock);
+	INIT_DELAYED_WORK(&priv->tx_confirm_work, udt1cri_usb_tx_confirm_work);
+	INIT_DELAYED_WORK(&priv->load_work, udt1cri_load_work);
+
+	udt1cri_ts_init(priv);
+	INIT_DELAYED_WORK(&priv->ts_work, udt1cri_ts_work);
+	priv->hwts_rx = true;
+	priv->hwts_tx = true;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 1, 0)
+	netif_napi_add(netdev, &priv->napi, udt1cri_usb_poll, NAPI_POLL_WEIGHT);
+#else
+	netif_napi_add(netdev, &priv->napi, udt1cri_usb_poll);
+#endif
+
+	spin_lock_init(&priv->tx_lock);
+	atomic_set(&priv->tx_urbs_in_flight, 0);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 13, 0)
+	hrtimer_init(&priv->tx_flush_timer, CLOCK_MONOTONIC,
+		     HRTIMER_MODE_REL_SOFT);
+	priv->tx_flush_timer.function = udt1cri_usb_tx_flush_timer;
+	hrtimer_init(&priv->rx_coalesce_timer, CLOCK_MONOTONIC,
+		     HRTIMER_MODE_REL_SOFT);
+	priv->rx_coalesce_timer.function = udt1cri_usb_rx_coalesce_timer;
+	hrtimer_init(&priv->periodic_timer, CLOCK_MONOTONIC,
+		     HRTIMER_MODE_ABS_SOFT);
+	priv->periodic_timer.function = udt1cri_usb_periodic_timer;
+#else
+	hrtimer_setup(&priv->tx_flush_timer, udt1cri_usb_tx_flush_timer,
+		      CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+	hrtimer_setup(&priv->rx_coalesce_timer, udt1cri_usb_rx_coalesce_timer,
+		      CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+	hrtimer_setup(&priv->periodic_timer, udt1cri_usb_periodic_timer,
+		      CLOCK_MONOTONIC, HRTIMER_MODE_ABS_SOFT);
+#endif
+
+	priv->rx_urbs_cnt = UDT1CRI_RX_URBS_DEFAULT;
+	priv->rx_buf_size = UDT1CRI_USB_RX_BUFF_SIZE;
+
+	err = udt1cri_alloc_ctx(priv, UDT1CRI_TX_CTX_DEFAULT);
+	if (err)
+		goto cleanup_free_candev;
+
+	/* Accept all frames until the filter is enabled through sysfs */
+	mutex_init(&priv->filter_lock);
+	RCU_INIT_POINTER(priv->filter,
+			 kzalloc(sizeof(struct udt1cri_filter), GFP_KERNEL));
+	if (!rcu_access_pointer(priv->filter)) {
+		err = -ENOMEM;
+		goto cleanup_free_ctx;
+	}
+
+	priv->stats = alloc_percpu(struct udt1cri_pcpu_stats);
+	priv->periodic = kcalloc(UDT1CRI_PERIODIC_MAX,
+				 sizeof(struct udt1cri_periodic), GFP_KERNEL);
+	if (!priv->stats || !priv->periodic) {
+		err = -ENOMEM;
+		goto cleanup_free_ctx;
+	}
+
+	for_each_possible_cpu(cpu) {
+		struct udt1cri_pcpu_stats *stats;
+
+		stats = per_cpu_ptr(priv->stats, cpu);
+		u64_stats_init(&stats->dir[UDT1CRI_RX].syncp);
+		u64_stats_init(&stats->dir[UDT1CRI_TX].syncp);
+		u64_stats_init(&stats->err.syncp);
+	}
+
+	BUILD_BUG_ON(sizeof(struct udt1cri_usb_msg) != UDT1CRI_USB_MSG_SIZE);
+	BUILD_BUG_ON(sizeof(struct udt1cri_usb_msg_canfd) !=
+		     UDT1CRI_USB_FD_MSG_SIZE);
+	BUILD_BUG_ON(offsetof(struct udt1cri_usb_msg_canfd, data) !=
+		     offsetof(struct udt1cri_usb_msg_can, data));
+
 	usb_set_intfdata(intf, priv);
 
 	/* Init CAN device */
@@ -817,7 +4088,26 @@ static int udt1cri_usb_probe(struct usb_interface *intf,
 	priv->can.do_get_berr_counter = udt1cri_net_get_berr_counter;
 	priv->can.do_set_bittiming = udt1cri_net_set_bittiming;
 
+	if (priv->fd) {
+		priv->can.ctrlmode_supported = CAN_CTRLMODE_FD;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 16, 0)
+		priv->can.data_bitrate_const = udt1cri_data_bitrate;
+		priv->can.data_bitrate_const_cnt =
+			ARRAY_SIZE(udt1cri_data_bitrate);
+		priv->can.do_set_data_bittiming =
+			udt1cri_net_set_data_bittiming;
+#else
+		priv->can.fd.data_bitrate_const = udt1cri_data_bitrate;
+		priv->can.fd.data_bitrate_const_cnt =
+			ARRAY_SIZE(udt1cri_data_bitrate);
+		priv->can.fd.do_set_data_bittiming =
+			udt1cri_net_set_data_bittiming;
+#endif
+	}
+
 	netdev->netdev_ops = &udt1cri_netdev_ops;
+	netdev->ethtool_ops = &udt1cri_ethtool_ops;
+	netdev->sysfs_groups[0] = &udt1cri_sysfs_group;
 
 	netdev->flags |= IFF_ECHO; /* we support local echo */
 
@@ -827,7 +4117,7 @@ static int udt1cri_usb_probe(struct usb_interface *intf,
 	if (err) {
 		netdev_err(netdev, "couldn't register CAN device: %d\n", err);
 
-		goto cleanup_free_candev;
+		goto cleanup_free_ctx;
 	}
 
 	/* Start USB dev only if we have successfully registered CAN device */
@@ -841,13 +4131,25 @@ static int udt1cri_usb_probe(struct usb_interface *intf,
 		goto cleanup_unregister_candev;
 	}
 
-	dev_info(&intf->dev, "UniSwarm UDT1CRI CAN debugger connected\n");
+	udt1cri_debugfs_init(priv, intf);
+
+	dev_info(&intf->dev, "UniSwarm %s CAN debugger connected\n",
+		 priv->fd ? "UDT1FRI" : "UDT1CRI");
 
 	return 0;
 
 cleanup_unregister_candev:
 	unregister_candev(priv->netdev);
 
+	usb_kill_anchored_urbs(&priv->tx_submitted);
+	udt1cri_usb_free_tx_pool(priv);
+
+cleanup_free_ctx:
+	kfree(priv->periodic);
+	free_percpu(priv->stats);
+	kfree(rcu_access_pointer(priv->filter));
+	udt1cri_free_ctx(priv);
+
 cleanup_free_candev:
 	free_candev(netdev);
 
@@ -863,20 +4165,151 @@ static void udt1cri_usb_disconnect(struct usb_interface *intf)
 
 	netdev_info(priv->netdev, "device disconnected\n");
 
+	udt1cri_capture_close(priv);
+	debugfs_remove_recursive(priv->debugfs);
+
 	unregister_candev(priv->netdev);
+
+	udt1cri_usb_drop_pending_tx(priv);
+	udt1cri_usb_stop_rx(priv);
+	usb_kill_anchored_urbs(&priv->tx_submitted);
+	udt1cri_usb_free_tx_pool(priv);
+	udt1cri_free_ctx(priv);
+	/* The RX URBs, the only readers, are gone */
+	kfree(rcu_access_pointer(priv->filter));
+	free_percpu(priv->stats);
+	/* Closing the interface stopped periodic_timer */
+	kfree(priv->periodic);
+
+	netif_napi_del(&priv->napi);
 	free_candev(priv->netdev);
+}
+
+/* System suspend, or autosuspend while the interface is down, when RX is
+ * already stopped. Frames in flight are lost, and the timers and works of
+ * a running interface are stopped until the resume.
+ */
+static int udt1cri_usb_suspend(struct usb_interface *intf,
+			       pm_message_t message)
+{
+	struct udt1cri_priv *priv = usb_get_intfdata(intf);
+	struct net_device *netdev = priv->netdev;
+
+	/* The device may lose its configuration with its power */
+	if (!PMSG_IS_AUTO(message))
+		priv->config_lost = true;
+
+	if (netif_running(netdev)) {
+		netif_device_detach(netdev);
+		udt1cri_usb_periodic_stop(priv);
+		udt1cri_usb_drop_pending_tx(priv);
+		cancel_delayed_work_sync(&priv->tx_confirm_work);
+		cancel_delayed_work_sync(&priv->ts_work);
+		cancel_delayed_work_sync(&priv->load_work);
+	}
+
+	mutex_lock(&priv->rx_lock);
+	udt1cri_usb_stop_rx(priv);
+	mutex_unlock(&priv->rx_lock);
+	usb_kill_anchored_urbs(&priv->tx_submitted);
+
+	if (netif_running(netdev))
+		udt1cri_usb_flush_confirm(priv, false);
+
+	return 0;
+}
+
+static int udt1cri_usb_do_resume(struct udt1cri_priv *priv, bool reset)
+{
+	struct net_device *netdev = priv->netdev;
+	unsigned long flags;
+	int err = 0;
+
+	priv->xstats.pm_resumes++;
+
+	mutex_lock(&priv->rx_lock);
+	if (priv->rx_users) {
+		priv->resume_time = ktime_get();
+		priv->resume_pending = true;
+
+		err = udt1cri_usb_start_rx(priv);
+	}
+	mutex_unlock(&priv->rx_lock);
+
+	/* Device timestamps may have restarted from zero */
+	spin_lock_irqsave(&priv->tc_lock, flags);
+	priv->tc_valid = false;
+	spin_unlock_irqrestore(&priv->tc_lock, flags);
+
+	/* A runtime resume finds the device as it was left */
+	if (!err && (reset || priv->config_lost)) {
+		priv->config_lost = false;
+		priv->can_speed_check = netif_running(netdev);
+		udt1cri_usb_apply_config(priv);
+	}
+
+	if (!netif_running(netdev))
+		return err;
+
+	/* Without RX, the interface can at least be closed and opened again */
+	netif_device_attach(netdev);
+	if (err)
+		return err;
+
+	schedule_delayed_work(&priv->ts_work, UDT1CRI_TS_WORK_PERIOD);
+	schedule_delayed_work(&priv->tx_confirm_work,
+			      UDT1CRI_TX_CONFIRM_TIMEOUT / 4);
+	/* Rates are measured again from the resume */
+	priv->load_pos = 0;
+	priv->load_cnt = 0;
+	schedule_delayed_work(&priv->load_work, 0);
+	udt1cri_usb_periodic_start(priv);
+
+	return 0;
+}
 
-	udt1cri_urb_unlink(priv);
+static int udt1cri_usb_resume(struct usb_interface *intf)
+{
+	return udt1cri_usb_do_resume(usb_get_intfdata(intf), false);
+}
+
+static int udt1cri_usb_reset_resume(struct usb_interface *intf)
+{
+	return udt1cri_usb_do_resume(usb_get_intfdata(intf), true);
 }
 
 static struct usb_driver udt1cri_usb_driver = {
 	.name = UDT1CRI_MODULE_NAME,
 	.probe = udt1cri_usb_probe,
 	.disconnect = udt1cri_usb_disconnect,
+	.suspend = udt1cri_usb_suspend,
+	.resume = udt1cri_usb_resume,
+	.reset_resume = udt1cri_usb_reset_resume,
 	.id_table = udt1cri_usb_table,
+	.supports_autosuspend = 1,
 };
 
-module_usb_driver(udt1cri_usb_driver);
+static int __init udt1cri_usb_init(void)
+{
+	int err;
+
+	udt1cri_debugfs_root = debugfs_create_dir(UDT1CRI_MODULE_NAME, NULL);
+
+	err = usb_register(&udt1cri_usb_driver);
+	if (err)
+		debugfs_remove_recursive(udt1cri_debugfs_root);
+
+	return err;
+}
+
+static void __exit udt1cri_usb_exit(void)
+{
+	usb_deregister(&udt1cri_usb_driver);
+	debugfs_remove_recursive(udt1cri_debugfs_root);
+}
+
+module_init(udt1cri_usb_init);
+module_exit(udt1cri_usb_exit);
 
 MODULE_AUTHOR("Remigiusz Kołłątaj <remigiusz.kollataj@mobica.com>");
 MODULE_DESCRIPTION("SocketCAN driver for UniSwarm UDT1CRI CAN debugger");